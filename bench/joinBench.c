@@ -0,0 +1,299 @@
+// Copyright (c) 2025 Sean Bremner
+// Licensed under the MIT License. See LICENSE file for details.
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "../src/microbus.h"
+#include "../src/master.h"
+#include "../src/node.h"
+#include "../src/networkManager.h"
+
+#include "../test/testSupport.h"
+
+// =============================================================== //
+//                  Join storm and churn benchmark
+//
+// Runs the simulated bus from testSupport with every node that is on
+// the network keeping its tx buffer full of data for the master, and
+// prints one CSV line per run (the header is the first line):
+//
+//   simultaneous - every node powers up at once (a full bus power cycle)
+//   staggered    - the nodes power up STAGGER_FRAMES apart
+//   churn        - on a full network nodes randomly drop off for a while,
+//                  half of them coming back power cycled
+//
+// full_frames/full_us  - first power up (or the end of the churn) until every node is on
+// join_frames_*        - from a node powering up / coming back until it is on
+// join_requests        - new node requests and rejoin claims sent by the nodes
+// throughput_lost_pct  - node data delivered while joining (or churning) against
+//                        the steady state of the full network over the same bus time
+//
+// Usage: JoinBench [seed]
+// =============================================================== //
+
+#define STAGGER_FRAMES 20
+#define STEADY_FRAMES 2000
+#define CHURN_FRAMES 20000
+#define CHURN_EVENT_FRAMES 200 // A node drops off this often on average
+#define CHURN_MAX_OFF_FRAMES 2000
+#define MAX_JOIN_FRAMES 100000
+#define NOT_WAITING 0xFFFFFFFF
+
+FILE * logfile;
+bool loggingEnabled = false;
+uint64_t cycleIndex = 0;
+uint64_t wCycleIndex = 0;
+
+// Don't spin forever like the default if the protocol asserts
+void assertMessage(const char * msg, size_t msgLen) {
+    fprintf(stderr, "Assert: %.*s\n", (int)msgLen, msg);
+    abort();
+}
+
+typedef struct {
+    bool singleChannel;
+    uint32_t numNodes;
+    tMaster * master;
+    tNode * nodes[MAX_NODES];    // Indexed from 1 like the tests
+    uint64_t uniqueId[MAX_NODES];
+    bool off[MAX_NODES];         // Passed to run() as ignoreNodes
+    uint32_t offFrames[MAX_NODES];
+    uint32_t waitingSince[MAX_NODES]; // Frame it powered up or came back - until it's on the network
+    uint32_t frame;
+    uint64_t rxBytes;            // Node data delivered to the master
+    // Results
+    uint32_t joins;
+    uint64_t joinFramesTotal;
+    uint32_t joinFramesMax;
+    uint32_t joinRequests;       // From nodes that have been power cycled
+} tBench;
+
+static bool isOnNetwork(tNode * node) {
+    return (node->nodeId != UNALLOCATED_NODE_ID) && (node->timeToLive > 0);
+}
+
+static uint32_t numJoinRequests(tBench * bench) {
+    uint32_t num = bench->joinRequests;
+    for (uint32_t i=1; i<bench->numNodes+1; i++) {
+        num += bench->nodes[i]->stats.newNodeRequest + bench->nodes[i]->stats.nodeRejoinRequest;
+    }
+    return num;
+}
+
+static void benchInit(tBench * bench, uint32_t numNodes, bool singleChannel) {
+    memset(bench, 0, sizeof(tBench));
+    bench->singleChannel = singleChannel;
+    bench->numNodes = numNodes;
+    bench->master = createMaster(10, 10, singleChannel);
+    for (uint32_t i=1; i<numNodes+1; i++) {
+        bench->nodes[i] = createNode(5, 4, 0);
+        bench->uniqueId[i] = bench->nodes[i]->uniqueId;
+        bench->off[i] = true;
+        bench->waitingSince[i] = NOT_WAITING;
+    }
+}
+
+static void benchFree(tBench * bench) {
+    for (uint32_t i=1; i<bench->numNodes+1; i++) {
+        freeNode(bench->nodes[i]);
+    }
+    freeMaster(bench->master);
+}
+
+static void resetResults(tBench * bench) {
+    bench->rxBytes = 0;
+    bench->joins = 0;
+    bench->joinFramesTotal = 0;
+    bench->joinFramesMax = 0;
+    bench->joinRequests = 0;
+    for (uint32_t i=1; i<bench->numNodes+1; i++) {
+        bench->nodes[i]->stats.newNodeRequest = 0;
+        bench->nodes[i]->stats.nodeRejoinRequest = 0;
+    }
+    bench->master->stats.newNodeRequestCollisions = 0;
+}
+
+static void powerUp(tBench * bench, uint32_t i, bool powerCycle) {
+    if (powerCycle) {
+        bench->joinRequests += bench->nodes[i]->stats.newNodeRequest + bench->nodes[i]->stats.nodeRejoinRequest;
+        freeNode(bench->nodes[i]);
+        bench->nodes[i] = createNode(5, 4, bench->uniqueId[i]);
+    }
+    bench->off[i] = false;
+    // Only timed the nodes that have actually lost their place
+    if (!isOnNetwork(bench->nodes[i])) {
+        bench->waitingSince[i] = bench->frame;
+    }
+}
+
+// Keep every node on the network busy and count what the master gets
+static void step(tBench * bench) {
+    for (uint32_t i=1; i<bench->numNodes+1; i++) {
+        tNode * node = bench->nodes[i];
+        if (bench->off[i] || !isOnNetwork(node)) {
+            continue;
+        }
+        uint8_t * txData;
+        while ((txData = nodeAllocateTxPacket(node)) != NULL) {
+            memset(txData, i, NODE_PACKET_DATA_SIZE);
+            nodeSubmitAllocatedTxPacket(node, MASTER_NODE_ID, NODE_PACKET_DATA_SIZE);
+        }
+    }
+
+    run(bench->master, &bench->nodes[1], &bench->off[1], bench->numNodes, 1, true, bench->singleChannel);
+    bench->frame++;
+
+    uint16_t size;
+    tNodeIndex srcNodeId;
+    bool datagram;
+    while (masterPeekNextRxDataPacket(bench->master, &size, &srcNodeId, &datagram) != NULL) {
+        bench->rxBytes += size;
+        masterPopNextDataPacket(bench->master);
+    }
+
+    for (uint32_t i=1; i<bench->numNodes+1; i++) {
+        if (bench->waitingSince[i] != NOT_WAITING && isOnNetwork(bench->nodes[i])) {
+            uint32_t joinFrames = bench->frame - bench->waitingSince[i];
+            bench->joins++;
+            bench->joinFramesTotal += joinFrames;
+            bench->joinFramesMax = MAX(bench->joinFramesMax, joinFrames);
+            bench->waitingSince[i] = NOT_WAITING;
+        }
+    }
+}
+
+static bool allOnNetwork(tBench * bench) {
+    for (uint32_t i=1; i<bench->numNodes+1; i++) {
+        if (bench->off[i] || !isOnNetwork(bench->nodes[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Node data bytes per us once everyone is on
+static double measureSteadyRate(tBench * bench) {
+    uint64_t rxBytes = bench->rxBytes;
+    uint64_t startTimeUs = simulatedTimeUs;
+    for (uint32_t j=0; j<STEADY_FRAMES; j++) {
+        step(bench);
+    }
+    return (double)(bench->rxBytes - rxBytes) / (double)(simulatedTimeUs - startTimeUs);
+}
+
+static double throughputLost(uint64_t rxBytes, uint64_t timeUs, double steadyRate) {
+    if (timeUs == 0 || steadyRate == 0) {
+        return 0;
+    }
+    return 100.0 * (1.0 - ((double)rxBytes / (steadyRate * (double)timeUs)));
+}
+
+static void printResult(const char * scenario, tBench * bench, uint32_t fullFrames, uint64_t fullUs, uint32_t joinRequests, double lostPct) {
+    printf("%s,%s,%u,%u,%llu,%u,%.1f,%u,%u,%.2f,%u,%.1f\n",
+        scenario,
+        bench->singleChannel ? "single" : "dual",
+        bench->numNodes,
+        fullFrames,
+        (unsigned long long)fullUs,
+        bench->joins,
+        bench->joins ? (double)bench->joinFramesTotal / bench->joins : 0.0,
+        bench->joinFramesMax,
+        joinRequests,
+        bench->joins ? (double)joinRequests / bench->joins : 0.0,
+        bench->master->stats.newNodeRequestCollisions,
+        lostPct);
+}
+
+// Returns the number of frames it took
+static uint32_t runUntilFull(tBench * bench, uint32_t staggerFrames) {
+    uint32_t startFrame = bench->frame;
+    uint32_t numPoweredUp = 0;
+    while (!allOnNetwork(bench)) {
+        while (numPoweredUp < bench->numNodes && bench->frame - startFrame >= numPoweredUp * staggerFrames) {
+            numPoweredUp++;
+            powerUp(bench, numPoweredUp, false);
+        }
+        step(bench);
+        if (bench->frame - startFrame > MAX_JOIN_FRAMES) {
+            fprintf(stderr, "Network never filled up - %s, numNodes: %u\n", bench->singleChannel ? "single" : "dual", bench->numNodes);
+            exit(1);
+        }
+    }
+    return bench->frame - startFrame;
+}
+
+static void benchPowerUp(const char * scenario, uint32_t numNodes, bool singleChannel, uint32_t staggerFrames) {
+    tBench bench;
+    benchInit(&bench, numNodes, singleChannel);
+    uint64_t startTimeUs = simulatedTimeUs;
+    uint32_t fullFrames = runUntilFull(&bench, staggerFrames);
+    uint64_t fullUs = simulatedTimeUs - startTimeUs;
+    uint64_t joinRxBytes = bench.rxBytes;
+    uint32_t joinRequests = numJoinRequests(&bench);
+
+    double steadyRate = measureSteadyRate(&bench);
+    printResult(scenario, &bench, fullFrames, fullUs, joinRequests, throughputLost(joinRxBytes, fullUs, steadyRate));
+    benchFree(&bench);
+}
+
+static void benchChurn(uint32_t numNodes, bool singleChannel) {
+    tBench bench;
+    benchInit(&bench, numNodes, singleChannel);
+    runUntilFull(&bench, 0);
+    double steadyRate = measureSteadyRate(&bench);
+    resetResults(&bench);
+
+    uint64_t startTimeUs = simulatedTimeUs;
+    for (uint32_t j=0; j<CHURN_FRAMES; j++) {
+        if (rand() % CHURN_EVENT_FRAMES == 0) {
+            uint32_t i = 1 + (rand() % numNodes);
+            if (!bench.off[i]) {
+                bench.off[i] = true;
+                bench.offFrames[i] = 1 + (rand() % CHURN_MAX_OFF_FRAMES);
+            }
+        }
+        for (uint32_t i=1; i<numNodes+1; i++) {
+            if (bench.off[i] && --bench.offFrames[i] == 0) {
+                // A node resuming mid-slot could talk over the master on a single channel so those are always power cycled
+                powerUp(&bench, i, singleChannel || (rand() & 1));
+            }
+        }
+        step(&bench);
+    }
+    uint64_t churnRxBytes = bench.rxBytes;
+    uint64_t churnUs = simulatedTimeUs - startTimeUs;
+
+    // Bring back anything still off and wait for the network to fill up again
+    for (uint32_t i=1; i<numNodes+1; i++) {
+        if (bench.off[i]) {
+            powerUp(&bench, i, false);
+        }
+    }
+    startTimeUs = simulatedTimeUs;
+    uint32_t fullFrames = runUntilFull(&bench, 0);
+    uint64_t fullUs = simulatedTimeUs - startTimeUs;
+
+    printResult("churn", &bench, fullFrames, fullUs, numJoinRequests(&bench), throughputLost(churnRxBytes, churnUs, steadyRate));
+    benchFree(&bench);
+}
+
+int main(int argc, char * argv[]) {
+    static const uint32_t numNodesList[] = {1, 2, 4, 8, 16, 32, 48, MAX_NODES - FIRST_NODE_ID};
+    uint32_t seed = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : 1;
+
+    printf("scenario,channel,nodes,full_frames,full_us,joins,join_frames_mean,join_frames_max,join_requests,requests_per_join,collisions,throughput_lost_pct\n");
+    for (uint32_t c=0; c<2; c++) {
+        bool singleChannel = (c == 1);
+        for (uint32_t n=0; n<sizeof(numNodesList)/sizeof(numNodesList[0]); n++) {
+            srand(seed);
+            benchPowerUp("simultaneous", numNodesList[n], singleChannel, 0);
+            srand(seed);
+            benchPowerUp("staggered", numNodesList[n], singleChannel, STAGGER_FRAMES);
+            srand(seed);
+            benchChurn(numNodesList[n], singleChannel);
+        }
+    }
+    return 0;
+}
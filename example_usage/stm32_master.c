@@ -23,6 +23,17 @@ Hardware setup:
 
 #define RESET_SPI_COUNT 50
 
+// The SPI interrupt, the timer and the user thread all update the node queues
+uint32_t microbusEnterCritical(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+void microbusExitCritical(uint32_t state) {
+    __set_PRIMASK(state);
+}
+
 typedef struct {
     tMaster * master;
     SPI_HandleTypeDef *hspi;
@@ -76,7 +87,8 @@ void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
     // Get our next data ptrs to use
     tPacket * masterTxPacket = NULL;
     tPacket * masterRxPacket = NULL;
-    masterDualChannelPipelinedPreProcess(spiMaster.master, &masterTxPacket, &masterRxPacket, crcError);
+    uint16_t masterTxSize = masterDualChannelPipelinedPreProcess(spiMaster.master, &masterTxPacket, &masterRxPacket, crcError);
+    (void) masterTxSize;
 
     // Wait to give nodes a chance to start their TxRx DMAs
     delayUs(spiMaster.usTimer, 40); // TODO- check
@@ -91,6 +103,8 @@ void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
     }
 
     // Start transaction
+    // Note: Always clocks a full packet - the node's reply can be longer than masterTxSize
+    // so variable length slots would need the node's header first
     __HAL_SPI_CLEAR_CRCERRFLAG(hspi);
     volatile int res = HAL_SPI_TransmitReceive_DMA(hspi, (uint8_t *) masterTxPacket, (uint8_t *) masterRxPacket, (MB_PACKET_SIZE-1)/2);
     myAssert(res == HAL_OK, "SPI TxRx failed");
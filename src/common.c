@@ -22,20 +22,87 @@ void __attribute__((weak)) assertMessage(const char * msg, size_t msgLen) {
     while(1) {};
 }
 
-// Sometimes called by independent thread!
-bool nodeQueueAdd(tNodeQueue * queue, tNodeIndex nodeId) {
-    if (queue->numNodes < MAX_NODES) {
-    	// If already exists then leave
-        for (uint32_t i=0; i<queue->numNodes; i++) {
-            // microbusAssert(queue->nodeIds[i] != nodeId, "");
-            if (queue->nodeIds[i] == nodeId) {
-            	return true;
-            }
-        }
+// Read-modify-writes of state the interrupt and the user/timer threads both update (e.g. the node
+// queue bitmaps) are done between these - override them for the target (on a Cortex-M save
+// PRIMASK and __disable_irq(), then restore it) as the default does nothing
+uint32_t __attribute__((weak)) microbusEnterCritical(void) {
+    return 0;
+}
+
+void __attribute__((weak)) microbusExitCritical(uint32_t state) {
+    (void)state;
+}
+
+// ==================================================================== //
+// Packet store
+// The free entries are kept in a ring of entry indices (stored in the entries'
+// freeSlot byte) so allocating and freeing are both O(1). Allocating only moves
+// the allocIndex and freeing only moves the freeIndex so they can be called from
+// different threads (i.e. allocate on the user thread and free from the interrupt)
+
+void packetStoreInit(tPacketStore * store, uint8_t maxEntries, tPacketEntry entries[]) {
+    microbusAssert(maxEntries < NULL_PACKET_ENTRY_INDEX, "");
+    memset(store, 0, sizeof(tPacketStore));
+    store->entries = entries;
+    store->maxEntries = maxEntries;
+    // Start with every entry free
+    for (uint8_t i=0; i<maxEntries; i++) {
+        entries[i].inUse = false;
+        entries[i].nextIndex = NULL_PACKET_ENTRY_INDEX;
+        entries[i].freeSlot = i;
+    }
+}
+
+uint8_t packetStoreNumFree(tPacketStore * store) {
+    return store->maxEntries - (store->numStored - store->numFreed);
+}
+
+tPacketEntry * packetStoreAllocate(tPacketStore * store) {
+    if (packetStoreNumFree(store) == 0) {
+        return NULL;
+    }
+    tPacketEntry * entry = &store->entries[store->entries[store->allocIndex].freeSlot];
+    microbusAssert(!entry->inUse, "");
+    entry->inUse = true;
+    store->allocIndex = INCR_AND_WRAP(store->allocIndex, 1, store->maxEntries);
+    // Do this at the end so the freeing thread never sees the slot before it's been read
+    store->numStored++;
+    return entry;
+}
+
+void packetStoreFree(tPacketStore * store, tPacketEntry * entry) {
+    microbusAssert(entry->inUse, "");
+    entry->inUse = false;
+    store->entries[store->freeIndex].freeSlot = entry - store->entries;
+    store->freeIndex = INCR_AND_WRAP(store->freeIndex, 1, store->maxEntries);
+    // Do this at the end so the allocating thread never sees the slot before it's written
+    store->numFreed++;
+}
+
+// ==================================================================== //
+// Node queue
+
+// Every operation is O(1) - the next member is found with a count trailing zeros
+
+// First member at or after nodeId - wrapping round to the start
+static tNodeIndex firstMemberFrom(uint64_t bitmap, uint32_t nodeId) {
+    uint64_t later = (nodeId < 64) ? (bitmap & (~((uint64_t)0) << nodeId)) : 0;
+    return __builtin_ctzll(later ? later : bitmap);
+}
 
-        queue->nodeIds[queue->numNodes] = nodeId;
-        // Do this at the end and atomically to cope with the other thread cutting in
-        queue->numNodes++;
+void nodeQueueInit(tNodeQueue * queue) {
+    queue->bitmap = 0;
+    queue->numNodes = 0;
+    queue->nextNode = 0;
+}
+
+// Sometimes called by independent thread! - the 64 bit bitmap update isn't atomic on a 32 bit MCU
+bool nodeQueueAdd(tNodeQueue * queue, tNodeIndex nodeId) {
+    if (nodeId < MAX_NODES) {
+        uint32_t state = microbusEnterCritical();
+        queue->bitmap |= NODE_BIT(nodeId);
+        queue->numNodes = __builtin_popcountll(queue->bitmap);
+        microbusExitCritical(state);
         return true;
     } else {
         microbusAssert(0, "");
@@ -43,51 +110,74 @@ bool nodeQueueAdd(tNodeQueue * queue, tNodeIndex nodeId) {
     }
 }
 
+bool nodeQueueContains(tNodeQueue * queue, tNodeIndex nodeId) {
+    return (nodeId < MAX_NODES) && (queue->bitmap & NODE_BIT(nodeId));
+}
+
 void nodeQueueRemoveIfExists(tNodeQueue * queue, tNodeIndex nodeId) {
-    if (queue->numNodes > 0) {
-        for (uint8_t i=0; i<queue->numNodes; i++) {
-            if (queue->nodeIds[i] == nodeId) {
-                // Shift all entries down by 1
-                for (uint8_t j=i; j<queue->numNodes-1; j++) {
-                    queue->nodeIds[j] = queue->nodeIds[j+1];
-                }
-                queue->numNodes--;
-                if (queue->lastIndex >= queue->numNodes) {
-                    queue->lastIndex = 0;
-                }
-                break;
-            }
-        }
+    if (nodeQueueContains(queue, nodeId)) {
+        uint32_t state = microbusEnterCritical();
+        queue->bitmap &= ~NODE_BIT(nodeId);
+        queue->numNodes = __builtin_popcountll(queue->bitmap);
+        microbusExitCritical(state);
     }
 }
 
 void nodeQueueRemove(tNodeQueue * queue, tNodeIndex nodeId) {
-    uint32_t prevNum = queue->numNodes;
-    microbusAssert(queue->numNodes > 0, "");
+    microbusAssert(nodeQueueContains(queue, nodeId), "");
     nodeQueueRemoveIfExists(queue, nodeId);
-    microbusAssert(prevNum == queue->numNodes + 1, "");
 }
 
+// True if the next node returned by getNextNodeInQueue is the last one before wrapping
 bool queueReachedEnd(tNodeQueue * queue) {
-    return ((queue->lastIndex + 1) >= queue->numNodes);
+    if (queue->bitmap == 0) {
+        return true;
+    }
+    tNodeIndex node = firstMemberFrom(queue->bitmap, queue->nextNode);
+    return ((queue->bitmap >> node) >> 1) == 0;
 }
 
+// The member after nodeId (wrapping) - nodeId doesn't need to be a member
+tNodeIndex nodeQueueNextAfter(tNodeQueue * queue, tNodeIndex nodeId) {
+    uint64_t bitmap = queue->bitmap;
+    if (bitmap == 0) {
+        return INVALID_NODE_ID;
+    }
+    return firstMemberFrom(bitmap, (uint32_t)nodeId + 1);
+}
+
+// Round robin - every node is returned once before any is returned again
+// (nodes added part way round are picked up when their id is reached)
 tNodeIndex getNextNodeInQueue(tNodeQueue * queue) {
-    tNodeIndex node = queue->nodeIds[queue->lastIndex];
-    queue->lastIndex++;
-    if (queue->lastIndex >= queue->numNodes) {
-        queue->lastIndex = 0;
+    uint64_t bitmap = queue->bitmap;
+    if (bitmap == 0) {
+        microbusAssert(0, "");
+        return INVALID_NODE_ID;
     }
+    tNodeIndex node = firstMemberFrom(bitmap, queue->nextNode);
+    queue->nextNode = node + 1;
     return node;
 }
 
+// How many bytes of the packet need to go over the bus (0 if there is no packet)
+uint16_t microbusPacketTransferSize(tPacket * packet) {
+    if (packet == NULL) {
+        return 0;
+    }
+    if (!MICROBUS_VARIABLE_LENGTH_SLOTS) {
+        return MB_PACKET_SIZE;
+    }
+    uint16_t size = GET_PACKET_DATA_SIZE(packet);
+    return MIN(MB_HEADER_SIZE + size, MB_PACKET_SIZE);
+}
+
 void microbusPrintPacket(tPacket * packet, bool master, uint32_t nodeId, bool tx, uint8_t numScheduled) {
     if (packet == NULL) {
         return;
     }
     uint16_t size = GET_PACKET_DATA_SIZE(packet);
     if (MICROBUS_LOG_EMPTY_PACKETS || size > 0) {
-        microbusAssert(size < MAX_PACKET_DATA_SIZE, "");
+        microbusAssert(size <= MAX_PACKET_DATA_SIZE, "");
         if (master) {
             MB_PRINTF("Master, %s packet:%u, size:%u, txSeqNum:%u", 
                 tx ? "Tx" : "Rx", 
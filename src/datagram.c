@@ -0,0 +1,159 @@
+// Copyright (c) 2025 Sean Bremner
+// Licensed under the MIT License. See LICENSE file for details.
+
+#include "string.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+#include "microbus.h"
+#include "datagram.h"
+
+// =============================================================== //
+//                        Datagrams
+//
+// For data where only the newest value matters (e.g. telemetry).
+// Datagrams bypass the tx manager completely - they have no sequence
+// number, are never acked and are never resent. If a datagram is lost
+// the next one replaces it.
+//
+// Latest value wins - when a new datagram is submitted for a destination
+// any older one that hasn't been sent yet is dropped.
+//
+// Like the tx manager the user thread only allocates and the interrupt
+// only frees. Submitted entries are passed over in a ring and from then on
+// only the interrupt touches them, so the interrupt can drop the older ones.
+//
+// =============================================================== //
+
+#define DATAGRAM_ENTRY_INDEX(store, packet) (PACKET_ENTRY_FROM_PACKET(packet) - (store)->packetStore.entries)
+
+static void datagramFreeEntry(tDatagramStore * store, uint8_t index) {
+    if (index != NULL_PACKET_ENTRY_INDEX) {
+        packetStoreFree(&store->packetStore, &store->packetStore.entries[index]);
+    }
+}
+
+// Pick up anything the user thread has submitted - dropping anything it replaces
+static void datagramTakeSubmitted(tDatagramStore * store, uint32_t * statsNumReplaced) {
+    while (store->numTaken != store->numSubmitted) {
+        uint8_t slot = store->numTaken % MAX_DATAGRAM_ENTRIES;
+        uint8_t index = store->submitEntry[slot];
+        tNodeIndex dstNodeId = store->submitDstNodeId[slot];
+        if (store->latestEntry[dstNodeId] != NULL_PACKET_ENTRY_INDEX) {
+            datagramFreeEntry(store, store->latestEntry[dstNodeId]);
+            (*statsNumReplaced)++;
+        }
+        store->latestEntry[dstNodeId] = index;
+        nodeQueueAdd(&store->pendingNodes, dstNodeId);
+        store->numTaken++;
+    }
+}
+
+// =============================================================== //
+// User thread
+
+tPacket * datagramAllocate(tDatagramStore * store) {
+    if (store->allocatedPacket != NULL) {
+        microbusAssert(0, ""); // "Allocated datagram must be submitted before the next allocation"
+        return NULL;
+    }
+    tPacketEntry * entry = store->unsubmittedEntry;
+    store->unsubmittedEntry = NULL;
+    if (entry == NULL) {
+        entry = packetStoreAllocate(&store->packetStore);
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    store->allocatedPacket = &entry->packet;
+    return store->allocatedPacket;
+}
+
+// The caller fills in the packet header first
+void datagramSubmitAllocated(tDatagramStore * store, tNodeIndex dstNodeId) {
+    microbusAssert(store->allocatedPacket != NULL && dstNodeId < MAX_NODES, "");
+    uint8_t slot = store->numSubmitted % MAX_DATAGRAM_ENTRIES;
+    store->submitEntry[slot] = DATAGRAM_ENTRY_INDEX(store, store->allocatedPacket);
+    store->submitDstNodeId[slot] = dstNodeId;
+    store->allocatedPacket = NULL;
+    // Do this at the end so the interrupt never sees the slot before it's written
+    store->numSubmitted++;
+}
+
+// Only the interrupt frees so hold on to it for the next allocation
+void datagramDropAllocated(tDatagramStore * store) {
+    microbusAssert(store->allocatedPacket != NULL, "");
+    store->unsubmittedEntry = PACKET_ENTRY_FROM_PACKET(store->allocatedPacket);
+    store->allocatedPacket = NULL;
+}
+
+// =============================================================== //
+// Interrupt
+
+// Round robin over the destinations with a datagram waiting
+tPacket * datagramGetNextTxPacket(tDatagramStore * store, uint32_t * statsNumReplaced) {
+    microbusAssert(store->txEntry == NULL_PACKET_ENTRY_INDEX, "");
+    datagramTakeSubmitted(store, statsNumReplaced);
+    if (store->pendingNodes.numNodes == 0) {
+        return NULL;
+    }
+    tNodeIndex dstNodeId = getNextNodeInQueue(&store->pendingNodes);
+    nodeQueueRemove(&store->pendingNodes, dstNodeId);
+    store->txEntry = store->latestEntry[dstNodeId];
+    store->txDstNodeId = dstNodeId;
+    store->latestEntry[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
+    return &store->packetStore.entries[store->txEntry].packet;
+}
+
+// A datagram that is still waiting for a tx slot is swapped for a newer one
+tPacket * datagramRefreshTxPacket(tDatagramStore * store, uint32_t * statsNumReplaced) {
+    microbusAssert(store->txEntry != NULL_PACKET_ENTRY_INDEX, "");
+    datagramTakeSubmitted(store, statsNumReplaced);
+    tNodeIndex dstNodeId = store->txDstNodeId;
+    if (store->latestEntry[dstNodeId] != NULL_PACKET_ENTRY_INDEX) {
+        datagramFreeEntry(store, store->txEntry);
+        (*statsNumReplaced)++;
+        store->txEntry = store->latestEntry[dstNodeId];
+        store->latestEntry[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
+        nodeQueueRemove(&store->pendingNodes, dstNodeId);
+    }
+    return &store->packetStore.entries[store->txEntry].packet;
+}
+
+// Called with every packet that goes out (datagram or not)
+// The packet memory is DMA'd after this so keep it for another couple of packets
+void datagramRecordTx(tDatagramStore * store, tPacket * txPacket) {
+    datagramFreeEntry(store, store->sentEntry[1]);
+    store->sentEntry[1] = store->sentEntry[0];
+    store->sentEntry[0] = NULL_PACKET_ENTRY_INDEX;
+    if (store->txEntry != NULL_PACKET_ENTRY_INDEX && txPacket == &store->packetStore.entries[store->txEntry].packet) {
+        store->sentEntry[0] = store->txEntry;
+        store->txEntry = NULL_PACKET_ENTRY_INDEX;
+    }
+}
+
+// Anything submitted that hasn't been given to the tx yet
+bool datagramIsWaiting(tDatagramStore * store) {
+    return (store->numTaken != store->numSubmitted) || (store->pendingNodes.numNodes > 0);
+}
+
+// Drop anything waiting for a node that has left the network
+void datagramRemoveNode(tDatagramStore * store, tNodeIndex nodeId, uint32_t * statsNumReplaced) {
+    datagramTakeSubmitted(store, statsNumReplaced);
+    if (store->latestEntry[nodeId] != NULL_PACKET_ENTRY_INDEX) {
+        datagramFreeEntry(store, store->latestEntry[nodeId]);
+        store->latestEntry[nodeId] = NULL_PACKET_ENTRY_INDEX;
+        nodeQueueRemove(&store->pendingNodes, nodeId);
+    }
+}
+
+void datagramStoreInit(tDatagramStore * store, uint8_t maxEntries, tPacketEntry entries[]) {
+    microbusAssert(maxEntries <= MAX_DATAGRAM_ENTRIES, "");
+    memset(store, 0, sizeof(tDatagramStore));
+    packetStoreInit(&store->packetStore, maxEntries, entries);
+    memset(store->latestEntry, NULL_PACKET_ENTRY_INDEX, sizeof(store->latestEntry));
+    nodeQueueInit(&store->pendingNodes);
+    store->txEntry = NULL_PACKET_ENTRY_INDEX;
+    store->sentEntry[0] = NULL_PACKET_ENTRY_INDEX;
+    store->sentEntry[1] = NULL_PACKET_ENTRY_INDEX;
+}
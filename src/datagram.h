@@ -0,0 +1,48 @@
+// Copyright (c) 2025 Sean Bremner
+// Licensed under the MIT License. See LICENSE file for details.
+
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include "string.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "microbus.h"
+
+#define MAX_DATAGRAM_ENTRIES 16 // Must divide 256 (the submit ring counters wrap at 256)
+
+// Unreliable datagrams - no sequence numbers, acks or retransmissions.
+// Only the newest unsent datagram for each destination is kept.
+typedef struct {
+    tPacketStore packetStore; // Allocated by the user thread, freed by the interrupt
+    tPacket * allocatedPacket;       // Only used by the user thread
+    tPacketEntry * unsubmittedEntry; // Allocated but dropped by the submit - re-used by the next allocate
+    // Submitted entries the interrupt hasn't picked up yet
+    // The user thread only writes numSubmitted and the interrupt only writes numTaken
+    uint8_t submitEntry[MAX_DATAGRAM_ENTRIES];
+    tNodeIndex submitDstNodeId[MAX_DATAGRAM_ENTRIES];
+    uint8_t numSubmitted;
+    uint8_t numTaken;
+    // Everything below is only used by the interrupt
+    uint8_t latestEntry[MAX_NODES]; // Newest unsent datagram per destination
+    tNodeQueue pendingNodes;        // Destinations with a latestEntry
+    uint8_t txEntry;                // Given to the tx but not sent yet
+    tNodeIndex txDstNodeId;
+    uint8_t sentEntry[2];           // Kept until the DMA has finished with them
+} tDatagramStore;
+
+// Called by the user thread
+tPacket * datagramAllocate(tDatagramStore * store);
+void datagramSubmitAllocated(tDatagramStore * store, tNodeIndex dstNodeId);
+void datagramDropAllocated(tDatagramStore * store);
+
+// Called by the interrupt
+tPacket * datagramGetNextTxPacket(tDatagramStore * store, uint32_t * statsNumReplaced);
+tPacket * datagramRefreshTxPacket(tDatagramStore * store, uint32_t * statsNumReplaced);
+void datagramRecordTx(tDatagramStore * store, tPacket * txPacket);
+bool datagramIsWaiting(tDatagramStore * store);
+void datagramRemoveNode(tDatagramStore * store, tNodeIndex nodeId, uint32_t * statsNumReplaced);
+
+void datagramStoreInit(tDatagramStore * store, uint8_t maxEntries, tPacketEntry entries[]);
+
+#endif
@@ -35,19 +35,53 @@ static void masterUpdateSchedule(tMaster * master) {
 
 // ========================================= //
 
+// Flow control - advertise how much room is left in the rx buffer. The nodes take one off for every node
+// slot after this is worked out (see nodeUpdateSchedule) as those packets are already on their way.
+// One entry is kept back - every node packet needs one to be received, even an empty one with only acks
+static void masterUpdateRxCredits(tMaster * master) {
+    if (master->tx.txManager.txCredits == NULL) {
+        return;
+    }
+    uint8_t numFree = rxManagerNumFreeEntries(&master->rx.rxPacketManager);
+    master->tx.rxCredits = (numFree > 0) ? MIN(numFree - 1, RX_CREDITS_UNLIMITED - 1) : 0;
+    schedulerSetMasterRxCredits(&master->scheduler, master->tx.rxCredits);
+}
+
+// Quick process the rx packet and if it had new data from a node then it will need an ack
+static void masterQuickProcessPrevRxAndRecordAck(tMaster * master, bool crcError) {
+    masterQuickProcessPrevRx(&master->rx, &master->nwManager, &master->tx.txManager, master->masterNodeTimeToLive, crcError);
+    if (master->rx.validRxPacket && master->rx.validRxSeqNum) {
+        tPacket * rxPacket = &master->rx.prevRxPacketEntry->packet;
+        masterTxRecordAckPending(&master->tx, rxPacket->node.srcNodeId, PACKET_TX_PRIORITY(GET_PACKET_TYPE(rxPacket)));
+    }
+}
 
 // Returns numTxPacketsFreed
 static uint8_t masterRemoveAnyTimeoutNodes(tMaster * master) {
     uint8_t numTxPacketsFreed = 0;
-    for (uint32_t nodeId=FIRST_NODE_ID; nodeId<MAX_NODES; nodeId++) {
+    // Set by the timer - the 64 bit read isn't atomic on a 32 bit MCU
+    uint32_t state = microbusEnterCritical();
+    uint64_t timedOutNodes = master->nwManager.timedOutNodes;
+    microbusExitCritical(state);
+    while (timedOutNodes) {
+        tNodeIndex nodeId = __builtin_ctzll(timedOutNodes);
+        timedOutNodes &= timedOutNodes - 1;
         if (master->masterNodeTimeToLive[nodeId] == REMOVE_NODE_TTL) {
             master->masterNodeTimeToLive[nodeId] = 0;
+            networkManagerClearTimedOutNode(&master->nwManager, nodeId);
             // Clear all tx packets
             networkManagerRemoveNewNodeRequest(&master->nwManager, nodeId);
             nodeQueueRemoveIfExists(&master->activeNodes, nodeId);
-            nodeQueueRemoveIfExists(&master->nodeTxNodes, nodeId);
+            schedulerRemoveNode(&master->scheduler, nodeId);
+            nodeQueueRemoveIfExists(&master->tx.ackPendingNodes, nodeId);
+            nodeQueueRemoveIfExists(&master->tx.urgentAckPendingNodes, nodeId);
+            datagramRemoveNode(&master->tx.datagrams, nodeId, &master->stats.datagramsReplaced);
+            masterTxResetBurstSize(&master->tx, nodeId);
             masterTxManagerRemoveNode(&master->tx.txManager, nodeId, &numTxPacketsFreed);
             rxManagerRemoveAllPackets(&master->rx.rxPacketManager, nodeId);
+            // Held back for it so it can come straight back
+            networkManagerRemoveNode(&master->nwManager, nodeId);
+            NEW_NODE_HEARD_UPDATE_SCHEDULER(master->scheduler);
             MB_PRINTF("Master - Node:%u, removed from network\n", nodeId);
         }
     }
@@ -61,14 +95,17 @@ static uint8_t masterRemoveAnyTimeoutNodes(tMaster * master) {
 // being transmitted and received. 
 // This is for the main SPI link which needs to run as fast as possible
 
-void masterDualChannelPipelinedPreProcess(tMaster * master, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError) {
+// Returns the tx transfer size
+uint16_t masterDualChannelPipelinedPreProcess(tMaster * master, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError) {
     masterUpdateSchedule(master);
     // Quick validate rx packet and record the seq nums so we can ack them as soon as possible
-    masterQuickProcessPrevRx(&master->rx, &master->nwManager, &master->tx.txManager, master->masterNodeTimeToLive, crcError);
-    // Now fill in the updated schedule and the acks
+    masterQuickProcessPrevRxAndRecordAck(master, crcError);
+    // Now fill in the updated schedule, the acks and what we have room for
+    masterUpdateRxCredits(master);
     masterQuickUpdateTxPacket(&master->tx, &master->scheduler, master->nextTxNodeId);
     *txPacket = masterTxGetNextTxPacket(&master->tx);
     *rxPacketMemory = masterRxGetNextPacketMemory(&master->rx);
+    return microbusPacketTransferSize(*txPacket);
 }
 
 // Return numTxFreed
@@ -95,19 +132,23 @@ tPacket * masterGetRxPacketMemory(tMaster * master) {
 uint8_t masterNoDelaySingleChannelProcessRx(tMaster * master, bool crcError) {
     // masterProcessTx(&master->tx, &master->nwManager, &master->scheduler, master->nextTxNodeId);
     masterUpdateSchedule(master);
-    masterQuickProcessPrevRx(&master->rx, &master->nwManager, &master->tx.txManager, master->masterNodeTimeToLive, crcError);
+    masterQuickProcessPrevRxAndRecordAck(master, crcError);
     uint8_t numTxFreed = masterProcessRx(&master->rx, &master->nwManager, &master->scheduler, &master->tx.txManager, master->masterNodeTimeToLive);
-    // numTxFreed += masterRemoveAnyTimeoutNodes(master);
+    numTxFreed += master->timeoutTxFreed;
+    master->timeoutTxFreed = 0;
     return numTxFreed;
 }
 
-// return numTxFreed
-uint8_t masterNoDelaySingleChannelProcessTx(tMaster * master, tPacket ** txPacket) {
+// Returns the tx transfer size like the other pre-process calls - packets freed
+// by nodes timing out are returned by the next rx call
+uint16_t masterNoDelaySingleChannelProcessTx(tMaster * master, tPacket ** txPacket) {
     masterProcessTx(&master->tx, &master->nwManager, &master->scheduler, master->nextTxNodeId);
     masterUpdateSchedule(master);
+    masterUpdateRxCredits(master);
     masterQuickUpdateTxPacket(&master->tx, &master->scheduler, master->nextTxNodeId);
     *txPacket = masterTxGetNextTxPacket(&master->tx);
-    return masterRemoveAnyTimeoutNodes(master);
+    master->timeoutTxFreed += masterRemoveAnyTimeoutNodes(master);
+    return microbusPacketTransferSize(*txPacket);
 }
 
 // ========================================= //
@@ -129,9 +170,13 @@ void masterInit(
         tPacketEntry * rxPacketQueue[]) {
             
     memset(master, 0, sizeof(tMaster));
+    nodeQueueInit(&master->activeNodes);
+    nodeQueueInit(&master->nodeTxNodes);
+    nodeQueueInit(&master->activeTxNodes);
 
     networkManagerInit(&master->nwManager, &master->activeNodes);
-    schedulerInit(&master->scheduler, &master->activeNodes, &master->activeTxNodes, &master->nodeTxNodes, numTxNodesScheduled, 80);
+    schedulerInit(&master->scheduler, &master->activeNodes, &master->activeTxNodes, &master->nodeTxNodes, numTxNodesScheduled, 80, master->masterNodeTimeToLive, &master->stats);
+    schedulerSetRejoinNodes(&master->scheduler, &master->nwManager.rejoinNodes);
     masterRxInit(&master->rx, maxRxPacketEntries, rxPacketEntries, rxPacketQueue, &master->stats);
     masterTxInit(&master->tx, &master->stats, &master->activeTxNodes, maxTxPacketEntries, txPacketEntries);
 
@@ -139,6 +184,61 @@ void masterInit(
     master->tx.masterResetCycles = 20;
 }
 
+// Largest sliding window any node can negotiate - only affects nodes that join after this is called
+void masterSetMaxWindowSize(void * master, uint8_t maxWindowSize) {
+    tMaster * rmaster = master;
+    networkManagerSetMaxWindowSize(&rmaster->nwManager, maxWindowSize);
+    rmaster->rx.rxPacketManager.windowSize = maxWindowSize;
+}
+
+// Share node tx slots by reported buffer level and weight rather than plain round robin
+void masterSetDrrScheduling(void * master, bool enabled) {
+    tMaster * rmaster = master;
+    schedulerSetDrrEnabled(&rmaster->scheduler, enabled);
+}
+
+// Weight (>0) is per node id and kept if the node rejoins
+void masterSetNodeWeight(void * master, tNodeIndex nodeId, uint8_t weight) {
+    tMaster * rmaster = master;
+    schedulerSetNodeWeight(&rmaster->scheduler, nodeId, weight);
+}
+
+// Latency contract - the node gets a slot at least every maxSlotInterval slots (0 to remove)
+// Returns false if it can't be met alongside the existing contracts (counted in stats.deadlineContractsRejected)
+bool masterSetNodeMaxSlotInterval(void * master, tNodeIndex nodeId, uint8_t maxSlotInterval) {
+    tMaster * rmaster = master;
+    return schedulerSetNodeMaxSlotInterval(&rmaster->scheduler, nodeId, maxSlotInterval);
+}
+
+// Isochronous slots - the node transmits every period slots, the first one phase slots
+// from now (period 0 to remove). The rest of the slots are scheduled as normal
+bool masterReserveSlots(void * master, tNodeIndex nodeId, uint8_t period, uint8_t phase) {
+    tMaster * rmaster = master;
+    return schedulerReserveSlots(&rmaster->scheduler, nodeId, period, phase);
+}
+
+// Single channel only - let the master move the schedule look-ahead (numTxNodesScheduled) between
+// MIN_TX_NODES_SCHEDULED and MAX_TX_NODES_SCHEDULED depending on its tx backlog and ack latency
+void masterSetAdaptiveLookAhead(void * master, bool enabled) {
+    tMaster * rmaster = master;
+    schedulerSetAdaptiveLookAhead(&rmaster->scheduler, enabled);
+}
+
+// Replay the normal rotation once the nodes and their backlogs have settled
+void masterSetSchedulePlan(void * master, bool enabled) {
+    tMaster * rmaster = master;
+    schedulerSetPlanEnabled(&rmaster->scheduler, enabled);
+}
+
+// Flow control - each end only sends data packets the other end has room to store, rather than
+// sending them to be dropped and resent (the nodes always report their room, this turns it on)
+void masterSetFlowControl(void * master, bool enabled) {
+    tMaster * rmaster = master;
+    txManagerSetCredits(&rmaster->tx.txManager, enabled ? rmaster->tx.txCredits : NULL);
+    rmaster->tx.rxCredits = RX_CREDITS_UNLIMITED;
+    schedulerSetMasterRxCredits(&rmaster->scheduler, RX_CREDITS_UNLIMITED);
+}
+
 void getConnectedNodesBitField(void * master, uint8_t connectedNodesBitfield[MAX_NODES/8]) {
     tMaster * rmaster = master;
     rmaster->masterNodeTimeToLive[0] = 1; // Mark our own node as active
@@ -153,6 +253,11 @@ void getConnectedNodesBitField(void * master, uint8_t connectedNodesBitfield[MAX
         microbusAssert(node != 0, "");
         connectedNodesBitfield[node/8] &= ~(0x1 << (7 - (node % 8)));
     }
+    for (uint32_t node=FIRST_NODE_ID; node<MAX_NODES; node++) {
+        if (nodeQueueContains(&rmaster->nwManager.rejoinPendingNodes, node)) {
+            connectedNodesBitfield[node/8] &= ~(0x1 << (7 - (node % 8)));
+        }
+    }
 }
 
 void masterResetTxCredits(void * master) {
@@ -160,7 +265,8 @@ void masterResetTxCredits(void * master) {
     masterTxClearBuffers(&rmaster->tx.txManager);
 }
 
-uint8_t * masterPeekNextRxDataPacket(void * master, uint16_t * size, tNodeIndex * srcNodeId) {
+// Datagrams come in the same queue as the reliable packets - datagram is set for them
+uint8_t * masterPeekNextRxDataPacket(void * master, uint16_t * size, tNodeIndex * srcNodeId, bool * datagram) {
     tMaster * rmaster = master;
     tPacket * packet = peekNextRxDataPacket(&rmaster->rx.rxPacketManager);
     if (packet == NULL) {
@@ -168,6 +274,7 @@ uint8_t * masterPeekNextRxDataPacket(void * master, uint16_t * size, tNodeIndex
     }
     *size = GET_PACKET_DATA_SIZE(packet);
     *srcNodeId = packet->node.srcNodeId;
+    *datagram = IS_DATAGRAM_PACKET(GET_PACKET_TYPE(packet));
     return packet->node.data;
 }
 
@@ -178,6 +285,8 @@ bool masterPopNextDataPacket(void * master) {
 
 uint8_t * masterAllocateTxPacket(void * master) {
     tMaster * rmaster = master;
+    // Any messages waiting go first
+    masterFlushTxMessages(master);
     tPacket * packet = allocateTxPacket(&rmaster->tx.txManager, MASTER_NODE_ID);
     if (packet == NULL) {
         rmaster->stats.txBufferFull++;
@@ -186,16 +295,155 @@ uint8_t * masterAllocateTxPacket(void * master) {
     return packet->master.data;
 }
 
-void masterSubmitAllocatedTxPacket(void * master, tNodeIndex dstNodeId, uint16_t numBytes) {
-    tMaster * rmaster = master;
+static void masterSubmitAllocatedTxPacketOfType(tMaster * master, tNodeIndex dstNodeId, tPacketType packetType, uint16_t numBytes) {
     if (numBytes > MASTER_PACKET_DATA_SIZE) {
         microbusAssert(0, ""); // "Tx packet exceeds max size"
     }
-    tPacket * packet = rmaster->tx.txManager.allocatedPacket;
+    tPacket * packet = master->tx.txManager.allocatedPacket;
     if (packet == NULL) {
         microbusAssert(0, "");
     }
-    submitAllocatedTxPacket(&rmaster->tx.txManager, true, &rmaster->masterNodeTimeToLive[dstNodeId], MASTER_NODE_ID, dstNodeId, MASTER_DATA_PACKET, numBytes);
+    submitAllocatedTxPacket(&master->tx.txManager, true, &master->masterNodeTimeToLive[dstNodeId], MASTER_NODE_ID, dstNodeId, packetType, numBytes);
+}
+
+void masterSubmitAllocatedTxPacket(void * master, tNodeIndex dstNodeId, uint16_t numBytes) {
+    masterSubmitAllocatedTxPacketOfType(master, dstNodeId, MASTER_DATA_PACKET, numBytes);
+}
+
+// Goes out ahead of any normal packets to the node (only kept in order with other urgent packets)
+void masterSubmitAllocatedUrgentTxPacket(void * master, tNodeIndex dstNodeId, uint16_t numBytes) {
+    masterSubmitAllocatedTxPacketOfType(master, dstNodeId, MASTER_URGENT_DATA_PACKET, numBytes);
+}
+
+// ========================================= //
+// Datagrams - unreliable, only the newest unsent one for each node is kept
+// Without masterInitDatagrams no datagrams can be allocated
+
+void masterInitDatagrams(void * master, uint8_t numEntries, tPacketEntry entries[]) {
+    tMaster * rmaster = master;
+    datagramStoreInit(&rmaster->tx.datagrams, numEntries, entries);
+}
+
+// Returns NULL if every datagram entry is in use
+uint8_t * masterAllocateDatagram(void * master) {
+    tMaster * rmaster = master;
+    tPacket * packet = datagramAllocate(&rmaster->tx.datagrams);
+    return packet ? packet->master.data : NULL;
 }
 
+// Replaces any datagram for the node that hasn't been sent yet
+void masterSubmitAllocatedDatagram(void * master, tNodeIndex dstNodeId, uint16_t numBytes) {
+    tMaster * rmaster = master;
+    tDatagramStore * datagrams = &rmaster->tx.datagrams;
+    tPacket * packet = datagrams->allocatedPacket;
+    if (numBytes == 0 || numBytes > MASTER_PACKET_DATA_SIZE || packet == NULL) {
+        microbusAssert(0, "");
+        return;
+    }
+    if (dstNodeId >= MAX_NODES || rmaster->masterNodeTimeToLive[dstNodeId] <= 0) {
+        // Not on the network - no point sending it
+        datagramDropAllocated(datagrams);
+        return;
+    }
+    SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, MASTER_DATAGRAM_PACKET);
+    SET_PACKET_DATA_SIZE(packet, numBytes);
+    packet->master.dstNodeId = dstNodeId;
+    packet->txSeqNum = INVALID_SEQUENCE_NUM;
+    datagramSubmitAllocated(datagrams, dstNodeId);
+}
+
+// ========================================= //
+// Message aggregation - many small messages sent in one packet
+// Packets sent with these must be read with masterPeekNextRxMessage/nodePeekNextRxMessage
+
+// Returns false if the tx buffer is full
+bool masterAppendTxMessage(void * master, tNodeIndex dstNodeId, const uint8_t * data, uint8_t numBytes) {
+    tMaster * rmaster = master;
+    tTxManager * txManager = &rmaster->tx.txManager;
+    if (txMessageNeedsNewPacket(txManager, dstNodeId, numBytes)) {
+        masterFlushTxMessages(master);
+    }
+    if (!txMessageAppend(txManager, true, MASTER_NODE_ID, dstNodeId, data, numBytes)) {
+        rmaster->stats.txBufferFull++;
+        return false;
+    }
+    // If nothing is queued for this node it would go straight out - so don't hold it back
+    if (getNumInTxBuffer(txManager, dstNodeId) == 0) {
+        masterFlushTxMessages(master);
+    }
+    return true;
+}
+
+// Submit the packet being filled with messages (call when there is nothing more to send for a while)
+void masterFlushTxMessages(void * master) {
+    tMaster * rmaster = master;
+    tNodeIndex dstNodeId;
+    uint16_t numBytes = txMessageClosePacket(&rmaster->tx.txManager, &dstNodeId);
+    if (numBytes > 0) {
+        masterSubmitAllocatedTxPacket(master, dstNodeId, numBytes);
+    }
+}
+
+// Any datagrams in the way are dropped (stats in rx.rxPacketManager.numDatagramsDropped)
+uint8_t * masterPeekNextRxMessage(void * master, uint16_t * size, tNodeIndex * srcNodeId) {
+    tMaster * rmaster = master;
+    tPacket * packet = rxManagerPeekNextMessagePacket(&rmaster->rx.rxPacketManager);
+    if (packet == NULL) {
+        return NULL;
+    }
+    *srcNodeId = packet->node.srcNodeId;
+    return rxManagerPeekMessage(&rmaster->rx.rxPacketManager, packet->node.data, GET_PACKET_DATA_SIZE(packet), size);
+}
+
+bool masterPopNextRxMessage(void * master) {
+    tMaster * rmaster = master;
+    tPacket * packet = rxManagerPeekNextMessagePacket(&rmaster->rx.rxPacketManager);
+    if (packet == NULL) {
+        return false;
+    }
+    // Pop the packet once all its messages have gone
+    if (rxManagerPopMessage(&rmaster->rx.rxPacketManager, packet->node.data, GET_PACKET_DATA_SIZE(packet))) {
+        return masterPopNextDataPacket(master);
+    }
+    return true;
+}
+
+// ========================================= //
+// Large messages - split over as many packets as needed (up to MAX_LARGE_MESSAGE_SIZE)
+// Packets sent with these must be read with masterPeekNextLargeRxMessage/nodePeekNextLargeRxMessage
+
+// Returns false if there isn't room in the tx buffer for the whole message (nothing is sent)
+bool masterSubmitLargeTxMessage(void * master, tNodeIndex dstNodeId, const uint8_t * data, uint16_t numBytes) {
+    tMaster * rmaster = master;
+    tTxManager * txManager = &rmaster->tx.txManager;
+    microbusAssert(numBytes > 0 && numBytes <= MAX_LARGE_MESSAGE_SIZE, "");
+    masterFlushTxMessages(master);
+    if (getNumFreeTxPackets(txManager) < NUM_FRAGMENTS(numBytes)) {
+        rmaster->stats.txBufferFull++;
+        return false;
+    }
+    for (uint16_t offset=0; offset<numBytes; offset+=MAX_FRAGMENT_DATA_SIZE) {
+        uint8_t * packetData = masterAllocateTxPacket(master);
+        microbusAssert(packetData, "");
+        uint16_t packetSize = txFragmentWrite(packetData, data, numBytes, offset);
+        masterSubmitAllocatedTxPacket(master, dstNodeId, packetSize);
+    }
+    return true;
+}
+
+// The reassembly buffers - without these only messages that fit in one packet can be received
+void masterInitLargeRxMessages(void * master, uint8_t numEntries, tReassemblyEntry entries[]) {
+    tMaster * rmaster = master;
+    rxManagerInitReassembly(&rmaster->rx.rxPacketManager, numEntries, entries);
+}
+
+uint8_t * masterPeekNextLargeRxMessage(void * master, uint16_t * size, tNodeIndex * srcNodeId) {
+    tMaster * rmaster = master;
+    return rxManagerPeekLargeMessage(&rmaster->rx.rxPacketManager, true, size, srcNodeId);
+}
+
+bool masterPopNextLargeRxMessage(void * master) {
+    tMaster * rmaster = master;
+    return rxManagerPopLargeMessage(&rmaster->rx.rxPacketManager);
+}
 
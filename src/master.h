@@ -24,22 +24,23 @@ typedef struct {
     // Schedule
     tNodeIndex currentTxNodeId;
     tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED+2];
+    uint8_t timeoutTxFreed; // Single channel - freed by the tx call, returned by the next rx call
 
     // State of connected nodes
-    uint8_t masterNodeTimeToLive[MAX_NODES]; // this is decremented every SLOTS_TO_LIVE_DECREMENT_COUNT
+    uint8_t masterNodeTimeToLive[MAX_NODES]; // Steps down to SERVICE_TIME_TO_LIVE and then REMOVE_NODE_TTL (see networkManagerUpdateTimeUs)
     tNodeQueue activeNodes; // MAX_NODES
     tNodeQueue nodeTxNodes; // MAX_NODES
     tNodeQueue activeTxNodes; // MAX_NODES
 } tMaster;
 
 // Dual channel pipelined - run by interrupt thread!
-void masterDualChannelPipelinedPreProcess(tMaster * master, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError);
+uint16_t masterDualChannelPipelinedPreProcess(tMaster * master, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError); // return tx transfer size
 uint8_t masterDualChannelPipelinedPostProcess(tMaster * master); // return numTxFreed
 
 // Single channel - no pipeline
 tPacket * masterGetRxPacketMemory(tMaster * master);
 uint8_t masterNoDelaySingleChannelProcessRx(tMaster * master, bool crcError); // return numTxFreed
-uint8_t masterNoDelaySingleChannelProcessTx(tMaster * master, tPacket ** txPacket); // return numTxFreed
+uint16_t masterNoDelaySingleChannelProcessTx(tMaster * master, tPacket ** txPacket); // return tx transfer size
 
 // Called by timer
 void masterUpdateTimeUs(tMaster * master, uint32_t usIncr);
@@ -57,8 +58,28 @@ void masterInit(
 
 uint8_t * masterAllocateTxPacket(void * master);
 void masterSubmitAllocatedTxPacket(void * master, tNodeIndex dstNodeId, uint16_t numBytes);
-uint8_t * masterPeekNextRxDataPacket(void * master, uint16_t * size, tNodeIndex * srcNodeId);
+void masterSubmitAllocatedUrgentTxPacket(void * master, tNodeIndex dstNodeId, uint16_t numBytes);
+void masterInitDatagrams(void * master, uint8_t numEntries, tPacketEntry entries[]);
+uint8_t * masterAllocateDatagram(void * master);
+void masterSubmitAllocatedDatagram(void * master, tNodeIndex dstNodeId, uint16_t numBytes);
+uint8_t * masterPeekNextRxDataPacket(void * master, uint16_t * size, tNodeIndex * srcNodeId, bool * datagram);
 bool masterPopNextDataPacket(void * master);
+bool masterAppendTxMessage(void * master, tNodeIndex dstNodeId, const uint8_t * data, uint8_t numBytes);
+void masterFlushTxMessages(void * master);
+uint8_t * masterPeekNextRxMessage(void * master, uint16_t * size, tNodeIndex * srcNodeId);
+bool masterPopNextRxMessage(void * master);
+bool masterSubmitLargeTxMessage(void * master, tNodeIndex dstNodeId, const uint8_t * data, uint16_t numBytes);
+void masterInitLargeRxMessages(void * master, uint8_t numEntries, tReassemblyEntry entries[]);
+uint8_t * masterPeekNextLargeRxMessage(void * master, uint16_t * size, tNodeIndex * srcNodeId);
+bool masterPopNextLargeRxMessage(void * master);
+void masterSetMaxWindowSize(void * master, uint8_t maxWindowSize);
+void masterSetDrrScheduling(void * master, bool enabled);
+void masterSetNodeWeight(void * master, tNodeIndex nodeId, uint8_t weight);
+bool masterSetNodeMaxSlotInterval(void * master, tNodeIndex nodeId, uint8_t maxSlotInterval);
+void masterSetAdaptiveLookAhead(void * master, bool enabled);
+void masterSetSchedulePlan(void * master, bool enabled);
+void masterSetFlowControl(void * master, bool enabled);
+bool masterReserveSlots(void * master, tNodeIndex nodeId, uint8_t period, uint8_t phase);
 void getConnectedNodesBitField(void * master, uint8_t connectedNodesBitfield[MAX_NODES/8]);
 void masterResetTxCredits(void * master);
 
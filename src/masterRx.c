@@ -24,7 +24,8 @@ void masterQuickProcessPrevRx(tMasterRx * rx, tNetworkManager * nwManager, tTxMa
         return;
     }
 
-    if (rxCrcError) {
+    // New node requests and rejoin claims have a checksum for each sub-slot as multiple nodes can transmit in that packet slot
+    if (rxCrcError && GET_PACKET_TYPE(rxPacket) != NEW_NODE_REQUEST_PACKET && GET_PACKET_TYPE(rxPacket) != NODE_REJOIN_PACKET) {
         rx->stats->rxCrcFailures++;
         // microbusAssert(0, "");
         return;
@@ -36,7 +37,7 @@ void masterQuickProcessPrevRx(tMasterRx * rx, tNetworkManager * nwManager, tTxMa
         return;
     }
 
-    if (GET_PACKET_DATA_SIZE(rxPacket) >= MAX_PACKET_DATA_SIZE) {
+    if (GET_PACKET_DATA_SIZE(rxPacket) > MAX_PACKET_DATA_SIZE) {
         rx->stats->rxInvalidDataSize++;
         //microbusAssert(0, "");
         return;
@@ -47,7 +48,7 @@ void masterQuickProcessPrevRx(tMasterRx * rx, tNetworkManager * nwManager, tTxMa
     
     // Record we've received a packet - before finding out whether the buffer is full
     tPacketType packetType = GET_PACKET_TYPE(rxPacket);
-    if (packetType == NODE_DATA_PACKET || packetType == NODE_EMPTY_PACKET) {
+    if (IS_NODE_DATA_PACKET(packetType) || packetType == NODE_EMPTY_PACKET || packetType == NODE_DATAGRAM_PACKET) {
         if (masterNodeTimeToLive[rxPacket->node.srcNodeId] > 0) {
             networkManagerRecordRxPacket(nwManager, masterNodeTimeToLive, rxPacket->node.srcNodeId);
         }
@@ -69,14 +70,31 @@ void masterQuickProcessPrevRx(tMasterRx * rx, tNetworkManager * nwManager, tTxMa
     // Check sequence number
     // We want to update our sequence number as quickly as possible so we can ack it straight away
     // rx->validRxSeqNum = true;
-    if (GET_PACKET_TYPE(rxPacket) == NODE_DATA_PACKET) {
-        tNodeIndex srcNodeId = rxPacket->node.srcNodeId;
-        rx->validRxSeqNum = rxPacketCheckAndUpdateSeqNum(txManager, srcNodeId, rxPacket->txSeqNum, true);
+    if (IS_NODE_DATA_PACKET(packetType)) {
+        uint8_t lane = TX_LANE(txManager, rxPacket->node.srcNodeId, PACKET_TX_PRIORITY(packetType));
+        rx->validRxSeqNum = rxPacketCheckAndUpdateSeqNum(txManager, lane, rxPacket->txSeqNum, true);
     }
 }
 
 // NOTE: this can't take too long. It must complete before the next packet is transmitted
 // Returns numTxPacketsFreed
+// Record the other ends acknowledgement (and how long it took for the scheduler)
+// Every node packet also carries the ack for our urgent packets, how many urgent packets it has waiting
+// and how many more packets it has room for
+static uint8_t masterRxAck(tMasterRx * rx, tSchedulerState * scheduler, tTxManager * txManager, tPacket * rxPacket) {
+    tNodeIndex srcNodeId = rxPacket->node.srcNodeId;
+    uint8_t numTxPacketsFreed = rxSelectiveAckSeqNum(txManager, srcNodeId, rxPacket->node.ackSeqNum, rxPacket->node.sackBitmap, true, &rx->stats->txWindowRestarts);
+    if (numTxPacketsFreed > 0) {
+        schedulerRecordAck(scheduler, srcNodeId);
+    }
+    if (srcNodeId < MAX_NODES) {
+        numTxPacketsFreed += rxAckSeqNum(txManager, TX_LANE(txManager, srcNodeId, TX_PRIORITY_URGENT), rxPacket->node.urgentAckSeqNum, true, &rx->stats->txWindowRestarts);
+        schedulerUpdateNodeUrgentBufferLevel(scheduler, srcNodeId, rxPacket->node.urgentBufferLevel);
+        txManagerUpdateCredits(txManager, srcNodeId, rxPacket->node.rxCredits);
+    }
+    return numTxPacketsFreed;
+}
+
 uint8_t masterProcessRx(tMasterRx * rx, tNetworkManager * nwManager, tSchedulerState * scheduler, tTxManager * txManager, uint8_t masterNodeTimeToLive[MAX_NODES]) {
     if (!rx->validRxPacket) {
         return 0;
@@ -95,15 +113,15 @@ uint8_t masterProcessRx(tMasterRx * rx, tNetworkManager * nwManager, tSchedulerS
 
     switch (packetType) {
         case NODE_EMPTY_PACKET: {
-            tNodeIndex srcNodeId = rxPacket->node.srcNodeId;
             // Record the other ends acknowledgement
-            numTxPacketsFreed += rxAckSeqNum(txManager, srcNodeId, rxPacket->node.ackSeqNum, true, &rx->stats->txWindowRestarts);
+            numTxPacketsFreed += masterRxAck(rx, scheduler, txManager, rxPacket);
             break;
         }
-        case NODE_DATA_PACKET: {
+        case NODE_DATA_PACKET:
+        case NODE_URGENT_DATA_PACKET: {
             tNodeIndex srcNodeId = rxPacket->node.srcNodeId;
             // Record the other ends acknowledgement
-            numTxPacketsFreed += rxAckSeqNum(txManager, srcNodeId, rxPacket->node.ackSeqNum, true, &rx->stats->txWindowRestarts);
+            numTxPacketsFreed += masterRxAck(rx, scheduler, txManager, rxPacket);
             // If it's the sequence number is expected
             if (rx->validRxSeqNum) {
                 microbusAssert(rxPacket->dataSize1 > 0 || rxPacket->dataSize2 > 0, "");
@@ -116,11 +134,25 @@ uint8_t masterProcessRx(tMasterRx * rx, tNetworkManager * nwManager, tSchedulerS
             }
             break;
         }
+        case NODE_DATAGRAM_PACKET: {
+            // No sequence number to check - it's always kept if there is room
+            numTxPacketsFreed += masterRxAck(rx, scheduler, txManager, rxPacket);
+            microbusAssert(rxPacket->dataSize1 > 0 || rxPacket->dataSize2 > 0, "");
+            schedulerUpdateNodeTxBufferLevel(scheduler, rxPacket->node.srcNodeId, rxPacket->node.bufferLevel);
+            rx->stats->rxDatagrams++;
+            addRxDataPacket(&rx->rxPacketManager, rxPacketEntry);
+            packetStored = true;
+            break;
+        }
         case NEW_NODE_REQUEST_PACKET:
-            rxNewNodePacketRequest(nwManager, masterNodeTimeToLive, rxPacket, &rx->stats->networkFullCount);
+            rxNewNodePacketRequest(nwManager, masterNodeTimeToLive, txManager->txWindowSize, rxPacket, &rx->stats->networkFullCount, &rx->stats->newNodeRequestCollisions);
             rx->stats->newNodeRequestRx++;
             NEW_NODE_HEARD_UPDATE_SCHEDULER((*scheduler));
             break;
+        case NODE_REJOIN_PACKET:
+            rx->stats->nodeRejoined += rxRejoinRequest(nwManager, masterNodeTimeToLive, txManager->txWindowSize, rxPacket);
+            NEW_NODE_HEARD_UPDATE_SCHEDULER((*scheduler));
+            break;
         default:
             rx->stats->rxInvalidPacketType++;
             //microbusAssert(0, "");
@@ -128,7 +160,7 @@ uint8_t masterProcessRx(tMasterRx * rx, tNetworkManager * nwManager, tSchedulerS
     }
     if (packetStored == false) {
         // Free the packet
-        rxPacketEntry->inUse = false;
+        rxManagerFreePacket(&rx->rxPacketManager, rxPacketEntry);
         // rx->nextRxPacketEntry->valid = false;
     }
     
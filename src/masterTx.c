@@ -11,6 +11,56 @@
 #include "txManager.h"
 #include "networkManager.h"
 
+// Fill in the latest acks for the nodes picked when the ack packet was prepared
+static void masterQuickUpdateAckPacket(tMasterTx * tx, tPacket * packet) {
+    uint8_t numEntries = GET_PACKET_DATA_SIZE(packet) / MASTER_ACK_ENTRY_SIZE;
+    for (uint8_t i=0; i<numEntries; i++) {
+        uint8_t entryNodeId = packet->master.data[i*MASTER_ACK_ENTRY_SIZE];
+        tNodeIndex nodeId = entryNodeId & ~URGENT_ACK_ENTRY_FLAG;
+        if (entryNodeId & URGENT_ACK_ENTRY_FLAG) {
+            packet->master.data[i*MASTER_ACK_ENTRY_SIZE + 1] = tx->txManager.rxSeqNum[TX_LANE(&tx->txManager, nodeId, TX_PRIORITY_URGENT)];
+            nodeQueueRemoveIfExists(&tx->urgentAckPendingNodes, nodeId);
+        } else {
+            packet->master.data[i*MASTER_ACK_ENTRY_SIZE + 1] = tx->txManager.rxSeqNum[nodeId];
+            nodeQueueRemoveIfExists(&tx->ackPendingNodes, nodeId);
+        }
+    }
+}
+
+// Add an entry for each node in the queue (up to what fits) - returns the new number of entries
+static uint8_t masterAddAckEntries(tPacket * packet, uint8_t numEntries, tNodeQueue * pendingNodes, uint8_t entryFlag) {
+    tNodeIndex nodeId = MASTER_NODE_ID;
+    uint8_t numToAdd = MIN(pendingNodes->numNodes, MAX_MASTER_ACK_ENTRIES - numEntries);
+    for (uint8_t i=0; i<numToAdd; i++) {
+        nodeId = nodeQueueNextAfter(pendingNodes, nodeId);
+        packet->master.data[numEntries*MASTER_ACK_ENTRY_SIZE] = nodeId | entryFlag;
+        numEntries++;
+    }
+    return numEntries;
+}
+
+// Ack every node that is waiting for one (up to what fits) - the acks themselves are filled in at the last moment
+static tPacket * masterPrepareAckPacket(tMasterTx * tx) {
+    tPacket * packet = &tx->tmpAckPacket[tx->tmpPacketCycle % 2];
+    SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, MASTER_ACK_PACKET);
+    packet->txSeqNum = INVALID_SEQUENCE_NUM;
+    packet->master.dstNodeId = INVALID_NODE_ID;
+
+    uint8_t numEntries = masterAddAckEntries(packet, 0, &tx->urgentAckPendingNodes, URGENT_ACK_ENTRY_FLAG);
+    numEntries = masterAddAckEntries(packet, numEntries, &tx->ackPendingNodes, 0);
+    SET_PACKET_DATA_SIZE(packet, numEntries * MASTER_ACK_ENTRY_SIZE);
+    return packet;
+}
+
+// Called when a data packet from a node has been accepted - it now needs acking
+void masterTxRecordAckPending(tMasterTx * tx, tNodeIndex nodeId, tTxPriority priority) {
+    if (priority == TX_PRIORITY_URGENT) {
+        nodeQueueAdd(&tx->urgentAckPendingNodes, nodeId);
+    } else {
+        nodeQueueAdd(&tx->ackPendingNodes, nodeId);
+    }
+}
+
 void masterQuickUpdateTxPacket(tMasterTx * tx, tSchedulerState * scheduler, tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED]) {
     if (tx->nextTxPacket) {
         
@@ -18,8 +68,19 @@ void masterQuickUpdateTxPacket(tMasterTx * tx, tSchedulerState * scheduler, tNod
         for (uint8_t i=0; i<scheduler->numTxNodesScheduled; i++) {
             tNodeIndex nodeId = nextTxNodeId[i]; // There is a delay of 1
             tx->nextTxPacket->master.nextTxNodeId[i] = nodeId;
-            tx->nextTxPacket->master.nextTxNodeAckSeqNum[i] = tx->txManager.rxSeqNum[nodeId];
+            tx->nextTxPacket->master.nextTxNodeAckSeqNum[i] = (nodeId < MAX_NODES) ? tx->txManager.rxSeqNum[nodeId] : NULL_SEQUENCE_NUM;
+            tx->nextTxPacket->master.nextTxNodeUrgentAckSeqNum[i] = (nodeId < MAX_NODES) ? tx->txManager.rxSeqNum[TX_LANE(&tx->txManager, nodeId, TX_PRIORITY_URGENT)] : NULL_SEQUENCE_NUM;
+            nodeQueueRemoveIfExists(&tx->ackPendingNodes, nodeId);
+            nodeQueueRemoveIfExists(&tx->urgentAckPendingNodes, nodeId);
+        }
+        // The look-ahead can change so the nodes mustn't pick up anything left from before
+        for (uint8_t i=scheduler->numTxNodesScheduled; i<MAX_TX_NODES_SCHEDULED; i++) {
+            tx->nextTxPacket->master.nextTxNodeId[i] = INVALID_NODE_ID;
+        }
+        if (GET_PACKET_TYPE(tx->nextTxPacket) == MASTER_ACK_PACKET) {
+            masterQuickUpdateAckPacket(tx, tx->nextTxPacket);
         }
+        tx->nextTxPacket->master.rxCredits = tx->rxCredits;
 
         tx->stats->txPackets++;
         if (MICROBUS_LOG_PACKETS && MICROBUS_LOGGING) {
@@ -28,12 +89,36 @@ void masterQuickUpdateTxPacket(tMasterTx * tx, tSchedulerState * scheduler, tNod
     }
 }
 
+// Halve the burst on a resend (loss), grow it by one after a full burst without one.
+// Never more than the window as the rest would only wait on the ack
+static void masterTxUpdateBurst(tMasterTx * tx, tSchedulerState * scheduler, tNodeIndex dstNodeId, bool resend) {
+    uint8_t * burstSize = &tx->burstSize[dstNodeId];
+    uint8_t count = tx->txManager.lastTxQueueCount;
+    if (resend) {
+        *burstSize = MAX(1, *burstSize / 2);
+    } else if (count >= *burstSize) {
+        *burstSize = MIN(*burstSize + 1, MIN(MAX_MASTER_BURST_SIZE, tx->txManager.txWindowSize[dstNodeId]));
+    }
+    uint8_t remaining = (count < *burstSize) ? *burstSize - count : 0;
+    remaining = MIN(remaining, getNumTxPacketsSendable(&tx->txManager, dstNodeId));
+    if (tx->txManager.txCredits) {
+        // Flow control - end the burst early so the ack slot brings back more credits (this packet
+        // has one)
+        remaining = MIN(remaining, tx->txManager.txCredits[dstNodeId] - 1);
+    }
+    schedulerSetMasterBurst(scheduler, dstNodeId, remaining);
+}
+
 // Work out the next tx packet
 void masterProcessTx(tMasterTx * tx, tNetworkManager * nwManager, tSchedulerState * scheduler, tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED]) {
     tPacket * txPacket = NULL;
 
     if (tx->masterResetCycles > 0) {
         tx->masterResetCycles--;
+        if (tx->masterResetCycles == 0) {
+            // Any nodes that were on the network have dropped off - hold their IDs back for them
+            networkManagerReserveAllNodeIds(nwManager);
+        }
         txPacket = &tx->tmpPacket;
         SET_PROTOCOL_VERSION_AND_PACKET_TYPE(txPacket, MASTER_RESET_PACKET);
         MB_PRINTF("Master reset cycle\n");
@@ -49,18 +134,39 @@ void masterProcessTx(tMasterTx * tx, tNetworkManager * nwManager, tSchedulerStat
             }
             
             // Only send new node responses every Nth cycle (so it doesn't consume all the bandwidth when nodes are joining)
-            if ((nwManager->numNewNodes > 0) && (tx->tmpPacketCycle == 1)) {
+            if ((nwManager->numNewNodes > 0 || nwManager->rejoinPendingNodes.numNodes > 0) && (tx->tmpPacketCycle == 1)) {
                 txPacket = &tx->tmpPacket;
                 tx->stats->newNodeAllocated++;
-                txNewNodeResponse(nwManager, txPacket);
+                txNewNodeResponse(nwManager, tx->txManager.txWindowSize, txPacket);
                 MB_TX_MANAGER_PRINTF("Master Prepare Tx new node\n");
 
             } else {
-                // TODO: issue where we only get <50% bandwidth when single channel, nodes>1 and only master sending data
-                //       because we continually schedule acks. We could get 75% if we sent bursts of up to 3 and only
-                //       scheduled acks every 4
-                uint8_t burstSize = 1; //scheduler->numTxNodesScheduled > 1 ? 3 : 1;
-                txPacket = masterGetNextTxDataPacket(&tx->txManager, scheduler->numTxNodesScheduled, nextTxNodeId, burstSize);
+                // Single channel would only get <50% bandwidth if every master packet had to be followed by
+                // an ack slot so send bursts to one node and only schedule its ack at the end
+                uint8_t burstSize = 1;
+                if (scheduler->numTxNodesScheduled > 1) {
+                    burstSize = tx->burstSize[tx->txManager.lastTxNodeId];
+                }
+                uint32_t numSelectiveResends = tx->txManager.numSelectiveResends;
+                uint32_t numCreditStalls = tx->txManager.numCreditStalls;
+                // Datagrams go after urgent packets but ahead of normal ones (they're only ever sent once)
+                if (tx->txManager.urgentTxNodes.numNodes == 0) {
+                    txPacket = datagramGetNextTxPacket(&tx->datagrams, &tx->stats->datagramsReplaced);
+                }
+                if (txPacket == NULL) {
+                    txPacket = masterGetNextTxDataPacket(&tx->txManager, scheduler->numTxNodesScheduled, nextTxNodeId, burstSize);
+                }
+                tx->stats->txCreditStalls += tx->txManager.numCreditStalls - numCreditStalls;
+                if (scheduler->numTxNodesScheduled > 1 && txPacket != NULL && GET_PACKET_TYPE(txPacket) == MASTER_DATA_PACKET) {
+                    masterTxUpdateBurst(tx, scheduler, txPacket->master.dstNodeId, numSelectiveResends != tx->txManager.numSelectiveResends);
+                }
+
+                // If no data to send then use the slot to ack any nodes that are waiting
+                // (so they don't have to wait to be scheduled to move their window on)
+                if (txPacket == NULL && (tx->ackPendingNodes.numNodes > 0 || tx->urgentAckPendingNodes.numNodes > 0)) {
+                    txPacket = masterPrepareAckPacket(tx);
+                    tx->stats->txAckPackets++;
+                }
 
                 // Alternate between 2 empty packet headers
                 // If no valid packet to send then send a blank one
@@ -75,13 +181,26 @@ void masterProcessTx(tMasterTx * tx, tNetworkManager * nwManager, tSchedulerStat
                     txPacketHeader->master.dstNodeId = INVALID_NODE_ID;
                     txPacket = (tPacket *)txPacketHeader; // A bit hacky - the DMA will access a few hundred bytes beyond the packet header
                     // MB_TX_MANAGER_PRINTF("Master Prepare Tx Empty packet\n");
-                } else {
-                    microbusAssert(GET_PACKET_DATA_SIZE(txPacket) < MAX_PACKET_DATA_SIZE, "");
+                } else if (IS_MASTER_DATA_PACKET(GET_PACKET_TYPE(txPacket))) {
+                    microbusAssert(GET_PACKET_DATA_SIZE(txPacket) <= MAX_PACKET_DATA_SIZE, "");
                     tx->stats->txDataPackets++;
+                    tNodeIndex dstNodeId = txPacket->master.dstNodeId;
+                    if (GET_PACKET_TYPE(txPacket) == MASTER_DATA_PACKET && txPacket->txSeqNum == tx->txManager.txSeqNumStart[dstNodeId]) {
+                        schedulerRecordTx(scheduler, dstNodeId);
+                    }
+                } else if (GET_PACKET_TYPE(txPacket) == MASTER_DATAGRAM_PACKET) {
+                    tx->stats->txDatagrams++;
                 }
             }
         // }
     }
+    datagramRecordTx(&tx->datagrams, txPacket);
+    // Anything the node stores uses up one of its credits - datagrams aren't held back but still
+    // take the room
+    tPacketType packetType = GET_PACKET_TYPE(txPacket);
+    bool stored = IS_MASTER_DATA_PACKET(packetType) || (packetType == MASTER_DATAGRAM_PACKET);
+    txManagerRecordCreditTx(&tx->txManager, stored ? txPacket->master.dstNodeId : INVALID_NODE_ID);
+    txPacket->master.joinCollisions = nwManager->joinCollisions;
     tx->nextTxPacket = txPacket;
 }
 
@@ -89,6 +208,10 @@ tPacket * masterTxGetNextTxPacket(tMasterTx * tx) {
     return tx->nextTxPacket;
 }
 
+void masterTxResetBurstSize(tMasterTx * tx, tNodeIndex nodeId) {
+    tx->burstSize[nodeId] = MAX_MASTER_BURST_SIZE;
+}
+
 void masterTxInit(tMasterTx * tx, tNodeStats * stats, tNodeQueue * activeTxNodes, uint8_t maxTxPacketEntries, tPacketEntry txPacketEntries[]) {
     initTxManager(
         &tx->txManager,
@@ -98,12 +221,26 @@ void masterTxInit(tMasterTx * tx, tNodeStats * stats, tNodeQueue * activeTxNodes
         tx->txManagerMemory.txSeqNumNext,
         tx->txManagerMemory.txSeqNumPauseCount,
         tx->txManagerMemory.rxSeqNum,
+        tx->txManagerMemory.txQueueHead,
+        tx->txManagerMemory.txQueueTail,
+        tx->txManagerMemory.txQueueLastSent,
+        tx->txManagerMemory.txNumSubmitted,
+        tx->txManagerMemory.txNumFreed,
+        tx->txManagerMemory.txSelectiveRepeat,
+        tx->txManagerMemory.txWindowSize,
         activeTxNodes,
         maxTxPacketEntries,
         txPacketEntries
     );
 
     tx->stats = stats;
+    nodeQueueInit(&tx->ackPendingNodes);
+    nodeQueueInit(&tx->urgentAckPendingNodes);
+    datagramStoreInit(&tx->datagrams, 0, NULL);
+    tx->rxCredits = RX_CREDITS_UNLIMITED;
+    for (uint32_t nodeId=0; nodeId<MAX_NODES; nodeId++) {
+        masterTxResetBurstSize(tx, nodeId);
+    }
 
     // Start with a valid packet
     tx->nextTxPacket = &tx->tmpPacket;
@@ -11,13 +11,21 @@
 #include "networkManager.h"
 #include "scheduler.h"
 #include "txManager.h"
+#include "datagram.h"
 
 typedef struct {
-    uint8_t txSeqNumStart[MAX_NODES];
-    uint8_t txSeqNumEnd[MAX_NODES];
-    uint8_t txSeqNumNext[MAX_NODES];
-    uint8_t txSeqNumPauseCount[MAX_NODES];
-    uint8_t rxSeqNum[MAX_NODES];
+    uint8_t txSeqNumStart[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txSeqNumEnd[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txSeqNumNext[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txSeqNumPauseCount[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t rxSeqNum[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txQueueHead[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txQueueTail[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txQueueLastSent[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txNumSubmitted[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txNumFreed[MAX_NODES*NUM_TX_PRIORITIES];
+    tTxSelectiveRepeat txSelectiveRepeat[MAX_NODES*NUM_TX_PRIORITIES];
+    uint8_t txWindowSize[MAX_NODES*NUM_TX_PRIORITIES];
 } tMasterTxManagerMemory;
 
 typedef struct {
@@ -27,14 +35,23 @@ typedef struct {
     uint8_t tmpPacketCycle;
     tPacketHeader tmpEmptyPacketHeader[2];
     tPacket tmpPacket;
+    tPacket tmpAckPacket[2]; // Alternate for the same reason as the empty packet headers
+    tNodeQueue ackPendingNodes; // Nodes whose data we've received but haven't acked yet
+    tNodeQueue urgentAckPendingNodes; // The same for their urgent packets
+    uint8_t burstSize[MAX_NODES]; // Single channel only - adapts to losses
+    uint8_t txCredits[MAX_NODES]; // Flow control - packets each node has room for (see txManagerUpdateCredits)
+    uint8_t rxCredits; // Flow control - advertised to the nodes in every packet
     tNodeStats * stats;
     uint32_t masterResetCycles;
     tTxManager txManager; // Handles queues for re-transmission
+    tDatagramStore datagrams; // Unreliable - bypasses the tx manager
 } tMasterTx;
 
+void masterTxRecordAckPending(tMasterTx * tx, tNodeIndex nodeId, tTxPriority priority);
 void masterQuickUpdateTxPacket(tMasterTx * tx, tSchedulerState * scheduler, tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED]);
 void masterProcessTx(tMasterTx * tx, tNetworkManager * nwManager, tSchedulerState * scheduler, tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED]);
 tPacket * masterTxGetNextTxPacket(tMasterTx * tx);
+void masterTxResetBurstSize(tMasterTx * tx, tNodeIndex nodeId);
 void masterTxInit(tMasterTx * tx, tNodeStats * stats, tNodeQueue * activeTxNodes, uint8_t maxTxPacketEntries, tPacketEntry txPacketEntries[]);
 
 
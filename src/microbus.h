@@ -8,20 +8,36 @@
 #include "stdbool.h"
 #include "stdint.h"
 #include "stdio.h"
+#include "stddef.h"
 
 
 // =========================== //
 // User configurable parameters
 
-#define MAX_NODES 64 // Must be less than 255
+#define MAX_NODES 64 // Must be less than 255 (and no more than 64 for the tNodeQueue bitmap)
 
 // TODO:
 #define MB_PACKET_SIZE 192 // (At 4.5Mhz => 355us per packet, at 9MHz => 177us per packet)
-#define SLOT_TIME_US ((8 * MB_PACKET_SIZE * 10) / 45)
+#define SLOT_TIME_FOR_BYTES_US(numBytes) ((8 * (numBytes) * 10) / 45)
+#define SLOT_TIME_US SLOT_TIME_FOR_BYTES_US(MB_PACKET_SIZE)
+// Variable length slots - only the header and the data used are transferred (so empty and ack slots are short)
+// The pre process calls return the tx transfer size. With both channels in use the slot is as long as the
+// longer of the 2 packets - the receiver can read the header first to find out how long the other side is
+#define MICROBUS_VARIABLE_LENGTH_SLOTS 1
 
 #define MAX_ACTIVE_TX_NODES 10 // Only for the master - how many nodes have tx packets waiting for them
-#define SLIDING_WINDOW_SIZE 4 // The size of the sliding window in tx packets
+#define SLIDING_WINDOW_SIZE 4 // The default size of the sliding window in tx packets (and the masters default cap)
+#define MAX_SLIDING_WINDOW_SIZE 8 // The largest window a node can negotiate when it joins
 #define SLIDING_WINDOW_PAUSE 3
+#define MAX_MASTER_BURST_SIZE 3 // Single channel only - most master packets in a row to one node before it acks
+// Selective repeat - the nodes buffer out of order packets from the master and send back a selective
+// ack bitmap, so the master only retransmits the missing packets rather than the whole window.
+// (The master can't send a selective ack back - no room in the header - so node -> master is always go-back-N)
+#define MICROBUS_SELECTIVE_REPEAT 1
+
+#if MAX_SLIDING_WINDOW_SIZE > 8 || SLIDING_WINDOW_SIZE > MAX_SLIDING_WINDOW_SIZE
+    #error "The selective repeat bitmaps only cover 8 packets"
+#endif
 
 #define MICROBUS_VERSION 1
 
@@ -32,8 +48,9 @@
 #define FIRST_NODE_ID 1
 #define UNALLOCATED_NODE_ID 0xFE // Used for signalling when newNodeId packets can be sent
 #define INVALID_NODE_ID 0xFF // Shouldn't ever be used
+#define REJOIN_SLOT_FLAG 0x80 // Scheduled with the first of a block of node IDs - nodes that had one of them claim it back in this slot
+#define IS_REJOIN_SLOT(nodeId) (((nodeId) & REJOIN_SLOT_FLAG) && (((nodeId) & ~REJOIN_SLOT_FLAG) < MAX_NODES))
 
-// TODO: change empty packet to ACK PACKET - allowing master to ack multiple nodes
 typedef enum {
     NULL_PACKET = 0,
     MASTER_DATA_PACKET = 1,
@@ -43,17 +60,67 @@ typedef enum {
     NEW_NODE_REQUEST_PACKET = 5,
     NEW_NODE_RESPONSE_PACKET = 6,
     MASTER_RESET_PACKET = 7,
-    MAX_PACKET_TYPE = 8
+    MASTER_ACK_PACKET = 8, // Sent instead of an empty packet - acks for any nodes not in the schedule
+    MASTER_URGENT_DATA_PACKET = 9,
+    NODE_URGENT_DATA_PACKET = 10,
+    MASTER_DATAGRAM_PACKET = 11, // Unreliable - no sequence number, never acked or resent
+    NODE_DATAGRAM_PACKET = 12,
+    NODE_REJOIN_PACKET = 13, // Claims back node IDs in a rejoin slot - one sub-slot per ID
+    MAX_PACKET_TYPE = 14
 } tPacketType; // Max of 15! - only 4 bits
 
+// Priority classes - each destination has its own sequence numbers and window per class (a lane)
+// so an urgent packet never waits behind a window full of bulk data. Urgent packets go out first
+typedef enum {
+    TX_PRIORITY_NORMAL = 0,
+    TX_PRIORITY_URGENT = 1,
+    NUM_TX_PRIORITIES = 2
+} tTxPriority;
+
+#define URGENT_WINDOW_SIZE 2 // Urgent packets are for short commands - a small window stops them filling the rx buffers
+#define URGENT_ACK_ENTRY_FLAG 0x80 // Set on the node id of a master ack packet entry that is for the urgent lane
+#define PACKET_TX_PRIORITY(packetType) ((((packetType) == MASTER_URGENT_DATA_PACKET) || ((packetType) == NODE_URGENT_DATA_PACKET)) ? TX_PRIORITY_URGENT : TX_PRIORITY_NORMAL)
+#define IS_NODE_DATA_PACKET(packetType) (((packetType) == NODE_DATA_PACKET) || ((packetType) == NODE_URGENT_DATA_PACKET))
+#define IS_MASTER_DATA_PACKET(packetType) (((packetType) == MASTER_DATA_PACKET) || ((packetType) == MASTER_URGENT_DATA_PACKET))
+#define IS_DATAGRAM_PACKET(packetType) (((packetType) == MASTER_DATAGRAM_PACKET) || ((packetType) == NODE_DATAGRAM_PACKET))
+
+// Flow control - each end advertises how many more packets it has room for in its rx buffer
+// and the other end holds its data back when that gets to 0
+#define RX_CREDITS_UNLIMITED 0xFF // Advertised by a master that isn't using flow control
+
 #define MAX_TX_NODES_SCHEDULED 4
 
-#define MB_HEADER_SIZE (6+(2*MAX_TX_NODES_SCHEDULED))
+#define MB_HEADER_SIZE (8+(3*MAX_TX_NODES_SCHEDULED))
+
+// Master ack packet - the data is a list of (nodeId, ackSeqNum) pairs
+#define MASTER_ACK_ENTRY_SIZE 2
+#define MAX_MASTER_ACK_ENTRIES 32
 
 // Keep them the same 
 #define MASTER_PACKET_DATA_SIZE (MB_PACKET_SIZE - MB_HEADER_SIZE)
 #define NODE_PACKET_DATA_SIZE    MASTER_PACKET_DATA_SIZE
 
+// New node requests and rejoin claims are split into sub-slots - each node only writes one
+#define NEW_NODE_REQUEST_ENTRY_SIZE 11 // uint64_t uniqueId, uint8_t windowSize, uint16_t checkSum
+#define NEW_NODE_REQUEST_SUB_SLOTS (NODE_PACKET_DATA_SIZE / NEW_NODE_REQUEST_ENTRY_SIZE)
+
+// Message aggregation - small messages packed into one packet, each with a 1 byte length in front
+#define MESSAGE_HEADER_SIZE 1
+#define MAX_MESSAGE_PACKET_SIZE MASTER_PACKET_DATA_SIZE
+#define MAX_MESSAGE_SIZE (MAX_MESSAGE_PACKET_SIZE - MESSAGE_HEADER_SIZE)
+
+// Large messages - split over consecutive packets, each packet starts with a fragment header
+#define MAX_LARGE_MESSAGE_SIZE 1024 // Size of each reassembly buffer
+#define FRAGMENT_FIRST 0x1
+#define FRAGMENT_LAST 0x2
+#define FRAGMENT_HEADER_SIZE 3 // uint8_t flags, uint16_t total size
+#define MAX_FRAGMENT_DATA_SIZE (MAX_MESSAGE_PACKET_SIZE - FRAGMENT_HEADER_SIZE)
+#define NUM_FRAGMENTS(numBytes) (((numBytes) + MAX_FRAGMENT_DATA_SIZE - 1) / MAX_FRAGMENT_DATA_SIZE)
+
+#if (MAX_MASTER_ACK_ENTRIES * MASTER_ACK_ENTRY_SIZE) > MASTER_PACKET_DATA_SIZE
+    #error "Master ack packet entries don't fit in a packet"
+#endif
+
 typedef uint8_t tNodeIndex; // Node 0 not allowed, Node 255 is unused for new nodes to advertise
 
 // TODO: pragma struct align
@@ -63,6 +130,9 @@ typedef struct {
     // We necessarily want to CRC check the whole packet just for these fields so we use the checksum instead
     uint8_t nextTxNodeId[MAX_TX_NODES_SCHEDULED]; // Master only
     uint8_t nextTxNodeAckSeqNum[MAX_TX_NODES_SCHEDULED];
+    uint8_t nextTxNodeUrgentAckSeqNum[MAX_TX_NODES_SCHEDULED];
+    uint8_t rxCredits; // Data packets the master has room for - shared by all the nodes
+    uint8_t joinCollisions; // Recent new node request collisions - joining nodes back off more when it's high
     // Remaining packet - only need to process if the packet is for us
     uint8_t dstNodeId;
     uint8_t wirelessDstNodeId;
@@ -76,7 +146,11 @@ typedef struct {
     uint8_t srcNodeId;
     uint8_t srcWirelessNodeId;
     uint8_t bufferLevel;
-    uint8_t spare[2*MAX_TX_NODES_SCHEDULED-2]; // Not used
+    uint8_t sackBitmap; // Selective ack - bit i set if ackSeqNum+2+i has been received
+    uint8_t urgentAckSeqNum;
+    uint8_t urgentBufferLevel; // Urgent packets waiting to be sent
+    uint8_t rxCredits; // Data packets the node has room for
+    uint8_t spare[3*MAX_TX_NODES_SCHEDULED-4]; // Not used - pads the node header to the same size as the master header
     uint8_t data[NODE_PACKET_DATA_SIZE];
 } __attribute__((packed, aligned(2))) tNodePacket;
 
@@ -104,29 +178,59 @@ typedef struct {
         struct {
             uint8_t nextTxNodeId[4];
             uint8_t nextTxNodeAckSeqNum[4];
+            uint8_t nextTxNodeUrgentAckSeqNum[4];
+            uint8_t rxCredits;
+            uint8_t joinCollisions;
             uint8_t dstNodeId;
-            uint8_t spare;
+            uint8_t wirelessDstNodeId;
         } master;
         struct {
             uint8_t ackSeqNum;
             uint8_t srcNodeId;
+            uint8_t srcWirelessNodeId;
             uint8_t bufferLevel;
-            uint8_t spare[7];
+            uint8_t sackBitmap;
+            uint8_t urgentAckSeqNum;
+            uint8_t urgentBufferLevel;
+            uint8_t rxCredits;
+            uint8_t spare[3*MAX_TX_NODES_SCHEDULED-4];
         } node;
     };
 } __attribute__((packed, aligned(2))) tPacketHeader;
 
 
+#define NULL_PACKET_ENTRY_INDEX 0xFF
+
 typedef struct {
     bool inUse;
     // bool valid;
+    uint8_t nextIndex; // Next entry in the same tx queue (sequence number order)
+    uint8_t freeSlot;  // Storage for the free ring - not related to this entry
     tPacket packet;
 } tPacketEntry;
 
+#define PACKET_ENTRY_FROM_PACKET(_packet_) ((tPacketEntry *)((uint8_t *)(_packet_) - offsetof(tPacketEntry, packet)))
+
+// Pool of packet entries with a ring of the free entry indices
+// One thread allocates and one thread frees - each only writes it's own index and count
+// so no locking is needed between them
+typedef struct {
+    tPacketEntry * entries;
+    uint8_t maxEntries;
+    uint8_t allocIndex; // Only written by the allocating thread
+    uint8_t freeIndex;  // Only written by the freeing thread
+    uint32_t numStored; // Only written by the allocating thread
+    uint32_t numFreed;  // Only written by the freeing thread
+} tPacketStore;
+
+#define NODE_BIT(nodeId) (((uint64_t)1) << (nodeId))
+
+// A set of nodes - one bit per node id
+// Iterated round robin in node id order (see getNextNodeInQueue)
 typedef struct {
-    tNodeIndex nodeIds[MAX_NODES]; // A list of nodes that we have outstanding packet for
+    uint64_t bitmap;
     uint8_t numNodes;
-    tNodeIndex lastIndex;
+    tNodeIndex nextNode; // Where getNextNodeInQueue carries on from
 } tNodeQueue;
 
 typedef struct {
@@ -145,13 +249,29 @@ typedef struct {
     uint64_t rxBufferFull;
     uint64_t txBufferFull;
     uint64_t txWindowRestarts;
+    uint64_t rxOutOfOrder; // Stored for selective repeat
+    uint64_t txAckPackets; // Master
+    uint64_t rxAckPackets; // Node - ack packets that had an ack for us
+    uint64_t txDatagrams;
+    uint64_t rxDatagrams;
+    uint32_t datagramsReplaced; // Dropped for a newer datagram before being sent
     uint32_t nodeLeftNw;
     uint32_t nodeJoinedNw;
     uint32_t networkFullCount;
-
-    uint32_t newNodeRequest; // Node
+    uint32_t deadlineOverruns; // Master
+    uint32_t deadlineContractsRejected; // Master
+    uint32_t slotReservationsRejected; // Master
+    uint32_t reservedSlotsDelayed; // Master - pushed back a slot by a master slot
+    uint32_t schedulePlanSlots; // Master - node tx turns replayed from the schedule plan
+    uint32_t schedulePlanInvalidations; // Master - plans thrown away as a node started or stopped sending or changed backlog class
+    uint32_t txCreditStalls; // Data held back as the other end had no room for it
+
+    uint32_t newNodeRequest; // Node - new node requests transmitted
     uint32_t newNodeRequestRx; // Master
+    uint32_t newNodeRequestCollisions; // Master - join request sub-slots that failed their checksum
     uint32_t newNodeAllocated; // Master
+    uint32_t nodeRejoinRequest; // Node
+    uint32_t nodeRejoined; // Master - nodes given their old ID back by a rejoin claim
     uint32_t newNodeAllocatedRx; // Node
 } tNodeStats;
 
@@ -159,6 +279,9 @@ typedef struct {
 #define NULL_SEQUENCE_NUM 255
 #define MAX_SEQUENCE_NUM 255
 
+// How far along the sequence numbers is to from from
+#define SEQUENCE_NUM_DISTANCE(from, to) DECR_AND_WRAP((to), (from), MAX_SEQUENCE_NUM)
+
 #define SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, packetType) ((packet)->protocolVersionAndPacketType = (MICROBUS_VERSION << 4) | (packetType & 0xF))
 #define SET_PACKET_DATA_SIZE(packet, dataSize) (packet)->dataSize1 = (dataSize >> 8); (packet)->dataSize2 = (dataSize & 0xFF)
 
@@ -278,13 +401,23 @@ extern uint64_t wCycleIndex;
 // =========================== //
 // from common.c
 
-void __attribute__((weak)) assertMessage(const char * msg, size_t msgLen);
+void assertMessage(const char * msg, size_t msgLen);
+uint32_t microbusEnterCritical(void);
+void microbusExitCritical(uint32_t state);
+void packetStoreInit(tPacketStore * store, uint8_t maxEntries, tPacketEntry entries[]);
+tPacketEntry * packetStoreAllocate(tPacketStore * store);
+void packetStoreFree(tPacketStore * store, tPacketEntry * entry);
+uint8_t packetStoreNumFree(tPacketStore * store);
+void nodeQueueInit(tNodeQueue * queue);
 bool nodeQueueAdd(tNodeQueue * queue, tNodeIndex nodeId);
+bool nodeQueueContains(tNodeQueue * queue, tNodeIndex nodeId);
+tNodeIndex nodeQueueNextAfter(tNodeQueue * queue, tNodeIndex nodeId);
 void nodeQueueRemove(tNodeQueue * queue, tNodeIndex nodeId);
 void nodeQueueRemoveIfExists(tNodeQueue * queue, tNodeIndex nodeId);
 bool queueReachedEnd(tNodeQueue * queue);
 tNodeIndex getNextNodeInQueue(tNodeQueue * queue);
 
+uint16_t microbusPacketTransferSize(tPacket * packet);
 void microbusPrintPacket(tPacket * packet, bool master, uint32_t nodeId, bool tx, uint8_t numScheduled);
 
 
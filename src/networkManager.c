@@ -16,9 +16,20 @@
 // process to join. The basic idea behind joining is that the master
 // advertises an joining slot occassionally and any node that wants to 
 // join can send their unique ID in a random sub-slot in the packet.
-// If too many try they will back-off. The master will then respond
-// with response packet assigning nodeIds to uniqueIds. Once a node
-// has a node ID it is on the network.
+// Each sub-slot has its own checksum so the master can take every
+// sub-slot only one node used, even when the packet CRC fails, and
+// the rest of the packet is left as zeros for the other nodes.
+// If too many try they will back-off - the window doubles every retry,
+// a node starts with a wider window when the master advertises that
+// sub-slots have been colliding, and every response that lets other
+// nodes in halves it again. The master will then respond with response
+// packet assigning nodeIds to uniqueIds. Once a node has a node ID it
+// is on the network.
+//
+// The join also agrees the sliding window size. The node asks for
+// the largest window its buffers can support and the master replies
+// with that, capped at its own maximum. Both ends then use the agreed
+// window for that node until it leaves the network.
 //
 // Each node then has a TTL (time to live) that get decremented every
 // time it is allocated a tx slot. The TTL is reset every time the node
@@ -26,6 +37,24 @@
 // to send an empty packet just to keep the it's place on the network
 // otherwise the master will assume it has disconnected and remove it.
 //
+// The master doesn't count every TTL down. Only the two steps matter -
+// down to SERVICE_TIME_TO_LIVE and then timed out - so each node is
+// put in a hashed timer wheel bucket for the tick of its next step, and
+// each tick only looks at the nodes in that bucket. Timed out nodes are
+// left in a bitmap for the master to remove.
+//
+// A removed node's ID is held back for a grace period along with the
+// uniqueId that had it. Until the grace period ends every other
+// allocation slot is a rejoin slot for a block of held IDs - each ID
+// has its own sub-slot that only the node that had it writes to, so
+// there is nothing to contend for and it gets its old ID straight back.
+// As its uniqueId is already known it doesn't wait for room in the new
+// node table either. If the node contends instead it is still given its
+// old ID. The block start is in the packet header, which the sub-slot
+// checksums don't cover, so each checksum also includes the ID claimed.
+// A restarted master doesn't know who had which ID so it holds every
+// ID back for a few rounds and takes the claim for each.
+//
 // =============================================================== //
 
 // Node
@@ -45,25 +74,95 @@ bool nodeNwHasNodeTimedOut(int32_t timeToLive) {
     return (timeToLive <= 0);
 }
 
+// Each collided sub-slot is at least one more node trying to join, so spread the requests wider
+uint8_t nodeNwJoinBackoffWindow(uint8_t backoffWindow, uint8_t joinCollisions) {
+    uint32_t window = MIN_NEW_NODE_BACKOFF * (1 + (joinCollisions / 4));
+    return MIN(MAX(backoffWindow, window), MAX_NEW_NODE_BACKOFF);
+}
+
+// Other nodes are getting in so there are fewer left to contend with
+uint8_t nodeNwNarrowJoinBackoff(uint8_t backoffWindow) {
+    return MAX(backoffWindow / 2, MIN_NEW_NODE_BACKOFF);
+}
+
 
 // ======================================== //
 // Master
 
-#define NEW_NODE_RESPONSE_ENTRY_SIZE 9 // uint64_t uniqueId; uint8_t nodeId;
-#define NEW_NODE_REQUEST_ENTRY_SIZE 10 // uint64_t uniqueId, uint16_t checkSum
+#define NEW_NODE_RESPONSE_ENTRY_SIZE 10 // uint64_t uniqueId; uint8_t nodeId; uint8_t windowSize;
+
+// Fletcher-16 with a non-zero start - so an unused (all zero) sub-slot doesn't pass
+// The node ID the entry is for is summed first, it isn't sent in the entry but a corrupted
+// block start in the packet header then fails every sub-slot rather than claiming the wrong IDs
+static uint16_t newNodeRequestChecksum(const uint8_t * entry, tNodeIndex nodeId) {
+    uint16_t sum1 = (0x5A + nodeId) % 255;
+    uint16_t sum2 = (0xA5 + sum1) % 255;
+    for (uint8_t i=0; i<NEW_NODE_REQUEST_ENTRY_SIZE-2; i++) {
+        sum1 = (sum1 + entry[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    return (sum2 << 8) | sum1;
+}
 
-static tNodeIndex getNextFreeNodeId(uint8_t masterNodeTimeToLive[MAX_NODES]) {
+// The window agreed with a node - 0 means the node didn't ask for a size so use the default
+static uint8_t negotiateWindowSize(tNetworkManager * nwManager, uint8_t requestedWindowSize) {
+    if (requestedWindowSize == 0) {
+        requestedWindowSize = SLIDING_WINDOW_SIZE;
+    }
+    return MIN(requestedWindowSize, nwManager->maxWindowSize);
+}
+
+// Move the node to the wheel bucket for its next TTL step. Called from both the SPI interrupt and
+// the timer so the 64 bit bucket updates are done in a critical section
+static void scheduleTtlStep(tNetworkManager * nwManager, tNodeIndex nodeId, uint8_t numTicks) {
+    uint32_t state = microbusEnterCritical();
+    nwManager->ttlWheel[nwManager->ttlEventTick[nodeId] % TTL_WHEEL_SIZE] &= ~NODE_BIT(nodeId);
+    nwManager->ttlEventTick[nodeId] = nwManager->ttlTick + numTicks;
+    nwManager->ttlWheel[nwManager->ttlEventTick[nodeId] % TTL_WHEEL_SIZE] |= NODE_BIT(nodeId);
+    microbusExitCritical(state);
+}
+
+// IDs held back for a rejoin are only used by the node that had them - or once there are no others left
+static tNodeIndex getNextFreeNodeId(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint64_t uniqueId) {
+    tNodeIndex freeNodeId = INVALID_NODE_ID;
+    tNodeIndex reservedNodeId = INVALID_NODE_ID;
     for (uint32_t nodeId = FIRST_NODE_ID; nodeId<MAX_NODES; nodeId++) {
-        if (masterNodeTimeToLive[nodeId] == 0) {
+        if (masterNodeTimeToLive[nodeId] != 0) {
+            continue;
+        }
+        if (!nodeQueueContains(&nwManager->rejoinNodes, nodeId)) {
+            freeNodeId = MIN(freeNodeId, nodeId);
+        } else if (nwManager->nodeUniqueId[nodeId] == uniqueId) {
             return nodeId;
+        } else {
+            reservedNodeId = MIN(reservedNodeId, nodeId);
         }
     }
-    return INVALID_NODE_ID;
+    return (freeNodeId != INVALID_NODE_ID) ? freeNodeId : reservedNodeId;
+}
+
+// Pass the node ID to the node - it's fully joined once it's heard
+static void allocateNodeId(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], tNodeIndex nodeId, uint64_t uniqueId, uint8_t requestedWindowSize) {
+    masterNodeTimeToLive[nodeId] = SERVICE_TIME_TO_LIVE; // So it gets a service slot straight away to confirm it's joined
+    scheduleTtlStep(nwManager, nodeId, SERVICE_TIME_TO_LIVE);
+    nodeQueueRemoveIfExists(&nwManager->rejoinNodes, nodeId);
+    nwManager->nodeUniqueId[nodeId] = uniqueId;
+    nodeWindowSize[nodeId] = negotiateWindowSize(nwManager, requestedWindowSize);
+    nodeQueueAdd(nwManager->activeNodes, nodeId);
+}
+
+static bool isNewNodeRegistered(tNetworkManager * nwManager, uint64_t uniqueId) {
+    for (uint8_t i=0; i<nwManager->numNewNodes; i++) {
+        if (nwManager->newNodeUniqueId[i] == uniqueId) {
+            return true;
+        }
+    }
+    return false;
 }
 
 // Master - Check to see if we are waiting for a response from this uniqueID, 
 // if not assign it a free node ID that will be transmitted later
-void networkManagerRegisterNewNode(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint64_t uniqueId, uint32_t * networkFullCount) {
+void networkManagerRegisterNewNode(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], uint64_t uniqueId, uint8_t requestedWindowSize, uint32_t * networkFullCount) {
     microbusAssert(uniqueId != 0, "");
 
     // Check if there is space in our new nodes allocation queue
@@ -73,30 +172,39 @@ void networkManagerRegisterNewNode(tNetworkManager * nwManager, uint8_t masterNo
     }
 
     // Check if this node has already been registered
-    for (uint8_t i=0; i<nwManager->numNewNodes; i++) {
-        if (nwManager->newNodeUniqueId[i] == uniqueId) {
-            return;
-        }
+    if (isNewNodeRegistered(nwManager, uniqueId)) {
+        return;
     }
 
     // Find free node ID
     // Start at last used - *this is important* - prevents nodes that think they have a node spot continuously getting packets
-    uint8_t nodeId = getNextFreeNodeId(masterNodeTimeToLive);
+    uint8_t nodeId = getNextFreeNodeId(nwManager, masterNodeTimeToLive, uniqueId);
     if(nodeId == INVALID_NODE_ID) {
         (*networkFullCount)++;
         return;
     }
 
     MB_NETWORK_MANAGER_PRINTF("Master - Node:%u partial join - uniqueId:0x%llx\n", nodeId, uniqueId);
-    masterNodeTimeToLive[nodeId] = MASTER_MAX_TIME_TO_LIVE; // TODO: need to bring this down buy scheduling newly join nodes to tx as priority
+    allocateNodeId(nwManager, masterNodeTimeToLive, nodeWindowSize, nodeId, uniqueId, requestedWindowSize);
     uint32_t index = nwManager->numNewNodes;
     nwManager->newNodeUniqueId[index] = uniqueId;
     nwManager->newNodeId[index] = nodeId;
+    nwManager->newNodeWindowSize[index] = nodeWindowSize[nodeId];
     nwManager->numNewNodes++;
-    nodeQueueAdd(nwManager->activeNodes, nodeId);
+}
+
+// Hold the ID back for the node that had it
+void networkManagerRemoveNode(tNetworkManager * nwManager, tNodeIndex nodeId) {
+    microbusAssert(nodeId >= FIRST_NODE_ID && nodeId < MAX_NODES, "");
+    nodeQueueAdd(&nwManager->rejoinNodes, nodeId);
+    scheduleTtlStep(nwManager, nodeId, REJOIN_GRACE_TTL);
 }
 
 bool networkManagerRemoveNewNodeRequest(tNetworkManager * nwManager, tNodeIndex rxNodeId) {
+    if (nodeQueueContains(&nwManager->rejoinPendingNodes, rxNodeId)) {
+        nodeQueueRemove(&nwManager->rejoinPendingNodes, rxNodeId);
+        return true;
+    }
     if (nwManager->numNewNodes > 0) {
         for (uint8_t i=0; i<nwManager->numNewNodes; i++) {
             if (nwManager->newNodeId[i] == rxNodeId) {
@@ -105,6 +213,7 @@ bool networkManagerRemoveNewNodeRequest(tNetworkManager * nwManager, tNodeIndex
                 for (uint8_t j=i; j<nwManager->numNewNodes-1; j++) {
                     nwManager->newNodeUniqueId[j] = nwManager->newNodeUniqueId[j+1];
                     nwManager->newNodeId[j]       = nwManager->newNodeId[j+1];
+                    nwManager->newNodeWindowSize[j] = nwManager->newNodeWindowSize[j+1];
                 }
                 nwManager->numNewNodes--;
                 return true;
@@ -116,13 +225,17 @@ bool networkManagerRemoveNewNodeRequest(tNetworkManager * nwManager, tNodeIndex
 
 void networkManagerRecordRxPacket(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], tNodeIndex rxNodeId) {
     microbusAssert(rxNodeId < MAX_NODES, "");
-    // Received data from this node - so TTL set to max
+    // Received data from this node - so TTL set to max. Can't be split by the timer stepping it down
+    uint32_t state = microbusEnterCritical();
     masterNodeTimeToLive[rxNodeId] = MASTER_MAX_TIME_TO_LIVE;
+    scheduleTtlStep(nwManager, rxNodeId, MASTER_MAX_TIME_TO_LIVE - SERVICE_TIME_TO_LIVE);
+    nwManager->timedOutNodes &= ~NODE_BIT(rxNodeId);
+    microbusExitCritical(state);
     // MB_NETWORK_MANAGER_PRINTF("Master - Node:%u heard, TTL reset:%u\n", rxNodeId, masterNodeTimeToLive[rxNodeId]);
 
     // If a node we've recently given a nodeId to starts transmitting then it's heard our reponse and 
     // joined the network so we can remove it from our allocation table
-    if (nwManager->numNewNodes > 0) {
+    if (nwManager->numNewNodes > 0 || nwManager->rejoinPendingNodes.numNodes > 0) {
         bool found = networkManagerRemoveNewNodeRequest(nwManager, rxNodeId);
         if (found) {
             MB_PRINTF("Node:%u - fully joined\n", rxNodeId);
@@ -137,66 +250,170 @@ void networkManagerUpdateTimeUs(tNetworkManager * nwManager, uint8_t masterNodeT
     // Increment a global timer
     nwManager->timeToLiveTimeUs += usIncr;
 
-    // When global timer is above a certain level update all counts
+    // When global timer is above a certain level step the TTL of the nodes due this tick
     if (nwManager->timeToLiveTimeUs >= TIME_TO_LIVE_UPDATE_TIME_US) {
         nwManager->timeToLiveTimeUs -= TIME_TO_LIVE_UPDATE_TIME_US;
-        
-        for (uint32_t nodeId=FIRST_NODE_ID; nodeId<MAX_NODES; nodeId++) {
-            if (masterNodeTimeToLive[nodeId] > 0 && masterNodeTimeToLive[nodeId] != REMOVE_NODE_TTL) {
-                masterNodeTimeToLive[nodeId]--;
-                if (masterNodeTimeToLive[nodeId] == 0) {
-                    // Mark it as needing to be removed
-                    masterNodeTimeToLive[nodeId] = REMOVE_NODE_TTL;
-                }
+        nwManager->ttlTick++;
+
+        // The SPI interrupt resets the TTLs, moves nodes round the wheel and adds join collisions
+        uint32_t state = microbusEnterCritical();
+        nwManager->joinCollisions -= (nwManager->joinCollisions + 7) / 8; // Decays once nodes stop colliding
+        uint64_t * bucket = &nwManager->ttlWheel[nwManager->ttlTick % TTL_WHEEL_SIZE];
+        uint64_t nodes = *bucket;
+        while (nodes) {
+            tNodeIndex nodeId = __builtin_ctzll(nodes);
+            nodes &= nodes - 1;
+            if (nwManager->ttlEventTick[nodeId] != nwManager->ttlTick) {
+                continue; // Due a later time round the wheel
+            }
+            *bucket &= ~NODE_BIT(nodeId);
+            if (masterNodeTimeToLive[nodeId] == 0) {
+                // Grace period over - the ID can go to anyone
+                nodeQueueRemoveIfExists(&nwManager->rejoinNodes, nodeId);
+                nwManager->nodeUniqueId[nodeId] = 0;
+            } else if (masterNodeTimeToLive[nodeId] > SERVICE_TIME_TO_LIVE) {
+                masterNodeTimeToLive[nodeId] = SERVICE_TIME_TO_LIVE;
+                scheduleTtlStep(nwManager, nodeId, SERVICE_TIME_TO_LIVE);
+            } else {
+                // Mark it as needing to be removed
+                masterNodeTimeToLive[nodeId] = REMOVE_NODE_TTL;
+                nwManager->timedOutNodes |= NODE_BIT(nodeId);
             }
         }
+        microbusExitCritical(state);
     }
 }
 
+// The master has removed it
+void networkManagerClearTimedOutNode(tNetworkManager * nwManager, tNodeIndex nodeId) {
+    uint32_t state = microbusEnterCritical();
+    nwManager->timedOutNodes &= ~NODE_BIT(nodeId);
+    microbusExitCritical(state);
+}
+
 // ======================================== //
 // Packets
 
+// Writes one sub-slot entry - the packet data is zeroed so the other sub-slots are left for other nodes
+static void txNewNodeRequestEntry(tPacket * packet, tPacketType packetType, tNodeIndex srcNodeId, uint64_t uniqueId, uint8_t windowSize, uint8_t subSlot, tNodeIndex nodeId) {
+    microbusAssert(subSlot < NEW_NODE_REQUEST_SUB_SLOTS, "");
+    SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, packetType);
+    packet->node.srcNodeId = srcNodeId;
+    uint16_t dataSize = NEW_NODE_REQUEST_SUB_SLOTS * NEW_NODE_REQUEST_ENTRY_SIZE;
+    SET_PACKET_DATA_SIZE(packet, dataSize);
+    memset(packet->node.data, 0, dataSize);
+    uint8_t * entry = &packet->node.data[subSlot * NEW_NODE_REQUEST_ENTRY_SIZE];
+    memcpy(&entry[0], &uniqueId, 8);
+    entry[8] = windowSize;
+    uint16_t checkSum = newNodeRequestChecksum(entry, nodeId);
+    memcpy(&entry[9], &checkSum, 2);
+}
+
+// The uniqueId in a sub-slot - 0 if it's unused or more than one node wrote to it
+static uint64_t rxNewNodeRequestEntry(tPacket * packet, uint8_t subSlot, tNodeIndex nodeId, uint8_t * windowSize, bool * collision) {
+    const uint8_t * entry = &packet->node.data[subSlot * NEW_NODE_REQUEST_ENTRY_SIZE];
+    uint64_t uniqueId;
+    uint16_t checkSum;
+    memcpy(&uniqueId, &entry[0], 8);
+    memcpy(&checkSum, &entry[9], 2);
+    *windowSize = entry[8];
+    if (checkSum != newNodeRequestChecksum(entry, nodeId) || uniqueId == 0) {
+        *collision = (uniqueId != 0 || checkSum != 0);
+        return 0;
+    }
+    *collision = false;
+    return uniqueId;
+}
+
 // Node - Ask for a node ID
-tPacket * txNewNodeRequest(tPacket * packet, uint64_t uniqueId) {
-    // TODO: this needs a backoff!
-    
-    SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, NEW_NODE_REQUEST_PACKET);
-    packet->node.srcNodeId = UNALLOCATED_NODE_ID;
-    packet->dataSize1 = 0;
-    packet->dataSize2 = 9;
-    memcpy(&packet->node.data[0], &uniqueId, 8);
+tPacket * txNewNodeRequest(tPacket * packet, uint64_t uniqueId, uint8_t windowSize, uint8_t subSlot) {
+    txNewNodeRequestEntry(packet, NEW_NODE_REQUEST_PACKET, UNALLOCATED_NODE_ID, uniqueId, windowSize, subSlot, UNALLOCATED_NODE_ID);
     return packet;
 }
 
-// Master
-void rxNewNodePacketRequest(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], tPacket * packet, uint32_t * networkFullCount) {
-    uint64_t uniqueId;
-    microbusAssert(packet->dataSize2 == 9, "");
-    memcpy(&uniqueId, &packet->node.data[0], 8);
-    networkManagerRegisterNewNode(nwManager, masterNodeTimeToLive, uniqueId, networkFullCount);
+// Master - every sub-slot is checked on its own, sub-slots used by more than one node fail their checksum
+void rxNewNodePacketRequest(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], tPacket * packet, uint32_t * networkFullCount, uint32_t * collisionCount) {
+    uint8_t numEntries = MIN(GET_PACKET_DATA_SIZE(packet), NODE_PACKET_DATA_SIZE) / NEW_NODE_REQUEST_ENTRY_SIZE;
+    uint8_t numCollisions = 0;
+    for (uint8_t i=0; i<numEntries; i++) {
+        uint8_t windowSize;
+        bool collision;
+        uint64_t uniqueId = rxNewNodeRequestEntry(packet, i, UNALLOCATED_NODE_ID, &windowSize, &collision);
+        if (uniqueId == 0) {
+            numCollisions += collision ? 1 : 0;
+            continue;
+        }
+        networkManagerRegisterNewNode(nwManager, masterNodeTimeToLive, nodeWindowSize, uniqueId, windowSize, networkFullCount);
+    }
+    *collisionCount += numCollisions;
+    // Moving average - joinCollisions settles at 4x the collisions per request
+    // The timer decays it too
+    uint32_t state = microbusEnterCritical();
+    nwManager->joinCollisions = MIN(nwManager->joinCollisions - (nwManager->joinCollisions / 4) + numCollisions, 255);
+    microbusExitCritical(state);
 }
 
-// Master
-void txNewNodeResponse(tNetworkManager * nwManager, tPacket * packet) {
+// Node - Claim back the ID we had in its sub-slot of the rejoin slot for the block starting at firstNodeId
+tPacket * txRejoinRequest(tPacket * packet, uint64_t uniqueId, uint8_t windowSize, tNodeIndex firstNodeId, tNodeIndex nodeId) {
+    microbusAssert(nodeId >= firstNodeId, "");
+    txNewNodeRequestEntry(packet, NODE_REJOIN_PACKET, firstNodeId, uniqueId, windowSize, nodeId - firstNodeId, nodeId);
+    return packet;
+}
+
+// Master - the claims are confirmed with a normal new node response, returns how many were accepted
+uint8_t rxRejoinRequest(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], tPacket * packet) {
+    tNodeIndex firstNodeId = packet->node.srcNodeId;
+    uint8_t numEntries = MIN(GET_PACKET_DATA_SIZE(packet), NODE_PACKET_DATA_SIZE) / NEW_NODE_REQUEST_ENTRY_SIZE;
+    uint8_t numRejoined = 0;
+    for (uint8_t i=0; i<numEntries && firstNodeId + i < MAX_NODES; i++) {
+        tNodeIndex nodeId = firstNodeId + i;
+        uint8_t windowSize;
+        bool collision;
+        uint64_t uniqueId = rxNewNodeRequestEntry(packet, i, nodeId, &windowSize, &collision);
+        if (uniqueId == 0 || !nodeQueueContains(&nwManager->rejoinNodes, nodeId) || masterNodeTimeToLive[nodeId] != 0) {
+            continue;
+        }
+        // Nothing is known about who had it after a master restart
+        if (nwManager->nodeUniqueId[nodeId] != 0 && nwManager->nodeUniqueId[nodeId] != uniqueId) {
+            continue;
+        }
+        if (isNewNodeRegistered(nwManager, uniqueId)) {
+            continue;
+        }
+        // Unlike a new node the ID and uniqueId are already known so it doesn't need the new node table
+        MB_NETWORK_MANAGER_PRINTF("Master - Node:%u rejoin - uniqueId:0x%llx\n", nodeId, uniqueId);
+        allocateNodeId(nwManager, masterNodeTimeToLive, nodeWindowSize, nodeId, uniqueId, windowSize);
+        nodeQueueAdd(&nwManager->rejoinPendingNodes, nodeId);
+        numRejoined++;
+    }
+    return numRejoined;
+}
+
+static void txNewNodeResponseEntry(tPacket * packet, uint8_t num, uint64_t uniqueId, tNodeIndex nodeId, uint8_t windowSize) {
+    MB_NETWORK_MANAGER_PRINTF_WITHOUT_NEW_LINE(" %u:0x%llx, ", nodeId, uniqueId);
+    memcpy(&packet->master.data[num*NEW_NODE_RESPONSE_ENTRY_SIZE], &uniqueId, 8);
+    packet->master.data[8 + num*NEW_NODE_RESPONSE_ENTRY_SIZE] = nodeId;
+    packet->master.data[9 + num*NEW_NODE_RESPONSE_ENTRY_SIZE] = windowSize;
+}
+
+// Master - any room left after the new nodes goes to the rejoined nodes in turn
+void txNewNodeResponse(tNetworkManager * nwManager, uint8_t nodeWindowSize[MAX_NODES], tPacket * packet) {
     SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, NEW_NODE_RESPONSE_PACKET);
     packet->master.dstNodeId = UNALLOCATED_NODE_ID;
 
     MB_NETWORK_MANAGER_PRINTF("%s", "Master, Tx new node response:");
     
-    uint8_t maxNum = MIN(nwManager->numNewNodes, MASTER_PACKET_DATA_SIZE / NEW_NODE_RESPONSE_ENTRY_SIZE);
+    uint8_t maxNum = MASTER_PACKET_DATA_SIZE / NEW_NODE_RESPONSE_ENTRY_SIZE;
     uint8_t num = 0;
-    for (uint8_t i=0; i<MAX_NODES_ALLOCATED_AT_ONCE; i++) {
-        if (nwManager->newNodeUniqueId[i] > 0) {
-            uint64_t uniqueId = nwManager->newNodeUniqueId[i];
-            uint8_t nodeId = nwManager->newNodeId[i];
-            MB_NETWORK_MANAGER_PRINTF_WITHOUT_NEW_LINE(" %u:0x%llx, ", nodeId, uniqueId);
-            memcpy(&packet->master.data[num*NEW_NODE_RESPONSE_ENTRY_SIZE], &uniqueId, 8);
-            packet->master.data[8 + num*NEW_NODE_RESPONSE_ENTRY_SIZE] = nodeId;
-            num++;
-            if (num == maxNum) {
-                break;
-            }
-        }
+    for (uint8_t i=0; i<nwManager->numNewNodes && num<maxNum; i++) {
+        txNewNodeResponseEntry(packet, num, nwManager->newNodeUniqueId[i], nwManager->newNodeId[i], nwManager->newNodeWindowSize[i]);
+        num++;
+    }
+    uint8_t numRejoined = MIN(nwManager->rejoinPendingNodes.numNodes, maxNum - num);
+    for (uint8_t i=0; i<numRejoined; i++) {
+        tNodeIndex nodeId = getNextNodeInQueue(&nwManager->rejoinPendingNodes);
+        txNewNodeResponseEntry(packet, num, nwManager->nodeUniqueId[nodeId], nodeId, nodeWindowSize[nodeId]);
+        num++;
     }
     
     MB_NETWORK_MANAGER_PRINTF_WITHOUT_NEW_LINE("%s", "\n");
@@ -207,7 +424,7 @@ void txNewNodeResponse(tNetworkManager * nwManager, tPacket * packet) {
 }
 
 // Node - Process the new node response - return the node ID if we've been allocated one
-void rxNewNodePacketResponse(tPacket * packet, uint64_t uniqueId, tNodeIndex * nodeId, int32_t * timeToLive, uint32_t * statsNodeJoined) {
+void rxNewNodePacketResponse(tPacket * packet, uint64_t uniqueId, tNodeIndex * nodeId, uint8_t * windowSize, int32_t * timeToLive, uint32_t * statsNodeJoined) {
     uint16_t dataSize = GET_PACKET_DATA_SIZE(packet);
     uint8_t numEntries = dataSize / NEW_NODE_RESPONSE_ENTRY_SIZE;
 
@@ -217,6 +434,7 @@ void rxNewNodePacketResponse(tPacket * packet, uint64_t uniqueId, tNodeIndex * n
         uint8_t tmpNodeId = packet->master.data[i*NEW_NODE_RESPONSE_ENTRY_SIZE + 8];
         if (rxUniqueId == uniqueId) {
             *nodeId = tmpNodeId;
+            *windowSize = packet->master.data[i*NEW_NODE_RESPONSE_ENTRY_SIZE + 9];
             (*statsNodeJoined)++;
             *timeToLive = NODE_TIMEOUT_US;
             MB_PRINTF("Node:%u - joined - uniqueId:0x%llx\n", tmpNodeId, uniqueId);
@@ -229,5 +447,24 @@ void rxNewNodePacketResponse(tPacket * packet, uint64_t uniqueId, tNodeIndex * n
 
 void networkManagerInit(tNetworkManager * nwManager, tNodeQueue * activeNodes) {
     nwManager->activeNodes = activeNodes;
+    nwManager->maxWindowSize = SLIDING_WINDOW_SIZE;
+    nodeQueueInit(&nwManager->rejoinNodes);
+    nodeQueueInit(&nwManager->rejoinPendingNodes);
+}
+
+// The master may have restarted under nodes that were on the network - give them a chance to claim their IDs back
+void networkManagerReserveAllNodeIds(tNetworkManager * nwManager) {
+    for (tNodeIndex nodeId = FIRST_NODE_ID; nodeId < MAX_NODES; nodeId++) {
+        if (!nodeQueueContains(nwManager->activeNodes, nodeId)) {
+            nodeQueueAdd(&nwManager->rejoinNodes, nodeId);
+            nwManager->nodeUniqueId[nodeId] = 0;
+            scheduleTtlStep(nwManager, nodeId, RESTART_REJOIN_TTL);
+        }
+    }
+}
+
+void networkManagerSetMaxWindowSize(tNetworkManager * nwManager, uint8_t maxWindowSize) {
+    microbusAssert(maxWindowSize > 0 && maxWindowSize <= MAX_SLIDING_WINDOW_SIZE, "");
+    nwManager->maxWindowSize = maxWindowSize;
 }
 
@@ -23,38 +23,76 @@
 #define MASTER_MAX_TIME_TO_LIVE  128
 #define TIME_TO_LIVE_UPDATE_TIME_US (MASTER_TIMEOUT_US / MASTER_MAX_TIME_TO_LIVE)
 
+// Nodes are kept in a hashed timer wheel by the tick their TTL next steps down
+#define TTL_WHEEL_SIZE 16 // Must divide 256 (the tick wraps at 256)
+
+#if SERVICE_TIME_TO_LIVE >= MASTER_MAX_TIME_TO_LIVE
+    #error "Nodes would be serviced straight after being heard"
+#endif
+
+// Join requests back off over a window of unallocated slots that doubles every unanswered retry
+// and halves every time a join response lets other nodes in
 // Based on simulations max_nodes/2 gives a good performance
+#define MIN_NEW_NODE_BACKOFF 2
 #define MAX_NEW_NODE_BACKOFF (MAX_NODES/2)
 
 #define MAX_NODES_ALLOCATED_AT_ONCE 10
 
 #define REMOVE_NODE_TTL 0xFF
 
+// How many TTL ticks a removed node's ID is held back for it to rejoin
+#define REJOIN_GRACE_TTL MASTER_MAX_TIME_TO_LIVE
+// After a master reset the IDs nobody claims are only held back for a few rounds of rejoin slots
+// (a rejoin slot every other allocation slot and an allocation slot every other slot - most of them empty)
+#define REJOIN_SWEEP_SLOTS (4 * ((MAX_NODES + NEW_NODE_REQUEST_SUB_SLOTS - 1) / NEW_NODE_REQUEST_SUB_SLOTS))
+#define RESTART_REJOIN_TTL (((4 * REJOIN_SWEEP_SLOTS * SLOT_TIME_FOR_BYTES_US(MB_HEADER_SIZE)) / TIME_TO_LIVE_UPDATE_TIME_US) + 2)
+// How long a node that has lost its ID keeps claiming it back before joining like a new node
+// (the master removes it MASTER_TIMEOUT_US - NODE_TIMEOUT_US after it gave up, then a few rounds of full rejoin slots)
+#define NODE_REJOIN_TIMEOUT_US ((MASTER_TIMEOUT_US - NODE_TIMEOUT_US) + (4 * REJOIN_SWEEP_SLOTS * SLOT_TIME_US))
+
 typedef struct {
     uint64_t newNodeUniqueId[MAX_NODES_ALLOCATED_AT_ONCE];
     uint8_t newNodeId[MAX_NODES_ALLOCATED_AT_ONCE];
+    uint8_t newNodeWindowSize[MAX_NODES_ALLOCATED_AT_ONCE];
     uint8_t numNewNodes;
+    uint8_t maxWindowSize; // Cap on the sliding window a node can negotiate when it joins
     tNodeQueue * activeNodes;
-    uint32_t timeToLiveTimeUs; // Once this counter reaches a certain time decrement all node TTL counts
+    uint32_t timeToLiveTimeUs; // Once this counter reaches a certain time the TTL tick moves on
+    uint8_t ttlTick;
+    uint8_t ttlEventTick[MAX_NODES];   // When each node's TTL next steps down
+    uint64_t ttlWheel[TTL_WHEEL_SIZE]; // Nodes by ttlEventTick % TTL_WHEEL_SIZE
+    uint64_t timedOutNodes;            // Waiting to be removed by the master
+    uint8_t joinCollisions; // Average collided sub-slots per new node request (in quarters), advertised to joining nodes
+    uint64_t nodeUniqueId[MAX_NODES]; // Who each ID was given to - 0 if unknown
+    tNodeQueue rejoinNodes;           // IDs held back for the node that had them
+    tNodeQueue rejoinPendingNodes;    // Given back by a rejoin claim but not heard from since
 } tNetworkManager;
 
 // Master only
 void networkManagerInit(tNetworkManager * nwManager, tNodeQueue * activeNodes);
 void networkManagerRecordRxPacket(tNetworkManager * nwManager, uint8_t nodeTTL[MAX_NODES], tNodeIndex rxNodeId);
 bool networkManagerRemoveNewNodeRequest(tNetworkManager * nwManager, tNodeIndex nodeId);
-void networkManagerRegisterNewNode(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint64_t uniqueId, uint32_t * networkFullCount);
+void networkManagerRegisterNewNode(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], uint64_t uniqueId, uint8_t requestedWindowSize, uint32_t * networkFullCount);
+void networkManagerSetMaxWindowSize(tNetworkManager * nwManager, uint8_t maxWindowSize);
 void networkManagerUpdateTimeUs(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint32_t usIncr);
+void networkManagerClearTimedOutNode(tNetworkManager * nwManager, tNodeIndex nodeId);
+void networkManagerRemoveNode(tNetworkManager * nwManager, tNodeIndex nodeId);
+void networkManagerReserveAllNodeIds(tNetworkManager * nwManager);
 
 // Node only
 void nodeNwRecordTxPacketSent(int32_t * timeToLive);
+uint8_t nodeNwJoinBackoffWindow(uint8_t backoffWindow, uint8_t joinCollisions);
+uint8_t nodeNwNarrowJoinBackoff(uint8_t backoffWindow);
 bool nodeNwHasNodeTimedOut(int32_t timeToLive);
 void nodeNwUpdateTimeUs(int32_t * timeToLive, uint32_t usIncr);
 
 // Packet specific calls
-tPacket * txNewNodeRequest(tPacket * packet, uint64_t uniqueId);
-void rxNewNodePacketRequest(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], tPacket * packet, uint32_t * networkFullCount);
-void txNewNodeResponse(tNetworkManager * nwManager, tPacket * packet);
-void rxNewNodePacketResponse(tPacket * packet, uint64_t uniqueId, tNodeIndex * nodeId, int32_t * timeToLive, uint32_t * statsNodeJoined);
+tPacket * txNewNodeRequest(tPacket * packet, uint64_t uniqueId, uint8_t windowSize, uint8_t subSlot);
+void rxNewNodePacketRequest(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], tPacket * packet, uint32_t * networkFullCount, uint32_t * collisionCount);
+tPacket * txRejoinRequest(tPacket * packet, uint64_t uniqueId, uint8_t windowSize, tNodeIndex firstNodeId, tNodeIndex nodeId);
+uint8_t rxRejoinRequest(tNetworkManager * nwManager, uint8_t masterNodeTimeToLive[MAX_NODES], uint8_t nodeWindowSize[MAX_NODES], tPacket * packet);
+void txNewNodeResponse(tNetworkManager * nwManager, uint8_t nodeWindowSize[MAX_NODES], tPacket * packet);
+void rxNewNodePacketResponse(tPacket * packet, uint64_t uniqueId, tNodeIndex * nodeId, uint8_t * windowSize, int32_t * timeToLive, uint32_t * statsNodeJoined);
 
 
 
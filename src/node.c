@@ -28,6 +28,38 @@ static int customRand(void) {
 
 // ==================================================================== //
 
+// Selective repeat - keep packets that arrive after a missing one
+static void nodeSelectiveRepeatCheckSeqNum(tNode * node, tPacketEntry * packetEntry) {
+    uint8_t seqNumOffset = rxPacketSeqNumOffset(&node->txManager, MASTER_NODE_ID, packetEntry->packet.txSeqNum);
+    if (seqNumOffset == 0) {
+        node->validRxSeqNum = rxPacketCheckAndUpdateSeqNum(&node->txManager, MASTER_NODE_ID, packetEntry->packet.txSeqNum, false);
+        // Any stored packets straight after this one can go out as well - so ack them now
+        node->numInOrderRxEntries = rxManagerTakeInOrder(&node->rxPacketManager, node->inOrderRxEntries);
+        rxAdvanceSeqNum(&node->txManager, MASTER_NODE_ID, node->numInOrderRxEntries);
+    } else {
+        node->validRxSeqNum = false;
+        node->rxStoredOutOfOrder = rxManagerStoreOutOfOrder(&node->rxPacketManager, seqNumOffset, packetEntry);
+        if (node->rxStoredOutOfOrder) {
+            node->stats.rxOutOfOrder++;
+        }
+    }
+}
+
+static void nodeRecordAckFromAckPacket(tNode * node, tPacket * rxPacket) {
+    uint16_t numEntries = MIN(GET_PACKET_DATA_SIZE(rxPacket) / MASTER_ACK_ENTRY_SIZE, MAX_MASTER_ACK_ENTRIES);
+    for (uint16_t i=0; i<numEntries; i++) {
+        uint8_t entryNodeId = rxPacket->master.data[i*MASTER_ACK_ENTRY_SIZE];
+        if (entryNodeId == node->nodeId) {
+            node->savedRxAckValid = true;
+            node->savedRxAck = rxPacket->master.data[i*MASTER_ACK_ENTRY_SIZE + 1];
+            node->stats.rxAckPackets++;
+        } else if (entryNodeId == (node->nodeId | URGENT_ACK_ENTRY_FLAG)) {
+            node->savedRxUrgentAckValid = true;
+            node->savedRxUrgentAck = rxPacket->master.data[i*MASTER_ACK_ENTRY_SIZE + 1];
+        }
+    }
+}
+
 void nodeQuickProcessPrevRx(tNode * node, bool rxCrcError) {
     if (!node->initialised) {
         return;
@@ -36,6 +68,9 @@ void nodeQuickProcessPrevRx(tNode * node, bool rxCrcError) {
     tPacket * rxPacket = &node->prevRxPacketEntry->packet;
     node->validRxPacket = false;
     node->savedRxAckValid = false;
+    node->savedRxUrgentAckValid = false;
+    node->rxStoredOutOfOrder = false;
+    node->numInOrderRxEntries = 0;
 
     // New node requests have their own CRC as multiple nodes can transmit in that packet slot
     if (rxCrcError) {
@@ -62,13 +97,22 @@ void nodeQuickProcessPrevRx(tNode * node, bool rxCrcError) {
     for (uint8_t i=0; i<MAX_TX_NODES_SCHEDULED; i++) {
         node->nextTxNodeId[i] = rxPacket->master.nextTxNodeId[i];
     }
+    node->masterRxCredits = rxPacket->master.rxCredits;
+    node->masterJoinCollisions = rxPacket->master.joinCollisions;
 
     if (node->nodeId != UNALLOCATED_NODE_ID) {
+        // Ack packets can have an ack for us even if we're not in the schedule
+        if (GET_PACKET_TYPE(rxPacket) == MASTER_ACK_PACKET) {
+            nodeRecordAckFromAckPacket(node, rxPacket);
+        }
         // Record the acks for us - even if the packet is not for us
+        // (these are filled in last by the master so take priority)
         for (uint8_t i=0; i<MAX_TX_NODES_SCHEDULED; i++) {
             if (rxPacket->master.nextTxNodeId[i] == node->nodeId) {
                 node->savedRxAckValid = true;
                 node->savedRxAck = rxPacket->master.nextTxNodeAckSeqNum[i];
+                node->savedRxUrgentAckValid = true;
+                node->savedRxUrgentAck = rxPacket->master.nextTxNodeUrgentAckSeqNum[i];
             }
         }
     }
@@ -91,7 +135,15 @@ void nodeQuickProcessPrevRx(tNode * node, bool rxCrcError) {
         node->validRxSeqNum = true;
         if (node->nodeId != UNALLOCATED_NODE_ID) {
             if (GET_PACKET_TYPE(rxPacket) == MASTER_DATA_PACKET) {
-                node->validRxSeqNum = rxPacketCheckAndUpdateSeqNum(&node->txManager, MASTER_NODE_ID, rxPacket->txSeqNum, false);
+                if (MICROBUS_SELECTIVE_REPEAT) {
+                    nodeSelectiveRepeatCheckSeqNum(node, node->prevRxPacketEntry);
+                } else {
+                    node->validRxSeqNum = rxPacketCheckAndUpdateSeqNum(&node->txManager, MASTER_NODE_ID, rxPacket->txSeqNum, false);
+                }
+            } else if (GET_PACKET_TYPE(rxPacket) == MASTER_URGENT_DATA_PACKET) {
+                // Urgent packets are go-back-N (the small window doesn't need selective repeat)
+                uint8_t lane = TX_LANE(&node->txManager, MASTER_NODE_ID, TX_PRIORITY_URGENT);
+                node->validRxSeqNum = rxPacketCheckAndUpdateSeqNum(&node->txManager, lane, rxPacket->txSeqNum, false);
             }
         }
     } else {
@@ -112,7 +164,24 @@ static void nodeProcessRxData(tNode * node, tPacketEntry * packetEntry) {
         if (packetType == NEW_NODE_RESPONSE_PACKET) {
             if (node->sentNewNodeRequest) {
                 node->stats.newNodeAllocatedRx++;
-                rxNewNodePacketResponse(packet, node->uniqueId, &node->nodeId, &node->timeToLive, &node->stats.nodeJoinedNw);
+                uint8_t windowSize = 0;
+                rxNewNodePacketResponse(packet, node->uniqueId, &node->nodeId, &windowSize, &node->timeToLive, &node->stats.nodeJoinedNw);
+                if (node->nodeId == UNALLOCATED_NODE_ID && GET_PACKET_DATA_SIZE(packet) > 0) {
+                    // Not us but requests are getting through
+                    node->newNodeBackoff = nodeNwNarrowJoinBackoff(node->newNodeBackoff);
+                }
+                if (node->nodeId != UNALLOCATED_NODE_ID) {
+                    // Any join packet still waiting would go out in our first slot instead of our data
+                    node->prevNodeId = INVALID_NODE_ID;
+                    node->nextTxPacket = NULL;
+                }
+                if (windowSize > 0) {
+                    // Window agreed with the master - used in both directions
+                    // It comes off the wire so never go past what our buffers were sized for
+                    windowSize = MIN(windowSize, node->requestedWindowSize);
+                    node->txManager.txWindowSize[0] = windowSize;
+                    node->rxPacketManager.windowSize = windowSize;
+                }
             }
         }
     } else {
@@ -122,12 +191,35 @@ static void nodeProcessRxData(tNode * node, tPacketEntry * packetEntry) {
                 case MASTER_DATA_PACKET:
                     microbusAssert(packet->dataSize1 > 0 || packet->dataSize2 > 0, "");
                     // if(rxPacketCheckAndUpdateSeqNum(&node->txManager, MASTER_NODE_ID, packet->txSeqNum, false)) {
+                    if (node->validRxSeqNum) {
+                        node->stats.rxDataPackets++;
+                        addRxDataPacket(&node->rxPacketManager, packetEntry);
+                        packetStored = true;
+                        // Followed by any out of order packets it completes
+                        for (uint8_t i=0; i<node->numInOrderRxEntries; i++) {
+                            node->stats.rxDataPackets++;
+                            addRxDataPacket(&node->rxPacketManager, node->inOrderRxEntries[i]);
+                        }
+                        node->numInOrderRxEntries = 0;
+                    } else if (node->rxStoredOutOfOrder) {
+                        packetStored = true;
+                    }
+                    break;
+                case MASTER_URGENT_DATA_PACKET:
+                    microbusAssert(packet->dataSize1 > 0 || packet->dataSize2 > 0, "");
                     if (node->validRxSeqNum) {
                         node->stats.rxDataPackets++;
                         addRxDataPacket(&node->rxPacketManager, packetEntry);
                         packetStored = true;
                     }
                     break;
+                case MASTER_DATAGRAM_PACKET:
+                    // No sequence number to check - it's always kept if there is room
+                    microbusAssert(packet->dataSize1 > 0 || packet->dataSize2 > 0, "");
+                    node->stats.rxDatagrams++;
+                    addRxDataPacket(&node->rxPacketManager, packetEntry);
+                    packetStored = true;
+                    break;
                 default:
                     node->stats.rxInvalidPacketType++;
                     break;
@@ -137,7 +229,7 @@ static void nodeProcessRxData(tNode * node, tPacketEntry * packetEntry) {
 
     if (!packetStored) {
         // Free the packet
-        packetEntry->inUse = false;
+        rxManagerFreePacket(&node->rxPacketManager, packetEntry);
     }
 }
 
@@ -145,6 +237,12 @@ static void nodeProcessRxData(tNode * node, tPacketEntry * packetEntry) {
 // Update Schedule
 
 void nodeUpdateSchedule(tNode * node) {
+    // Flow control - the master's credits are shared so each node slot since its last packet may
+    // have used one
+    bool nodeSlot = (node->currentTxNodeId >= FIRST_NODE_ID) && (node->currentTxNodeId < MAX_NODES);
+    if (nodeSlot && node->masterRxCredits > 0 && node->masterRxCredits != RX_CREDITS_UNLIMITED) {
+        node->masterRxCredits--;
+    }
     // Shift down
     node->currentTxNodeId = node->nextTxNodeId[0];
     for (uint8_t i=0; i<MAX_TX_NODES_SCHEDULED-1; i++) {
@@ -158,6 +256,32 @@ void nodeUpdateSchedule(tNode * node) {
 // ========================================= //
 // Process Tx
 
+static tPacket * nodeGetEmptyTxPacket(tNode * node) {
+    // Alternate between 2 empty packet headers
+    // This is because the packet memory is only DMA'd a cycle later
+    node->tmpPacketCycle++;
+    if (node->tmpPacketCycle >= 2) {
+        node->tmpPacketCycle = 0;
+    }
+    tPacketHeader * txPacketHeader = &node->tmpEmptyPacketHeader[node->tmpPacketCycle];
+    SET_PROTOCOL_VERSION_AND_PACKET_TYPE(txPacketHeader, NODE_EMPTY_PACKET);
+    SET_PACKET_DATA_SIZE(txPacketHeader, 0);
+    txPacketHeader->node.srcNodeId = node->nodeId;
+    txPacketHeader->txSeqNum = INVALID_SEQUENCE_NUM;
+    txPacketHeader->node.ackSeqNum = node->txManager.rxSeqNum[MASTER_NODE_ID];
+    // MB_TX_MANAGER_PRINTF("Node:%u Prepare Tx Empty packet\n", node->nodeId);
+    return (tPacket *)txPacketHeader; // A bit hacky - the DMA will access a few hundred bytes beyond the packet header
+}
+
+// Binary exponential backoff - a node that gets in stops asking so every retry was unanswered
+static uint8_t nodeGetJoinBackoff(tNode * node, bool retry) {
+    uint8_t window = nodeNwJoinBackoffWindow(node->newNodeBackoff, node->masterJoinCollisions);
+    if (retry) {
+        node->newNodeBackoff = MIN(window * 2, MAX_NEW_NODE_BACKOFF);
+    }
+    return customRand() % window;
+}
+
 static void nodeProcessTx(tNode * node) {
     tPacket * txPacket = NULL;
     // Prepare the next packet for when it's our turn
@@ -165,8 +289,14 @@ static void nodeProcessTx(tNode * node) {
     // If we haven't sent the last packet (and that packet wasn't just an empty packet)
     // then keep trying (don't get the next one)
     if (node->nextTxPacket) {
-        if ((GET_PACKET_TYPE(node->nextTxPacket) == NODE_DATA_PACKET)
-             || (GET_PACKET_TYPE(node->nextTxPacket) == NEW_NODE_REQUEST_PACKET)) {
+        if (IS_NODE_DATA_PACKET(GET_PACKET_TYPE(node->nextTxPacket))
+             || (GET_PACKET_TYPE(node->nextTxPacket) == NEW_NODE_REQUEST_PACKET)
+             || (GET_PACKET_TYPE(node->nextTxPacket) == NODE_REJOIN_PACKET && node->rejoinTimeUs > 0)) {
+            return;
+        }
+        // Still waiting for our slot - but if there's a newer datagram send that instead
+        if (GET_PACKET_TYPE(node->nextTxPacket) == NODE_DATAGRAM_PACKET) {
+            node->nextTxPacket = datagramRefreshTxPacket(&node->datagrams, &node->stats.datagramsReplaced);
             return;
         }
     }
@@ -175,39 +305,33 @@ static void nodeProcessTx(tNode * node) {
         // MB_NETWORK_MANAGER_PRINTF("Node:%u TTL reset:%u\n", node->nodeId, node->timeToLive);
 
         // If we've got a node ID and it's our turn we can transmit
-        txPacket = nodeGetNextTxDataPacket(&node->txManager);
-
+        // Datagrams go after urgent packets but ahead of normal ones (they're only ever sent once)
+        if (IS_TX_BUFFER_EMPTY(&node->txManager, TX_LANE(&node->txManager, MASTER_NODE_ID, TX_PRIORITY_URGENT))) {
+            txPacket = datagramGetNextTxPacket(&node->datagrams, &node->stats.datagramsReplaced);
+        }
         if (txPacket == NULL) {
-            // Alternate between 2 empty packet headers
-            // This is because the packet memory is only DMA'd a cycle later
-            node->tmpPacketCycle++;
-            if (node->tmpPacketCycle >= 2) {
-                node->tmpPacketCycle = 0;
-            }
+            txPacket = nodeGetNextTxDataPacket(&node->txManager);
+        }
 
+        if (txPacket == NULL) {
             // We always send a packet when it's our turn
             // Just send an empty one
-            tPacketHeader * txPacketHeader = &node->tmpEmptyPacketHeader[node->tmpPacketCycle];
-            SET_PROTOCOL_VERSION_AND_PACKET_TYPE(txPacketHeader, NODE_EMPTY_PACKET);
-            SET_PACKET_DATA_SIZE(txPacketHeader, 0);
-            txPacketHeader->node.srcNodeId = node->nodeId;
-            txPacketHeader->txSeqNum = INVALID_SEQUENCE_NUM;
-            txPacketHeader->node.ackSeqNum = node->txManager.rxSeqNum[MASTER_NODE_ID];
-            txPacket = (tPacket *)txPacketHeader; // A bit hacky - the DMA will access a few hundred bytes beyond the packet header
-
-            // MB_TX_MANAGER_PRINTF("Node:%u Prepare Tx Empty packet\n", node->nodeId);
+            txPacket = nodeGetEmptyTxPacket(node);
         }
         
         if (txPacket != NULL) {
-            txPacket->node.bufferLevel = getNumInTxBuffer(&node->txManager, MASTER_NODE_ID);
+            txPacket->node.bufferLevel = getNumInTxBuffer(&node->txManager, MASTER_NODE_ID) + (datagramIsWaiting(&node->datagrams) ? 1 : 0);
         }
+    } else if (node->prevNodeId != INVALID_NODE_ID && node->rejoinTimeUs > 0) {
+        // Wait for the slot to claim back our old ID rather than contending for a new one
+        node->sentNewNodeRequest = true;
+        txPacket = txRejoinRequest(&node->tmpPacket, node->uniqueId, node->requestedWindowSize, node->prevNodeId, node->prevNodeId); // Moved to our sub-slot when it's sent
     } else {
         // If we haven't got a node ID then we can send a request when the next slot is unused
         if (node->nextNewNodeResponseCountdown == 0) {
-            node->stats.newNodeRequest++;
             node->sentNewNodeRequest = true;
-            txPacket = txNewNodeRequest(&node->tmpPacket, node->uniqueId);
-            node->nextNewNodeResponseCountdown = customRand() % MAX_NEW_NODE_BACKOFF;
+            txPacket = txNewNodeRequest(&node->tmpPacket, node->uniqueId, node->requestedWindowSize, customRand() % NEW_NODE_REQUEST_SUB_SLOTS);
+            node->nextNewNodeResponseCountdown = nodeGetJoinBackoff(node, false);
             MB_NETWORK_MANAGER_PRINTF("Node %u, Prepare Tx new node request: 0x%llx, (backoff:%u)\n", node->nodeId, node->uniqueId, node->nextNewNodeResponseCountdown);
         } else {
             node->nextNewNodeResponseCountdown--;
@@ -226,6 +350,9 @@ void nodeProcessRx(tNode * node) {
     if (node->savedRxAckValid) {
         rxAckSeqNum(&node->txManager, MASTER_NODE_ID, node->savedRxAck, false, &node->stats.txWindowRestarts);
     }
+    if (node->savedRxUrgentAckValid) {
+        rxAckSeqNum(&node->txManager, TX_LANE(&node->txManager, MASTER_NODE_ID, TX_PRIORITY_URGENT), node->savedRxUrgentAck, false, &node->stats.txWindowRestarts);
+    }
     if (node->validRxPacket) {
         nodeProcessRxData(node, node->prevRxPacketEntry); // Process the last rx packet
     } else {
@@ -234,10 +361,15 @@ void nodeProcessRx(tNode * node) {
 }
 
 
-void nodeQuickUpdateTxPacket(tNode * node) {
+void nodeQuickUpdateTxPacket(tNode * node, tPacket * txPacket) {
     // Update the ack 
-    if (node->nextTxPacket) {
-        node->nextTxPacket->node.ackSeqNum = node->txManager.rxSeqNum[MASTER_NODE_ID];
+    if (txPacket) {
+        uint8_t urgentLane = TX_LANE(&node->txManager, MASTER_NODE_ID, TX_PRIORITY_URGENT);
+        txPacket->node.ackSeqNum = node->txManager.rxSeqNum[MASTER_NODE_ID];
+        txPacket->node.sackBitmap = MICROBUS_SELECTIVE_REPEAT ? rxManagerGetSackBitmap(&node->rxPacketManager) : 0;
+        txPacket->node.urgentAckSeqNum = node->txManager.rxSeqNum[urgentLane];
+        txPacket->node.urgentBufferLevel = getNumTxPacketsNotSent(&node->txManager, urgentLane);
+        txPacket->node.rxCredits = rxManagerNumFreeEntries(&node->rxPacketManager);
     }
 }
 
@@ -247,9 +379,18 @@ tPacket * nodeGetTxPacket(tNode * node) {
     if (node->nextTxPacket != NULL) {
         // Make sure we only sent new node responses after a backoff
         if (node->nodeId == UNALLOCATED_NODE_ID) {
-            if (node->nextNewNodeResponseCountdown == 0) {
+            if (GET_PACKET_TYPE(node->nextTxPacket) == NODE_REJOIN_PACKET) {
+                // Claimed every time round until we get it or give up and join like a new node
+                if (node->rejoinSlotFirstNodeId == INVALID_NODE_ID) {
+                    return NULL;
+                }
+                node->stats.nodeRejoinRequest++;
+                txRejoinRequest(node->nextTxPacket, node->uniqueId, node->requestedWindowSize, node->rejoinSlotFirstNodeId, node->prevNodeId);
+            } else if (node->rejoinSlotFirstNodeId != INVALID_NODE_ID) {
+                return NULL;
+            } else if (node->nextNewNodeResponseCountdown == 0) {
                 node->stats.newNodeRequest++;
-                node->nextNewNodeResponseCountdown = customRand() % MAX_NEW_NODE_BACKOFF;
+                node->nextNewNodeResponseCountdown = nodeGetJoinBackoff(node, true);
                 MB_NETWORK_MANAGER_PRINTF("Node, Tx new node request: 0x%llx, (backoff:%u)\n", node->uniqueId, node->nextNewNodeResponseCountdown);
             } else {
                 node->nextNewNodeResponseCountdown--;
@@ -257,16 +398,29 @@ tPacket * nodeGetTxPacket(tNode * node) {
             }
         }
 
-        // Now fill in the updated schedule and the acks
-        nodeQuickUpdateTxPacket(node);
         tPacket * txPacket = node->nextTxPacket;
-        node->nextTxPacket = NULL;
+        tPacketType packetType = GET_PACKET_TYPE(txPacket);
+        if ((IS_NODE_DATA_PACKET(packetType) || packetType == NODE_DATAGRAM_PACKET) && node->masterRxCredits == 0) {
+            // Flow control - the master has no room for it so keep it for our next turn and only
+            // send the acks
+            node->stats.txCreditStalls++;
+            txPacket = nodeGetEmptyTxPacket(node);
+            txPacket->node.bufferLevel = node->nextTxPacket->node.bufferLevel;
+        } else {
+            node->nextTxPacket = NULL;
+        }
+
+        // Now fill in the updated schedule and the acks
+        nodeQuickUpdateTxPacket(node, txPacket);
 
         // Record some stats
         node->stats.txPackets++;
-        if (GET_PACKET_TYPE(txPacket) == NODE_DATA_PACKET) {
+        if (IS_NODE_DATA_PACKET(GET_PACKET_TYPE(txPacket))) {
             node->stats.txDataPackets++;
+        } else if (GET_PACKET_TYPE(txPacket) == NODE_DATAGRAM_PACKET) {
+            node->stats.txDatagrams++;
         }
+        datagramRecordTx(&node->datagrams, txPacket);
         if (MICROBUS_LOG_PACKETS && MICROBUS_LOGGING) {
             microbusPrintPacket(txPacket, false, node->nodeId, true, 0);
         }
@@ -280,6 +434,19 @@ tPacket * nodeGetTxPacket(tNode * node) {
     return NULL;
 }
 
+// Our own slot, or while we're off the network the slot for claiming back our old ID
+static bool nodeIsTxSlot(tNode * node) {
+    node->rejoinSlotFirstNodeId = INVALID_NODE_ID;
+    if ((node->nodeId == UNALLOCATED_NODE_ID) && (node->prevNodeId != INVALID_NODE_ID) && IS_REJOIN_SLOT(node->currentTxNodeId)) {
+        tNodeIndex firstNodeId = node->currentTxNodeId & ~REJOIN_SLOT_FLAG;
+        if ((node->prevNodeId >= firstNodeId) && (node->prevNodeId - firstNodeId < NEW_NODE_REQUEST_SUB_SLOTS)) {
+            node->rejoinSlotFirstNodeId = firstNodeId;
+            return true;
+        }
+    }
+    return (node->currentTxNodeId == node->nodeId);
+}
+
 // ========================================= //
 
 void nodeCheckIfTimedOut(tNode * node) {
@@ -295,9 +462,10 @@ void nodeCheckIfTimedOut(tNode * node) {
 // being transmitted and received. 
 // This is for the main SPI link which needs to run as fast as possible
 
-void nodeDualChannelPipelinedPreProcess(tNode * node, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError) {
+// Returns the tx transfer size (0 if not transmitting)
+uint16_t nodeDualChannelPipelinedPreProcess(tNode * node, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError) {
     if (!node->initialised) {
-        return;
+        return 0;
     }
     // Quick validate rx packet and record the seq nums so we can ack them as soon as possible
     nodeQuickProcessPrevRx(node, crcError);
@@ -306,9 +474,11 @@ void nodeDualChannelPipelinedPreProcess(tNode * node, tPacket ** txPacket, tPack
     nodeUpdateSchedule(node);
     *rxPacketMemory = &node->nextRxPacketEntry->packet;
 
-    if ((node->currentTxNodeId == node->nodeId) && (node->nextTxPacket != NULL)) {
+    if (nodeIsTxSlot(node) && (node->nextTxPacket != NULL)) {
         *txPacket = nodeGetTxPacket(node);
+        return microbusPacketTransferSize(*txPacket);
     }
+    return 0;
 }
 
 void nodeDualChannelPipelinedPostProcess(tNode * node) {
@@ -335,7 +505,7 @@ bool nodeIsTxMode(tNode * node) {
     if (!node->initialised) {
         return false;
     }
-    bool isTx = (node->currentTxNodeId == node->nodeId);
+    bool isTx = nodeIsTxSlot(node);
     nodeCheckIfTimedOut(node);
     nodeUpdateSchedule(node);
     return isTx;
@@ -350,12 +520,14 @@ void nodeNoDelaySingleChannelProcessRx(tNode * node, bool crcError) {
     nodeProcessRx(node);
 }
 
-void nodeNoDelaySingleChannelProcessTx(tNode * node, tPacket ** txPacket) {
+// Returns the tx transfer size (0 if not transmitting)
+uint16_t nodeNoDelaySingleChannelProcessTx(tNode * node, tPacket ** txPacket) {
     if (!node->initialised) {
-        return;
+        return 0;
     }
     nodeProcessTx(node);
     *txPacket = nodeGetTxPacket(node);
+    return microbusPacketTransferSize(*txPacket);
 }
 
 // ========================================= //
@@ -364,6 +536,7 @@ void nodeNoDelaySingleChannelProcessTx(tNode * node, tPacket ** txPacket) {
 void nodeUpdateTimeUs(tNode * node, uint32_t usIncr) {
 //    int32_t prevTime = node->timeToLive;
     nodeNwUpdateTimeUs(&node->timeToLive, usIncr);
+    nodeNwUpdateTimeUs(&node->rejoinTimeUs, usIncr);
     #if MICROBUS_LOGGING
         if (nodeNwHasNodeTimedOut(prevTime) == false && nodeNwHasNodeTimedOut(node->timeToLive)) {
             MB_PRINTF("Node:%u, timed out: %d\n", node->nodeId, node->timeToLive);
@@ -375,13 +548,22 @@ void nodeUpdateTimeUs(tNode * node, uint32_t usIncr) {
 // Called by main thread
 
 void nodeReset(tNode * node) {
+    // Any datagrams waiting or messages part way through are dropped but the memory is kept
+    uint8_t maxDatagramEntries = node->datagrams.packetStore.maxEntries;
+    tPacketEntry * datagramEntries = node->datagrams.packetStore.entries;
+    uint8_t maxReassemblyEntries = node->rxPacketManager.maxReassemblyEntries;
+    tReassemblyEntry * reassemblyEntries = node->rxPacketManager.reassemblyEntries;
     nodeInit(node, 
             node->uniqueId,
             node->txManager.packetStore.maxEntries, 
             node->txManager.packetStore.entries, 
             node->rxPacketManager.maxRxPacketEntries, 
-            node->rxPacketManager.rxPacketEntries,
+            node->rxPacketManager.packetStore.entries,
             node->rxPacketManager.rxPacketQueue);
+    datagramStoreInit(&node->datagrams, maxDatagramEntries, datagramEntries);
+    if (reassemblyEntries != NULL) {
+        rxManagerInitReassembly(&node->rxPacketManager, maxReassemblyEntries, reassemblyEntries);
+    }
 }
 
 static void nodeRemoveFromNetwork(tNode * node) {
@@ -389,10 +571,14 @@ static void nodeRemoveFromNetwork(tNode * node) {
         MB_PRINTF("Node:%u, left network, 0x%llx\n", node->nodeId, node->uniqueId);
         uint32_t nodeLeftNw = node->stats.nodeLeftNw;
         uint32_t nodeJoinedNw = node->stats.nodeJoinedNw;
+        tNodeIndex prevNodeId = node->nodeId;
         nodeReset(node);
         nodeLeftNw++;
         node->stats.nodeLeftNw = nodeLeftNw;
         node->stats.nodeJoinedNw = nodeJoinedNw;
+        // The master holds our ID back for a while so try to claim it back first
+        node->prevNodeId = prevNodeId;
+        node->rejoinTimeUs = NODE_REJOIN_TIMEOUT_US;
     }
 }
 
@@ -407,27 +593,37 @@ void nodeInit(tNode * node,
     memset(node, 0, sizeof(tNode));
     node->nodeId = UNALLOCATED_NODE_ID;
     node->uniqueId = uniqueId;
+    node->masterRxCredits = RX_CREDITS_UNLIMITED;
+    node->newNodeBackoff = MIN_NEW_NODE_BACKOFF;
+    node->prevNodeId = INVALID_NODE_ID;
+    node->rejoinSlotFirstNodeId = INVALID_NODE_ID;
+    // Ask for a window no bigger than our rx buffer - the master may give us less
+    node->requestedWindowSize = MIN(MAX_SLIDING_WINDOW_SIZE, maxRxPacketEntries);
 
     // Rx
-    memset(rxPacketEntries, 0, maxRxPacketEntries * sizeof(tPacketEntry));
-    memset(rxPacketQueue, 0, maxRxPacketEntries * sizeof(tPacketEntry *));
-    node->rxPacketManager.maxRxPacketEntries = maxRxPacketEntries;
-    node->rxPacketManager.rxPacketEntries = rxPacketEntries;
-    node->rxPacketManager.rxPacketQueue = rxPacketQueue;
+    rxManagerInit(&node->rxPacketManager, maxRxPacketEntries, rxPacketEntries, rxPacketQueue);
     node->nextRxPacketEntry = findFreeRxPacket(&node->rxPacketManager);
     microbusAssert(node->nextRxPacketEntry, "");
 
     // Tx
     initTxManager(&node->txManager,
         1,
-        &node->txManagerMemory.txSeqNumStart,
-        &node->txManagerMemory.txSeqNumEnd,
-        &node->txManagerMemory.txSeqNumNext,
-        &node->txManagerMemory.txSeqNumPauseCount,
-        &node->txManagerMemory.rxSeqNum,
+        node->txManagerMemory.txSeqNumStart,
+        node->txManagerMemory.txSeqNumEnd,
+        node->txManagerMemory.txSeqNumNext,
+        node->txManagerMemory.txSeqNumPauseCount,
+        node->txManagerMemory.rxSeqNum,
+        node->txManagerMemory.txQueueHead,
+        node->txManagerMemory.txQueueTail,
+        node->txManagerMemory.txQueueLastSent,
+        node->txManagerMemory.txNumSubmitted,
+        node->txManagerMemory.txNumFreed,
+        node->txManagerMemory.txSelectiveRepeat,
+        node->txManagerMemory.txWindowSize,
         NULL,
         maxTxPacketEntries,
         txPacketEntries);
+    datagramStoreInit(&node->datagrams, 0, NULL);
 
     // Fill in an empty packet to start with
     node->nextTxPacket = &node->tmpPacket;
@@ -445,6 +641,8 @@ void nodeInit(tNode * node,
 
 tPacket * nodeAllocateTxPacketFull(void * node) {
     tNode * rnode = node;
+    // Any messages waiting go first
+    nodeFlushTxMessages(node);
     tPacket * packet = allocateTxPacket(&rnode->txManager, rnode->nodeId);
     if (packet == NULL) {
         rnode->stats.txBufferFull++;
@@ -461,31 +659,70 @@ uint8_t * nodeAllocateTxPacket(void * node) {
     return packet->node.data;
 }
 
-void nodeSubmitAllocatedTxPacket(void * node, uint8_t dstNodeId, uint16_t numBytes) {
-    tNode * rnode = node;
+static void nodeSubmitAllocatedTxPacketOfType(tNode * node, tPacketType packetType, uint16_t numBytes) {
     if (numBytes > NODE_PACKET_DATA_SIZE) {
         microbusAssert(numBytes <= NODE_PACKET_DATA_SIZE, ""); // "Tx packet exceeds max size"
     }
-    tPacket * packet = rnode->txManager.allocatedPacket;
+    tPacket * packet = node->txManager.allocatedPacket;
     if (packet == NULL) {
         microbusAssert(0, "");
     }
-    submitAllocatedTxPacket(&rnode->txManager, false, NULL, rnode->nodeId, MASTER_NODE_ID, NODE_DATA_PACKET, numBytes);
+    submitAllocatedTxPacket(&node->txManager, false, NULL, node->nodeId, MASTER_NODE_ID, packetType, numBytes);
 }
 
-tPacket * nodePeekNextRxDataPacketFull(void * node) {
+void nodeSubmitAllocatedTxPacket(void * node, uint8_t dstNodeId, uint16_t numBytes) {
+    nodeSubmitAllocatedTxPacketOfType(node, NODE_DATA_PACKET, numBytes);
+}
+
+// Goes out ahead of any normal packets (and the master schedules the node sooner)
+void nodeSubmitAllocatedUrgentTxPacket(void * node, uint8_t dstNodeId, uint16_t numBytes) {
+    nodeSubmitAllocatedTxPacketOfType(node, NODE_URGENT_DATA_PACKET, numBytes);
+}
+
+// ========================================= //
+// Datagrams - unreliable, only the newest unsent one is kept
+// Without nodeInitDatagrams no datagrams can be allocated
+
+void nodeInitDatagrams(void * node, uint8_t numEntries, tPacketEntry entries[]) {
     tNode * rnode = node;
-    tPacketEntry ** entry;
-    tRxPacketManager * rpm = &rnode->rxPacketManager;
-    if (CIRCULAR_BUFFER_EMPTY(rpm->start, rpm->end, rpm->maxRxPacketEntries)) {
-    	return NULL;
+    datagramStoreInit(&rnode->datagrams, numEntries, entries);
+}
+
+// Returns NULL if every datagram entry is in use
+uint8_t * nodeAllocateDatagram(void * node) {
+    tNode * rnode = node;
+    tPacket * packet = datagramAllocate(&rnode->datagrams);
+    return packet ? packet->node.data : NULL;
+}
+
+// Replaces any datagram that hasn't been sent yet
+void nodeSubmitAllocatedDatagram(void * node, uint8_t dstNodeId, uint16_t numBytes) {
+    tNode * rnode = node;
+    tDatagramStore * datagrams = &rnode->datagrams;
+    tPacket * packet = datagrams->allocatedPacket;
+    if (numBytes == 0 || numBytes > NODE_PACKET_DATA_SIZE || packet == NULL) {
+        microbusAssert(0, "");
+        return;
     }
-    CIRCULAR_BUFFER_PEEK((entry), rpm->rxPacketQueue, rpm->start, rpm->end, rpm->maxRxPacketEntries);
-    microbusAssert(entry != NULL, "");
-    return &(*entry)->packet;
+    if (rnode->nodeId == UNALLOCATED_NODE_ID) {
+        // Not on the network - no point sending it
+        datagramDropAllocated(datagrams);
+        return;
+    }
+    SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, NODE_DATAGRAM_PACKET);
+    SET_PACKET_DATA_SIZE(packet, numBytes);
+    packet->node.srcNodeId = rnode->nodeId;
+    packet->txSeqNum = INVALID_SEQUENCE_NUM;
+    datagramSubmitAllocated(datagrams, MASTER_NODE_ID);
 }
 
-uint8_t * nodePeekNextRxDataPacket(void * node, uint16_t * size, tNodeIndex * srcNodeId) {
+tPacket * nodePeekNextRxDataPacketFull(void * node) {
+    tNode * rnode = node;
+    return peekNextRxDataPacket(&rnode->rxPacketManager);
+}
+
+// Datagrams come in the same queue as the reliable packets - datagram is set for them
+uint8_t * nodePeekNextRxDataPacket(void * node, uint16_t * size, tNodeIndex * srcNodeId, bool * datagram) {
     tPacket * packet = nodePeekNextRxDataPacketFull(node);
     if (packet == NULL) {
         return NULL;
@@ -493,16 +730,103 @@ uint8_t * nodePeekNextRxDataPacket(void * node, uint16_t * size, tNodeIndex * sr
     *size = GET_PACKET_DATA_SIZE(packet);
     microbusAssert(*size > 0, "");
     *srcNodeId = MASTER_NODE_ID;
+    *datagram = IS_DATAGRAM_PACKET(GET_PACKET_TYPE(packet));
     return packet->master.data;
 }
 
 bool nodePopNextDataPacket(void * node) {
     tNode * rnode = node;
-    tRxPacketManager * rpm = &rnode->rxPacketManager;
-    tPacketEntry ** entry;
-    CIRCULAR_BUFFER_PEEK((entry), rpm->rxPacketQueue, rpm->start, rpm->end, rpm->maxRxPacketEntries);
-    (*entry)->inUse = false;
-    CIRCULAR_BUFFER_POP(rpm->start, rpm->end, rpm->maxRxPacketEntries);
-    return true; //TODO
+    return popNextDataPacket(&rnode->rxPacketManager);
+}
+
+// ========================================= //
+// Message aggregation - many small messages sent in one packet (see masterAppendTxMessage)
+
+// Returns false if the tx buffer is full
+bool nodeAppendTxMessage(void * node, const uint8_t * data, uint8_t numBytes) {
+    tNode * rnode = node;
+    tTxManager * txManager = &rnode->txManager;
+    if (txMessageNeedsNewPacket(txManager, MASTER_NODE_ID, numBytes)) {
+        nodeFlushTxMessages(node);
+    }
+    if (!txMessageAppend(txManager, false, rnode->nodeId, MASTER_NODE_ID, data, numBytes)) {
+        rnode->stats.txBufferFull++;
+        return false;
+    }
+    // If nothing is queued it would go straight out - so don't hold it back
+    if (getNumInTxBuffer(txManager, MASTER_NODE_ID) == 0) {
+        nodeFlushTxMessages(node);
+    }
+    return true;
+}
+
+// Submit the packet being filled with messages (call when there is nothing more to send for a while)
+void nodeFlushTxMessages(void * node) {
+    tNode * rnode = node;
+    tNodeIndex dstNodeId;
+    uint16_t numBytes = txMessageClosePacket(&rnode->txManager, &dstNodeId);
+    if (numBytes > 0) {
+        nodeSubmitAllocatedTxPacket(node, dstNodeId, numBytes);
+    }
+}
+
+// Any datagrams in the way are dropped (see masterPeekNextRxMessage)
+uint8_t * nodePeekNextRxMessage(void * node, uint16_t * size) {
+    tNode * rnode = node;
+    tPacket * packet = rxManagerPeekNextMessagePacket(&rnode->rxPacketManager);
+    if (packet == NULL) {
+        return NULL;
+    }
+    return rxManagerPeekMessage(&rnode->rxPacketManager, packet->master.data, GET_PACKET_DATA_SIZE(packet), size);
+}
+
+bool nodePopNextRxMessage(void * node) {
+    tNode * rnode = node;
+    tPacket * packet = rxManagerPeekNextMessagePacket(&rnode->rxPacketManager);
+    if (packet == NULL) {
+        return false;
+    }
+    // Pop the packet once all its messages have gone
+    if (rxManagerPopMessage(&rnode->rxPacketManager, packet->master.data, GET_PACKET_DATA_SIZE(packet))) {
+        return nodePopNextDataPacket(node);
+    }
+    return true;
+}
+
+// ========================================= //
+// Large messages - split over as many packets as needed (see masterSubmitLargeTxMessage)
+
+// Returns false if there isn't room in the tx buffer for the whole message (nothing is sent)
+bool nodeSubmitLargeTxMessage(void * node, const uint8_t * data, uint16_t numBytes) {
+    tNode * rnode = node;
+    microbusAssert(numBytes > 0 && numBytes <= MAX_LARGE_MESSAGE_SIZE, "");
+    nodeFlushTxMessages(node);
+    if (getNumFreeTxPackets(&rnode->txManager) < NUM_FRAGMENTS(numBytes)) {
+        rnode->stats.txBufferFull++;
+        return false;
+    }
+    for (uint16_t offset=0; offset<numBytes; offset+=MAX_FRAGMENT_DATA_SIZE) {
+        uint8_t * packetData = nodeAllocateTxPacket(node);
+        microbusAssert(packetData, "");
+        uint16_t packetSize = txFragmentWrite(packetData, data, numBytes, offset);
+        nodeSubmitAllocatedTxPacket(node, MASTER_NODE_ID, packetSize);
+    }
+    return true;
+}
+
+void nodeInitLargeRxMessages(void * node, uint8_t numEntries, tReassemblyEntry entries[]) {
+    tNode * rnode = node;
+    rxManagerInitReassembly(&rnode->rxPacketManager, numEntries, entries);
+}
+
+uint8_t * nodePeekNextLargeRxMessage(void * node, uint16_t * size) {
+    tNode * rnode = node;
+    tNodeIndex srcNodeId;
+    return rxManagerPeekLargeMessage(&rnode->rxPacketManager, false, size, &srcNodeId);
+}
+
+bool nodePopNextLargeRxMessage(void * node) {
+    tNode * rnode = node;
+    return rxManagerPopLargeMessage(&rnode->rxPacketManager);
 }
 
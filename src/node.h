@@ -10,15 +10,23 @@
 #include "microbus.h"
 #include "txManager.h"
 #include "rxManager.h"
+#include "datagram.h"
 #include "networkManager.h"
 #include "scheduler.h"
 
 typedef struct {
-    uint8_t txSeqNumStart;
-    uint8_t txSeqNumEnd;
-    uint8_t txSeqNumNext;
-    uint8_t txSeqNumPauseCount;
-    uint8_t rxSeqNum;
+    uint8_t txSeqNumStart[NUM_TX_PRIORITIES];
+    uint8_t txSeqNumEnd[NUM_TX_PRIORITIES];
+    uint8_t txSeqNumNext[NUM_TX_PRIORITIES];
+    uint8_t txSeqNumPauseCount[NUM_TX_PRIORITIES];
+    uint8_t rxSeqNum[NUM_TX_PRIORITIES];
+    uint8_t txQueueHead[NUM_TX_PRIORITIES];
+    uint8_t txQueueTail[NUM_TX_PRIORITIES];
+    uint8_t txQueueLastSent[NUM_TX_PRIORITIES];
+    uint8_t txNumSubmitted[NUM_TX_PRIORITIES];
+    uint8_t txNumFreed[NUM_TX_PRIORITIES];
+    tTxSelectiveRepeat txSelectiveRepeat[NUM_TX_PRIORITIES];
+    uint8_t txWindowSize[NUM_TX_PRIORITIES];
 } tNodeTxManagerMemory;
 
 typedef struct {
@@ -26,6 +34,7 @@ typedef struct {
     tTxManager txManager; // Handle re-transmission
     tNodeTxManagerMemory txManagerMemory; // Memory used by the tx manager - not used directly
     tRxPacketManager rxPacketManager;
+    tDatagramStore datagrams; // Unreliable - bypasses the tx manager
     uint64_t uniqueId;
     tNodeIndex nodeId;
     tNodeIndex currentTxNodeId;
@@ -34,14 +43,25 @@ typedef struct {
     bool sentNewNodeRequest;
     // uint32_t timeSinceLastHeardMaster;
     uint8_t nextNewNodeResponseCountdown;
-    uint8_t newNodeBackoff;
+    uint8_t newNodeBackoff; // Unallocated slots a join request is spread over - doubles every retry, halves when others get in
+    uint8_t masterJoinCollisions; // From the master's last packet
+    tNodeIndex prevNodeId; // The ID we had before leaving the network - claimed back in its rejoin slot
+    int32_t rejoinTimeUs;  // How long we wait for the rejoin slot before joining like a new node
+    tNodeIndex rejoinSlotFirstNodeId; // Start of the block of IDs if we're in the rejoin slot for prevNodeId (INVALID_NODE_ID if not)
+    uint8_t requestedWindowSize; // Sliding window asked for when joining
     tPacketEntry * nextRxPacketEntry;
     tPacketEntry * prevRxPacketEntry;
     tPacket * nextTxPacket;
     uint8_t rxBufferLevel;
+    uint8_t masterRxCredits; // Flow control - data packets the master has room for (from its last packet)
     bool savedRxAckValid;
     uint8_t savedRxAck;
+    bool savedRxUrgentAckValid;
+    uint8_t savedRxUrgentAck;
     bool validRxSeqNum;
+    bool rxStoredOutOfOrder; // Selective repeat - held on to until the missing packets arrive
+    uint8_t numInOrderRxEntries;
+    tPacketEntry * inOrderRxEntries[MAX_SLIDING_WINDOW_SIZE-1]; // Stored packets that follow on from the rx packet
     bool validRxPacket;
     tNodeStats stats;
     // Spare memory for sending packets like new node packets
@@ -52,17 +72,20 @@ typedef struct {
 
 
 // Dual channel pipelined
-void nodeDualChannelPipelinedPreProcess(tNode * node, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError);
+uint16_t nodeDualChannelPipelinedPreProcess(tNode * node, tPacket ** txPacket, tPacket ** rxPacketMemory, bool crcError); // return tx transfer size
 void nodeDualChannelPipelinedPostProcess(tNode * node);
 
 // Single channel - no pipeline
 bool nodeIsTxMode(tNode * node);
 tPacket * nodeGetRxPacketMemory(tNode * node);
 void nodeNoDelaySingleChannelProcessRx(tNode * node, bool crcError);
-void nodeNoDelaySingleChannelProcessTx(tNode * node, tPacket ** txPacket);
+uint16_t nodeNoDelaySingleChannelProcessTx(tNode * node, tPacket ** txPacket); // return tx transfer size
 
 void nodeUpdateTimeUs(tNode * node, uint32_t usIncr);
 
+// The schedule and acks from the last rx packet - called by both pre-processes
+void nodeQuickProcessPrevRx(tNode * node, bool rxCrcError);
+
 // Called by main thread
 void nodeInit(tNode * node, 
                 uint64_t uniqueId,
@@ -73,8 +96,20 @@ void nodeInit(tNode * node,
                 tPacketEntry * rxPacketQueue[]);
 uint8_t * nodeAllocateTxPacket(void * node);
 void nodeSubmitAllocatedTxPacket(void * node, uint8_t dstNodeId, uint16_t numBytes);
-uint8_t * nodePeekNextRxDataPacket(void * node, uint16_t * size, tNodeIndex * srcNodeId);
+void nodeSubmitAllocatedUrgentTxPacket(void * node, uint8_t dstNodeId, uint16_t numBytes);
+void nodeInitDatagrams(void * node, uint8_t numEntries, tPacketEntry entries[]);
+uint8_t * nodeAllocateDatagram(void * node);
+void nodeSubmitAllocatedDatagram(void * node, uint8_t dstNodeId, uint16_t numBytes);
+uint8_t * nodePeekNextRxDataPacket(void * node, uint16_t * size, tNodeIndex * srcNodeId, bool * datagram);
 bool nodePopNextDataPacket(void * node);
+bool nodeAppendTxMessage(void * node, const uint8_t * data, uint8_t numBytes);
+void nodeFlushTxMessages(void * node);
+uint8_t * nodePeekNextRxMessage(void * node, uint16_t * size);
+bool nodePopNextRxMessage(void * node);
+bool nodeSubmitLargeTxMessage(void * node, const uint8_t * data, uint16_t numBytes);
+void nodeInitLargeRxMessages(void * node, uint8_t numEntries, tReassemblyEntry entries[]);
+uint8_t * nodePeekNextLargeRxMessage(void * node, uint16_t * size);
+bool nodePopNextLargeRxMessage(void * node);
 
 tPacket * nodeAllocateTxPacketFull(void * node);
 tPacket * nodePeekNextRxDataPacketFull(void * node);
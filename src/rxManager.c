@@ -12,19 +12,45 @@
 
 // ==================================================================== //
 // Rx Packet memory manager
+//
+// The packet store is only ever allocated from and freed to by the interrupt.
+// The user thread popping a packet only moves the start of the queue, the
+// interrupt then returns the popped entries to the store the next time it
+// needs a free one.
+
+// Return everything the user has popped to the packet store
+static void reclaimPoppedPackets(tRxPacketManager * rpm) {
+    uint8_t start = rpm->start; // Written by the user thread
+    while (rpm->reclaimIndex != start) {
+        tPacketEntry * entry = rpm->rxPacketQueue[rpm->reclaimIndex];
+        // Entries removed from the queue have already been freed
+        if (entry) {
+            packetStoreFree(&rpm->packetStore, entry);
+        }
+        rpm->reclaimIndex = INCR_AND_WRAP(rpm->reclaimIndex, 1, rpm->maxRxPacketEntries);
+    }
+}
 
 tPacketEntry * findFreeRxPacket(tRxPacketManager * rpm) {
+    reclaimPoppedPackets(rpm);
     // Check the queue isn't full (it can be full when there are still empty entries because removing nodes doesn't shift down the queue)
-    if (CIRCULAR_BUFFER_FULL(rpm->start, rpm->end, rpm->maxRxPacketEntries)) {
+    // NOTE: check against the reclaimIndex so the queue never overwrites popped entries not yet reclaimed
+    if (CIRCULAR_BUFFER_FULL(rpm->reclaimIndex, rpm->end, rpm->maxRxPacketEntries)) {
         return NULL;
     }
-    for (uint32_t i=0; i<rpm->maxRxPacketEntries; i++) {
-        if (rpm->rxPacketEntries[i].inUse == false) {
-            rpm->rxPacketEntries[i].inUse = true;
-            return &rpm->rxPacketEntries[i];
-        }
-    }
-    return NULL;
+    return packetStoreAllocate(&rpm->packetStore);
+}
+
+// Flow control - how many more packets can be stored (each needs a free entry and a place in the queue).
+// The entry the next packet is received into isn't counted as it's already allocated
+uint8_t rxManagerNumFreeEntries(tRxPacketManager * rpm) {
+    reclaimPoppedPackets(rpm);
+    uint8_t queueFree = rpm->maxRxPacketEntries - 1 - CIRCULAR_BUFFER_LENGTH(rpm->reclaimIndex, rpm->end, rpm->maxRxPacketEntries);
+    return MIN(packetStoreNumFree(&rpm->packetStore), queueFree);
+}
+
+void rxManagerFreePacket(tRxPacketManager * rpm, tPacketEntry * packetEntry) {
+    packetStoreFree(&rpm->packetStore, packetEntry);
 }
 
 void addRxDataPacket(tRxPacketManager * rpm, tPacketEntry * packetEntry) {
@@ -38,21 +64,68 @@ void addRxDataPacket(tRxPacketManager * rpm, tPacketEntry * packetEntry) {
 void rxManagerRemoveAllPackets(tRxPacketManager * rpm, tNodeIndex nodeId) {
     // Rather than remove from the queue and having to shift everything up
     // instead just set packet invalid 
-    for (uint32_t i=rpm->start; i != rpm->end; i++) {
-        if (i >= rpm->maxRxPacketEntries) {
-            i = 0;
-        }
-
-        if (rpm->rxPacketQueue[i]) {
-            if (rpm->rxPacketQueue[i]->packet.node.srcNodeId == nodeId) {
-                // Free the packet in memory
-                rpm->rxPacketQueue[i]->inUse = false;
+    for (uint32_t i=rpm->start; i != rpm->end; i = INCR_AND_WRAP(i, 1, rpm->maxRxPacketEntries)) {
+        tPacketEntry * entry = rpm->rxPacketQueue[i];
+        if (entry) {
+            if (entry->packet.node.srcNodeId == nodeId) {
                 // Invaliddate this entry in the queue
                 rpm->rxPacketQueue[i] = NULL;
+                // Free the packet in memory
+                packetStoreFree(&rpm->packetStore, entry);
             }
         }
     }
     // microbusAssert(numValidRxPackets(rpm) == CIRCULAR_BUFFER_LENGTH(rpm->start, rpm->end, rpm->maxRxPacketEntries), "");
+    // Any message it was part way through is never going to finish (the reassembly entries belong to the user thread)
+    uint32_t state = microbusEnterCritical();
+    rpm->removedSrcNodes |= NODE_BIT(nodeId);
+    microbusExitCritical(state);
+}
+
+// ==================================================================== //
+// Selective repeat - holding on to out of order packets until the gap is filled
+
+// seqNumOffset is how far the packet is after the expected one (which must be > 0)
+bool rxManagerStoreOutOfOrder(tRxPacketManager * rpm, uint8_t seqNumOffset, tPacketEntry * packetEntry) {
+    if (seqNumOffset == 0 || seqNumOffset >= rpm->windowSize) {
+        return false;
+    }
+    if (rpm->outOfOrderEntries[seqNumOffset-1] != NULL) {
+        // Already got it
+        return false;
+    }
+    // Always leave a free entry for the missing packet - otherwise we could never receive it
+    if (packetStoreNumFree(&rpm->packetStore) == 0) {
+        return false;
+    }
+    rpm->outOfOrderEntries[seqNumOffset-1] = packetEntry;
+    return true;
+}
+
+// Called once the expected packet has been received. Returns the stored packets
+// that now follow on from it (in order) and moves everything else down
+uint8_t rxManagerTakeInOrder(tRxPacketManager * rpm, tPacketEntry * inOrderEntries[MAX_SLIDING_WINDOW_SIZE-1]) {
+    uint8_t numInOrder = 0;
+    while (numInOrder < MAX_SLIDING_WINDOW_SIZE-1 && rpm->outOfOrderEntries[numInOrder] != NULL) {
+        inOrderEntries[numInOrder] = rpm->outOfOrderEntries[numInOrder];
+        numInOrder++;
+    }
+    // The expected packet takes one place as well
+    uint8_t shift = numInOrder + 1;
+    for (uint8_t i=0; i<MAX_SLIDING_WINDOW_SIZE-1; i++) {
+        rpm->outOfOrderEntries[i] = (i + shift < MAX_SLIDING_WINDOW_SIZE-1) ? rpm->outOfOrderEntries[i + shift] : NULL;
+    }
+    return numInOrder;
+}
+
+uint8_t rxManagerGetSackBitmap(tRxPacketManager * rpm) {
+    uint8_t sackBitmap = 0;
+    for (uint8_t i=0; i<MAX_SLIDING_WINDOW_SIZE-1; i++) {
+        if (rpm->outOfOrderEntries[i] != NULL) {
+            sackBitmap |= (1 << i);
+        }
+    }
+    return sackBitmap;
 }
 
 // ============================================ //
@@ -81,20 +154,220 @@ tPacket * peekNextRxDataPacket(tRxPacketManager * rpm) {
 }
 
 bool popNextDataPacket(tRxPacketManager * rpm) {
-    // Find the packet and "free" it by setting the protocolversion byte to 0
-    tPacketEntry ** entry;
-    CIRCULAR_BUFFER_PEEK((entry), rpm->rxPacketQueue, rpm->start, rpm->end, rpm->maxRxPacketEntries);
-    (*entry)->inUse = false;
-    // Now move the start position of the buffer
+    if (CIRCULAR_BUFFER_EMPTY(rpm->start, rpm->end, rpm->maxRxPacketEntries)) {
+        return false;
+    }
+    // Just move the start position of the buffer - the interrupt frees the packet later
     CIRCULAR_BUFFER_POP(rpm->start, rpm->end, rpm->maxRxPacketEntries);
-    return true; //TODO
+    return true;
+}
+
+// Message aggregation - split the head packet back into the messages it was built from
+
+// Start again if the user has moved on to a different packet
+static void syncMessagePacket(tRxPacketManager * rpm, uint8_t * packetData, uint16_t packetSize) {
+    if (rpm->messagePacketData != packetData || rpm->messageOffset >= packetSize) {
+        rpm->messagePacketData = packetData;
+        rpm->messageOffset = 0;
+    }
+}
+
+uint8_t * rxManagerPeekMessage(tRxPacketManager * rpm, uint8_t * packetData, uint16_t packetSize, uint16_t * messageSize) {
+    syncMessagePacket(rpm, packetData, packetSize);
+    uint16_t offset = rpm->messageOffset;
+    // Don't trust the length to stay inside the packet
+    *messageSize = MIN(packetData[offset], packetSize - offset - MESSAGE_HEADER_SIZE);
+    return &packetData[offset + MESSAGE_HEADER_SIZE];
+}
+
+// Returns true if that was the last message in the packet (so the packet can be popped)
+bool rxManagerPopMessage(tRxPacketManager * rpm, uint8_t * packetData, uint16_t packetSize) {
+    syncMessagePacket(rpm, packetData, packetSize);
+    rpm->messageOffset += MESSAGE_HEADER_SIZE + packetData[rpm->messageOffset];
+    if (rpm->messageOffset >= packetSize) {
+        rpm->messagePacketData = NULL;
+        rpm->messageOffset = 0;
+        return true;
+    }
+    return false;
+}
+
+// The message calls would misparse a datagram so they drop any they come to
+tPacket * rxManagerPeekNextMessagePacket(tRxPacketManager * rpm) {
+    tPacket * packet;
+    while ((packet = peekNextRxDataPacket(rpm)) != NULL && IS_DATAGRAM_PACKET(GET_PACKET_TYPE(packet))) {
+        rpm->numDatagramsDropped++;
+        popNextDataPacket(rpm);
+    }
+    return packet;
+}
+
+// Large messages - join the fragments back together
+// Fragments from different nodes can be mixed up in the queue so each source
+// has its own reassembly entry. A message in a single packet isn't copied.
+
+static tReassemblyEntry * findReassemblyEntry(tRxPacketManager * rpm, tNodeIndex srcNodeId) {
+    for (uint8_t i=0; i<rpm->maxReassemblyEntries; i++) {
+        tReassemblyEntry * entry = &rpm->reassemblyEntries[i];
+        if (entry->inUse && !entry->complete && entry->srcNodeId == srcNodeId) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static tReassemblyEntry * allocateReassemblyEntry(tRxPacketManager * rpm, tNodeIndex srcNodeId, uint16_t expectedSize) {
+    // A new first fragment means the last message from this source is never going to finish
+    tReassemblyEntry * entry = findReassemblyEntry(rpm, srcNodeId);
+    if (entry) {
+        rpm->numFragmentsDropped++;
+    }
+    if (expectedSize > MAX_LARGE_MESSAGE_SIZE) {
+        if (entry) {
+            entry->inUse = false;
+        }
+        return NULL;
+    }
+    for (uint8_t i=0; entry == NULL && i<rpm->maxReassemblyEntries; i++) {
+        if (!rpm->reassemblyEntries[i].inUse) {
+            entry = &rpm->reassemblyEntries[i];
+        }
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->inUse = true;
+    entry->complete = false;
+    entry->srcNodeId = srcNodeId;
+    entry->size = 0;
+    entry->expectedSize = expectedSize;
+    return entry;
+}
+
+// Add the fragment to its message - returns the message if that completed it
+static tReassemblyEntry * addFragment(tRxPacketManager * rpm, tNodeIndex srcNodeId, uint8_t flags, uint16_t expectedSize, uint8_t * data, uint16_t fragmentSize) {
+    tReassemblyEntry * entry;
+    if (flags & FRAGMENT_FIRST) {
+        entry = allocateReassemblyEntry(rpm, srcNodeId, expectedSize);
+    } else {
+        entry = findReassemblyEntry(rpm, srcNodeId);
+    }
+    if (entry == NULL) {
+        // No room (or we missed the start) - drop the whole message
+        rpm->numFragmentsDropped++;
+        return NULL;
+    }
+    if (entry->size + fragmentSize > entry->expectedSize) {
+        entry->inUse = false;
+        rpm->numFragmentsDropped++;
+        return NULL;
+    }
+    memcpy(&entry->data[entry->size], data, fragmentSize);
+    entry->size += fragmentSize;
+    if (flags & FRAGMENT_LAST) {
+        if (entry->size != entry->expectedSize) {
+            entry->inUse = false;
+            rpm->numFragmentsDropped++;
+            return NULL;
+        }
+        entry->complete = true;
+        return entry;
+    }
+    return NULL;
+}
+
+// Free the unfinished messages from sources that have been removed
+static void dropRemovedSrcMessages(tRxPacketManager * rpm) {
+    uint32_t state = microbusEnterCritical();
+    uint64_t removedSrcNodes = rpm->removedSrcNodes;
+    rpm->removedSrcNodes = 0;
+    microbusExitCritical(state);
+    for (uint8_t i=0; i<rpm->maxReassemblyEntries && removedSrcNodes; i++) {
+        tReassemblyEntry * entry = &rpm->reassemblyEntries[i];
+        if (entry->inUse && !entry->complete && (removedSrcNodes & NODE_BIT(entry->srcNodeId))) {
+            entry->inUse = false;
+            rpm->numFragmentsDropped++;
+        }
+    }
+}
+
+// Returns the next complete message - NULL if there isn't one yet
+uint8_t * rxManagerPeekLargeMessage(tRxPacketManager * rpm, bool isMaster, uint16_t * size, tNodeIndex * srcNodeId) {
+    if (rpm->removedSrcNodes) {
+        dropRemovedSrcMessages(rpm);
+    }
+    while (true) {
+        tPacket * packet = rxManagerPeekNextMessagePacket(rpm);
+        if (rpm->largeMessagePeeked) {
+            if (rpm->peekedLargeMessage) {
+                *size = rpm->peekedLargeMessage->size;
+                *srcNodeId = rpm->peekedLargeMessage->srcNodeId;
+                return rpm->peekedLargeMessage->data;
+            }
+            microbusAssert(packet, "");
+        }
+        if (packet == NULL) {
+            return NULL;
+        }
+
+        uint8_t * packetData = isMaster ? packet->node.data : packet->master.data;
+        tNodeIndex packetSrcNodeId = isMaster ? packet->node.srcNodeId : MASTER_NODE_ID;
+        uint16_t packetSize = GET_PACKET_DATA_SIZE(packet);
+        if (packetSize < FRAGMENT_HEADER_SIZE) {
+            rpm->numFragmentsDropped++;
+            popNextDataPacket(rpm);
+            continue;
+        }
+        uint8_t flags = packetData[0];
+        uint16_t expectedSize;
+        memcpy(&expectedSize, &packetData[1], 2);
+        uint8_t * fragmentData = &packetData[FRAGMENT_HEADER_SIZE];
+        uint16_t fragmentSize = packetSize - FRAGMENT_HEADER_SIZE;
+
+        // The whole message is in this packet - use it where it is
+        if ((flags & FRAGMENT_FIRST) && (flags & FRAGMENT_LAST) && fragmentSize == expectedSize) {
+            rpm->largeMessagePeeked = true;
+            rpm->peekedLargeMessage = NULL;
+            *size = fragmentSize;
+            *srcNodeId = packetSrcNodeId;
+            return fragmentData;
+        }
+
+        tReassemblyEntry * entry = addFragment(rpm, packetSrcNodeId, flags, expectedSize, fragmentData, fragmentSize);
+        popNextDataPacket(rpm);
+        if (entry) {
+            rpm->largeMessagePeeked = true;
+            rpm->peekedLargeMessage = entry;
+        }
+    }
+}
+
+bool rxManagerPopLargeMessage(tRxPacketManager * rpm) {
+    if (!rpm->largeMessagePeeked) {
+        return false;
+    }
+    rpm->largeMessagePeeked = false;
+    if (rpm->peekedLargeMessage) {
+        rpm->peekedLargeMessage->inUse = false;
+        rpm->peekedLargeMessage = NULL;
+        return true;
+    }
+    return popNextDataPacket(rpm);
+}
+
+void rxManagerInitReassembly(tRxPacketManager * rpm, uint8_t maxReassemblyEntries, tReassemblyEntry reassemblyEntries[]) {
+    memset(reassemblyEntries, 0, maxReassemblyEntries * sizeof(tReassemblyEntry));
+    rpm->reassemblyEntries = reassemblyEntries;
+    rpm->maxReassemblyEntries = maxReassemblyEntries;
 }
 
 void rxManagerInit(tRxPacketManager * rpm, uint8_t maxRxPacketEntries, tPacketEntry rxPacketEntries[], tPacketEntry * rxPacketQueue[]) {
+    memset(rpm, 0, sizeof(tRxPacketManager));
     memset(rxPacketEntries, 0, maxRxPacketEntries * sizeof(tPacketEntry));
     memset(rxPacketQueue, 0, maxRxPacketEntries * sizeof(tPacketEntry *));
     rpm->maxRxPacketEntries = maxRxPacketEntries;
-    rpm->rxPacketEntries = rxPacketEntries;
+    packetStoreInit(&rpm->packetStore, maxRxPacketEntries, rxPacketEntries);
     rpm->rxPacketQueue = rxPacketQueue;
+    rpm->windowSize = SLIDING_WINDOW_SIZE;
 }
 
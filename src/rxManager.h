@@ -10,14 +10,39 @@
 #include "microbus.h"
 
 
+// A large message being put back together from its fragments
+typedef struct {
+    bool inUse;
+    bool complete;
+    tNodeIndex srcNodeId;
+    uint16_t size;
+    uint16_t expectedSize;
+    uint8_t data[MAX_LARGE_MESSAGE_SIZE];
+} tReassemblyEntry;
+
 // Rx buffer - a circular buffer to allow access by other threads
 typedef struct {
     uint8_t maxRxPacketEntries;
-    tPacketEntry * rxPacketEntries;
+    tPacketStore packetStore;  // Only allocated/freed by the interrupt
     tPacketEntry ** rxPacketQueue;
     uint8_t start;
     uint8_t end;
+    uint8_t reclaimIndex;      // Popped entries before start still to be returned to the packet store
     uint8_t rxBufferLevel;
+    // Selective repeat - packets received after a missing one, entry i is for the expected seqNum + 1 + i
+    uint8_t windowSize; // The senders window - no packets will come from further ahead than this
+    tPacketEntry * outOfOrderEntries[MAX_SLIDING_WINDOW_SIZE-1];
+    // Message aggregation - where the user has got to in the head packet (only used by the user thread)
+    uint8_t * messagePacketData;
+    uint16_t messageOffset;
+    // Large messages - reassembly buffers provided by the user (only used by the user thread)
+    tReassemblyEntry * reassemblyEntries;
+    uint8_t maxReassemblyEntries;
+    tReassemblyEntry * peekedLargeMessage; // NULL if the peeked message is still in its (only) packet
+    bool largeMessagePeeked;
+    uint64_t removedSrcNodes;  // Set by the interrupt - their unfinished messages are dropped by the user thread
+    uint32_t numFragmentsDropped;
+    uint32_t numDatagramsDropped; // Skipped by the message calls - datagrams are only read as packets
 } tRxPacketManager;
 
 tPacketEntry * findFreeRxPacket(tRxPacketManager * rpm);
@@ -25,6 +50,17 @@ void addRxDataPacket(tRxPacketManager * rpm, tPacketEntry * packetEntry);
 void rxManagerRemoveAllPackets(tRxPacketManager * rpm, tNodeIndex nodeId);
 tPacket * peekNextRxDataPacket(tRxPacketManager * rpm);
 bool popNextDataPacket(tRxPacketManager * rpm);
+tPacket * rxManagerPeekNextMessagePacket(tRxPacketManager * rpm);
+uint8_t * rxManagerPeekMessage(tRxPacketManager * rpm, uint8_t * packetData, uint16_t packetSize, uint16_t * messageSize);
+bool rxManagerPopMessage(tRxPacketManager * rpm, uint8_t * packetData, uint16_t packetSize);
+void rxManagerFreePacket(tRxPacketManager * rpm, tPacketEntry * packetEntry);
+uint8_t rxManagerNumFreeEntries(tRxPacketManager * rpm);
+bool rxManagerStoreOutOfOrder(tRxPacketManager * rpm, uint8_t seqNumOffset, tPacketEntry * packetEntry);
+uint8_t rxManagerTakeInOrder(tRxPacketManager * rpm, tPacketEntry * inOrderEntries[MAX_SLIDING_WINDOW_SIZE-1]);
+uint8_t rxManagerGetSackBitmap(tRxPacketManager * rpm);
+void rxManagerInitReassembly(tRxPacketManager * rpm, uint8_t maxReassemblyEntries, tReassemblyEntry reassemblyEntries[]);
+uint8_t * rxManagerPeekLargeMessage(tRxPacketManager * rpm, bool isMaster, uint16_t * size, tNodeIndex * srcNodeId);
+bool rxManagerPopLargeMessage(tRxPacketManager * rpm);
 void rxManagerInit(tRxPacketManager * rpm, uint8_t maxRxPacketEntries, tPacketEntry rxPacketEntries[], tPacketEntry * rxPacketQueue[]);
 
 
@@ -39,7 +39,9 @@ static tNodeIndex getNextMasterRxAckNode(tSchedulerState * scheduler) {
             //     return INVALID_NODE_ID;
             // }
             tNodeIndex nodeId = getNextNodeInQueue(scheduler->activeTxNodes);
-            if (!nodeRecentlySent(scheduler, nodeId)) {
+            // Wait until the end of a burst to get the ack for all of it
+            bool midBurst = (scheduler->burstRemaining > 0) && (nodeId == scheduler->burstNode);
+            if (!nodeRecentlySent(scheduler, nodeId) && !midBurst) {
                 return nodeId;
             }
             // Should only ever have to iterate a maximum of this many 
@@ -49,13 +51,149 @@ static tNodeIndex getNextMasterRxAckNode(tSchedulerState * scheduler) {
     return INVALID_NODE_ID;
 }
 
+static uint16_t drrQuantum(tSchedulerState * scheduler, tNodeIndex nodeId) {
+    return scheduler->nodeWeight[nodeId] * scheduler->nodeTxBufferLevel[nodeId];
+}
+
+// Every node with a backlog adds its quantum to its deficit - anything it hadn't spent has already
+// been dropped when its buffer emptied
+static void startDrrRound(tSchedulerState * scheduler) {
+    uint64_t bitmap = scheduler->nodeTxNodes->bitmap;
+    scheduler->drrOwed = bitmap;
+    while (bitmap) {
+        tNodeIndex nodeId = __builtin_ctzll(bitmap);
+        bitmap &= bitmap - 1;
+        scheduler->drrDeficit[nodeId] += drrQuantum(scheduler, nodeId);
+    }
+}
+
+// Deficit round robin - each round a node's deficit grows by its quantum (weight * reported buffer
+// level) and every node tx slot spends one. A visit ends after DRR_MAX_BURST slots in a row, so a big
+// quantum takes several passes round the queue, and the round only ends once every deficit is spent
+static tNodeIndex getNextDrrNodeTxNode(tSchedulerState * scheduler) {
+    uint64_t owed = scheduler->drrOwed & scheduler->nodeTxNodes->bitmap;
+    bool visitOver = scheduler->drrNode >= MAX_NODES || scheduler->drrBurst >= DRR_MAX_BURST ||
+        (owed & NODE_BIT(scheduler->drrNode)) == 0;
+    if (visitOver) {
+        if (owed == 0) {
+            startDrrRound(scheduler);
+        }
+        // Nodes that have spent their deficit sit out the rest of the round
+        do {
+            scheduler->drrNode = getNextNodeInQueue(scheduler->nodeTxNodes);
+        } while ((scheduler->drrOwed & NODE_BIT(scheduler->drrNode)) == 0);
+        scheduler->drrBurst = 0;
+    }
+    scheduler->drrBurst++;
+    if (--scheduler->drrDeficit[scheduler->drrNode] == 0) {
+        scheduler->drrOwed &= ~NODE_BIT(scheduler->drrNode);
+    }
+    return scheduler->drrNode;
+}
+
+// A node whose buffer empties drops the rest of its deficit
+static void clearDrrDeficit(tSchedulerState * scheduler, tNodeIndex nodeId) {
+    scheduler->drrDeficit[nodeId] = 0;
+    scheduler->drrOwed &= ~NODE_BIT(nodeId);
+}
+
 static tNodeIndex getNextNodeTxNode(tSchedulerState * scheduler) {
     if (scheduler->nodeTxNodes->numNodes > 0) {
+        if (scheduler->drrEnabled) {
+            return getNextDrrNodeTxNode(scheduler);
+        }
         return getNextNodeInQueue(scheduler->nodeTxNodes);
     }
     return INVALID_NODE_ID;
 }
 
+// The node tx turns only depend on which nodes have data and their backlog class (see
+// schedulerUpdateNodeTxBufferLevel). Once these have settled one full period of the turns is
+// recorded and then replayed in O(1) until one of them changes. The master tx and rx ack turns
+// depend on what was scheduled recently, so they and everything around the rotation (servicing,
+// urgent, bursts, reservations, deadlines, allocation) are still worked out every slot
+static bool planInputsUnchanged(tSchedulerState * scheduler) {
+    tSchedulePlan * plan = &scheduler->plan;
+    bool unchanged = (plan->nodeTxNodes == scheduler->nodeTxNodes->bitmap)
+        && (plan->compiledVersion == plan->version);
+    plan->nodeTxNodes = scheduler->nodeTxNodes->bitmap;
+    plan->compiledVersion = plan->version;
+    return unchanged;
+}
+
+static void getNodeTxState(tSchedulerState * scheduler, tNodeTxState * state) {
+    memset(state, 0, sizeof(tNodeTxState));
+    state->drrOwed = scheduler->drrOwed & scheduler->nodeTxNodes->bitmap;
+    state->nextNode = scheduler->nodeTxNodes->nextNode;
+    state->drrNode = scheduler->drrNode;
+    state->drrBurst = scheduler->drrBurst;
+}
+
+// With deficit round robin the deficits only repeat between rounds, when they're all spent
+static bool canStartPlan(tSchedulerState * scheduler) {
+    return !scheduler->drrEnabled || (scheduler->drrOwed & scheduler->nodeTxNodes->bitmap) == 0;
+}
+
+static tNodeIndex getNextPlannedNodeTxNode(tSchedulerState * scheduler) {
+    tSchedulePlan * plan = &scheduler->plan;
+    if (scheduler->nodeTxNodes->numNodes == 0) {
+        return INVALID_NODE_ID;
+    }
+    if (!planInputsUnchanged(scheduler)) {
+        if (plan->state == PLAN_REPLAYING) {
+            scheduler->stats->schedulePlanInvalidations++;
+        }
+        plan->state = PLAN_SETTLING;
+        plan->count = 0;
+    }
+    tNodeIndex node;
+    switch (plan->state) {
+        case PLAN_SETTLING:
+            if (plan->count < SCHEDULE_PLAN_SETTLE_SLOTS || !canStartPlan(scheduler)) {
+                plan->count = MIN(plan->count + 1, SCHEDULE_PLAN_SETTLE_SLOTS);
+                return getNextNodeTxNode(scheduler);
+            }
+            getNodeTxState(scheduler, &plan->start);
+            plan->state = PLAN_COMPILING;
+            plan->count = 0;
+            // Fall through
+        case PLAN_COMPILING: {
+            node = getNextNodeTxNode(scheduler);
+            plan->slots[plan->count++] = node;
+            tNodeTxState state;
+            getNodeTxState(scheduler, &state);
+            if (memcmp(&state, &plan->start, sizeof(tNodeTxState)) == 0) {
+                MB_SCHEDULER_PRINTF("Master schedule plan compiled, length:%u\n", plan->count);
+                plan->state = PLAN_REPLAYING;
+                plan->length = plan->count;
+                plan->count = 0;
+            } else if (plan->count == SCHEDULE_PLAN_LENGTH) {
+                // The period is too long to record - try again later
+                plan->state = PLAN_SETTLING;
+                plan->count = 0;
+            }
+            return node;
+        }
+        default:
+            node = plan->slots[plan->count];
+            plan->count = (plan->count + 1) % plan->length;
+            scheduler->stats->schedulePlanSlots++;
+            return node;
+    }
+}
+
+// Nodes with urgent packets go before the normal turns - but not while they're recently scheduled,
+// as their next report of what's waiting hasn't come back yet
+static tNodeIndex getNextUrgentNode(tSchedulerState * scheduler) {
+    for (uint8_t i=0; i<scheduler->urgentNodes.numNodes; i++) {
+        tNodeIndex nodeId = getNextNodeInQueue(&scheduler->urgentNodes);
+        if (nodeQueueContains(scheduler->activeNodes, nodeId) && !nodeRecentlySent(scheduler, nodeId)) {
+            return nodeId;
+        }
+    }
+    return INVALID_NODE_ID;
+}
+
 static tNodeIndex getNextServiceNode(tSchedulerState * scheduler, bool avoidRecentlyScheduled) {
     scheduler->countTillNextService = MAX_SLOTS_BETWEEN_SERVICING;
     tNodeIndex nodeId = UNALLOCATED_NODE_ID; // If nothing to service it means there are no nodes yet - so send an unallocated node id
@@ -74,19 +212,62 @@ static tNodeIndex getNextServiceNode(tSchedulerState * scheduler, bool avoidRece
     return INVALID_NODE_ID;
 }
 
+// The regular service slot only goes to a node whose TTL is getting low - nodes that have been
+// sending don't need one and idle nodes come up about every MASTER_TIMEOUT_US/4. If none are
+// due the slot goes to the normal scheduling
+static tNodeIndex getNextDueServiceNode(tSchedulerState * scheduler) {
+    if (scheduler->nodeTimeToLive == NULL) {
+        return getNextServiceNode(scheduler, true);
+    }
+    scheduler->countTillNextService = MAX_SLOTS_BETWEEN_SERVICING;
+    for (uint8_t i=0; i<scheduler->activeNodes->numNodes; i++) {
+        tNodeIndex nodeId = getNextNodeInQueue(scheduler->activeNodes);
+        if (scheduler->nodeTimeToLive[nodeId] <= SERVICE_TIME_TO_LIVE && !nodeRecentlySent(scheduler, nodeId)) {
+            MB_SCHEDULER_PRINTF("Master scheduling SERVICE_NODE, node:%u, ttl:%u\n", nodeId, scheduler->nodeTimeToLive[nodeId]);
+            return nodeId;
+        }
+    }
+    return INVALID_NODE_ID;
+}
 
-static tNodeIndex scheduleNextAllocatedNode(tSchedulerState * scheduler, uint8_t masterTxBufferLevel) {
-    tNodeIndex node = INVALID_NODE_ID;
-    
-    if (scheduler->countTillNextService == 0) {
-        node = getNextServiceNode(scheduler, true);
-        if (node != INVALID_NODE_ID) {
-            return node;
+// Earliest deadline first over the nodes with a contract. It only steps in once the earliest
+// is close to due (with enough slack for every contract to fall due at once, for the reserved
+// slots and for a forced master slot in single channel mode), so bulk traffic gets the slots in between
+static tNodeIndex getNextDeadlineNode(tSchedulerState * scheduler) {
+    tNodeIndex earliestNode = INVALID_NODE_ID;
+    int16_t earliestSlots = INT16_MAX;
+    uint64_t bitmap = scheduler->deadlineNodes.bitmap;
+    while (bitmap) {
+        tNodeIndex nodeId = __builtin_ctzll(bitmap);
+        bitmap &= bitmap - 1;
+        if (!nodeQueueContains(scheduler->activeNodes, nodeId)) {
+            // The contract only starts once the node is on the network
+            scheduler->nodeDeadline[nodeId] = scheduler->slotCount + scheduler->nodeMaxSlotInterval[nodeId];
+            continue;
+        }
+        int16_t slots = (int16_t)(scheduler->nodeDeadline[nodeId] - scheduler->slotCount);
+        if (slots < 0) {
+            scheduler->stats->deadlineOverruns++;
+            MB_SCHEDULER_PRINTF("Master missed deadline, node:%u\n", nodeId);
+            scheduler->nodeDeadline[nodeId] = scheduler->slotCount;
+            slots = 0;
+        }
+        if (slots < earliestSlots) {
+            earliestSlots = slots;
+            earliestNode = nodeId;
         }
     }
-    
-    // Whichever turn it is (masterRxAck or nodeTx) try and see if there is a candidate
-    // if not give the other one a try
+    int16_t slack = scheduler->deadlineNodes.numNodes + scheduler->numReservations + (scheduler->numTxNodesScheduled > 1 ? 1 : 0);
+    if (earliestSlots < slack) {
+        return earliestNode;
+    }
+    return INVALID_NODE_ID;
+}
+
+// Whichever turn it is (masterRxAck or nodeTx) try and see if there is a candidate
+// if not give the other one a try
+static tNodeIndex getNextRotationNode(tSchedulerState * scheduler, uint8_t masterTxBufferLevel) {
+    tNodeIndex node = INVALID_NODE_ID;
     for (uint8_t i=0; i<MAX_TURN; i++) {
         switch (scheduler->nextTurn) {
             case MASTER_TX:
@@ -102,7 +283,10 @@ static tNodeIndex scheduleNextAllocatedNode(tSchedulerState * scheduler, uint8_t
                 node = getNextMasterRxAckNode(scheduler);
                 break;
             case NODE_TX:
-                node = getNextNodeTxNode(scheduler);
+                // The node would only send an empty packet
+                if (scheduler->masterRxCredits > 0) {
+                    node = scheduler->plan.enabled ? getNextPlannedNodeTxNode(scheduler) : getNextNodeTxNode(scheduler);
+                }
                 break;
             default:
                 microbusAssert(0, "");
@@ -122,18 +306,111 @@ static tNodeIndex scheduleNextAllocatedNode(tSchedulerState * scheduler, uint8_t
             return node;
         }
     }
+    return INVALID_NODE_ID;
+}
+
+static tNodeIndex scheduleNextAllocatedNode(tSchedulerState * scheduler, uint8_t masterTxBufferLevel) {
+    tNodeIndex node = INVALID_NODE_ID;
+    
+    if (scheduler->countTillNextService == 0) {
+        node = getNextDueServiceNode(scheduler);
+        if (node != INVALID_NODE_ID) {
+            return node;
+        }
+    }
+
+    if (scheduler->urgentNodes.numNodes > 0) {
+        node = getNextUrgentNode(scheduler);
+        if (node != INVALID_NODE_ID) {
+            MB_SCHEDULER_PRINTF("Master scheduling URGENT, node:%u\n", node);
+            return node;
+        }
+    }
+
+    // Single channel master bursts - the master keeps the bus for the rest of the burst
+    // then the node gets the next slot to ack it all. Only when the nodes have nothing
+    // to send so they keep their share of the bus
+    if (scheduler->burstRemaining > 0) {
+        scheduler->burstRemaining = 0;
+        if (scheduler->nodeTxNodes->numNodes == 0) {
+            MB_SCHEDULER_PRINTF("Master scheduling MASTER_BURST\n");
+            return MASTER_NODE_ID;
+        }
+    }
+    if (scheduler->burstAckNode != INVALID_NODE_ID) {
+        node = scheduler->burstAckNode;
+        scheduler->burstAckNode = INVALID_NODE_ID;
+        if (nodeQueueContains(scheduler->activeNodes, node)) {
+            MB_SCHEDULER_PRINTF("Master scheduling BURST_ACK, node:%u\n", node);
+            return node;
+        }
+    }
+    
+    node = getNextRotationNode(scheduler, masterTxBufferLevel);
+    if (node != INVALID_NODE_ID) {
+        return node;
+    }
     // If no slot is needed for masterRxAck or nodeTx then use it for servicing
     return getNextServiceNode(scheduler, false);
 }
 
+// Shift down the last scheduled nodes and record the new one
+static void recordRecentlyScheduled(tSchedulerState * scheduler, tNodeIndex node) {
+    for (uint32_t i=0; i<MAX_MASTER_SLOTS_BETWEEN_ACKS-1; i++) {
+        scheduler->recentScheduledNodes[i] = scheduler->recentScheduledNodes[i+1];
+    }
+    scheduler->recentScheduledNodes[MAX_MASTER_SLOTS_BETWEEN_ACKS-1] = node;
+}
+
+// Reserved slots come before anything else. If the node isn't on the network (yet)
+// the slot goes back to the normal scheduling
+static tNodeIndex getNextReservedNode(tSchedulerState * scheduler) {
+    while (scheduler->reservationsDue.numNodes > 0) {
+        tNodeIndex nodeId = getNextNodeInQueue(&scheduler->reservationsDue);
+        nodeQueueRemove(&scheduler->reservationsDue, nodeId);
+        if (nodeQueueContains(scheduler->activeNodes, nodeId)) {
+            return nodeId;
+        }
+    }
+    return INVALID_NODE_ID;
+}
+
+static void updateReservations(tSchedulerState * scheduler) {
+    for (uint32_t i=0; i<scheduler->numReservations; i++) {
+        tSlotReservation * reservation = &scheduler->reservations[i];
+        if (reservation->countdown == 0) {
+            nodeQueueAdd(&scheduler->reservationsDue, reservation->nodeId);
+            reservation->countdown = reservation->period;
+        }
+        reservation->countdown--;
+    }
+}
+
 tNodeIndex scheduleNextNode(tSchedulerState * scheduler, uint8_t masterTxBufferLevel) {
-    tNodeIndex node;
-    if (scheduler->countTillNextAllocation == 0) {
+    tNodeIndex node = getNextReservedNode(scheduler);
+    if (node != INVALID_NODE_ID) {
+        // Allocation and servicing work around it the same as for deadlines
+        MB_SCHEDULER_PRINTF("Master scheduling RESERVED, node:%u\n", node);
+        recordRecentlyScheduled(scheduler, node);
+    } else if ((node = getNextDeadlineNode(scheduler)) != INVALID_NODE_ID) {
+        // Everything else waits (allocation and servicing are only put back a slot)
+        MB_SCHEDULER_PRINTF("Master scheduling DEADLINE, node:%u\n", node);
+        recordRecentlyScheduled(scheduler, node);
+    } else if (scheduler->countTillNextAllocation == 0) {
         MB_SCHEDULER_PRINTF("Master scheduling ALLOCATION\n");
         // "Pause" any other scheduling whilst we schedule an unallocated slot
         // for any new nodes to join in
         node = UNALLOCATED_NODE_ID;
 
+        // Every other one is left for nodes to claim back the IDs being held for them
+        // Each ID has its own sub-slot so one slot covers a block of them
+        scheduler->rejoinTurn = !scheduler->rejoinTurn;
+        if (scheduler->rejoinNodes != NULL && scheduler->rejoinNodes->numNodes > 0 && scheduler->rejoinTurn) {
+            tNodeIndex firstNodeId = nodeQueueNextAfter(scheduler->rejoinNodes, scheduler->lastRejoinNodeId);
+            scheduler->lastRejoinNodeId = MIN(firstNodeId + NEW_NODE_REQUEST_SUB_SLOTS - 1, MAX_NODES - 1);
+            node = REJOIN_SLOT_FLAG | firstNodeId;
+        }
+
         // If we've heard a new node since the last unallocated slot then
         // the gap between will be reset to 2. Then after 128
         // unallocated slots if we haven't heard a new node packet
@@ -157,27 +434,48 @@ tNodeIndex scheduleNextNode(tSchedulerState * scheduler, uint8_t masterTxBufferL
         microbusAssert(scheduler->countTillNextService > 0, "");
         scheduler->countTillNextAllocation--;
         scheduler->countTillNextService--;
-        // Shift down the last scheduled nodes and record the new one
-        for (uint32_t i=0; i<MAX_MASTER_SLOTS_BETWEEN_ACKS-1; i++) {
-            scheduler->recentScheduledNodes[i] = scheduler->recentScheduledNodes[i+1];
-        }
-        scheduler->recentScheduledNodes[MAX_MASTER_SLOTS_BETWEEN_ACKS-1] = node;
+        recordRecentlyScheduled(scheduler, node);
     }
     if (node == INVALID_NODE_ID) {
         node = UNALLOCATED_NODE_ID;
+    } else if (nodeQueueContains(&scheduler->deadlineNodes, node)) {
+        // Any slot the node gets counts towards its contract
+        scheduler->nodeDeadline[node] = scheduler->slotCount + scheduler->nodeMaxSlotInterval[node];
     }
     return node;
 }
 
+// A busy master (or slow acks) wants a shallower look-ahead so it gets the bus more often,
+// a quiet one a deeper one so fewer slots go on sending the schedule
+static void updateLookAheadTarget(tSchedulerState * scheduler, uint8_t masterTxBufferLevel) {
+    if ((scheduler->slotCount % LOOKAHEAD_UPDATE_SLOTS) != 0) {
+        return;
+    }
+    uint8_t * target = &scheduler->targetNumTxNodesScheduled;
+    if (masterTxBufferLevel > LOOKAHEAD_BUSY_TX_BACKLOG || scheduler->ackLatency > LOOKAHEAD_MAX_ACK_LATENCY) {
+        *target = MAX(MIN_TX_NODES_SCHEDULED, *target - 1);
+    } else if (masterTxBufferLevel == 0) {
+        *target = MIN(MAX_TX_NODES_SCHEDULED, *target + 1);
+    }
+}
+
 void schedulerUpdateAndCalcNextTxNodes(tSchedulerState * scheduler, tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED], uint8_t masterTxBufferLevel) {
+    scheduler->slotCount++;
+    updateReservations(scheduler);
     // Work out the next node (at position scheduler->numTxNodesScheduled - as we're alway generate 1 extra for the delay)
     if (scheduler->numTxNodesScheduled == 1) {
         nodesToTx[0] = scheduleNextNode(scheduler, 0);
     } else {
+        uint8_t numTxNodesScheduled = scheduler->numTxNodesScheduled;
         bool oneMasterTx = false;
+        bool masterBeforeLast = false;
+
+        if (scheduler->adaptiveLookAhead) {
+            updateLookAheadTarget(scheduler, masterTxBufferLevel);
+        }
 
         // Shift all nodes down (and check if the master is currently scheduled)
-        for (uint8_t i=0; i<scheduler->numTxNodesScheduled-1; i++) {
+        for (uint8_t i=0; i<numTxNodesScheduled-1; i++) {
             nodesToTx[i] = nodesToTx[i+1];
             if (nodesToTx[i] == MASTER_NODE_ID) {
                 if (masterTxBufferLevel > 0) {
@@ -187,9 +485,17 @@ void schedulerUpdateAndCalcNextTxNodes(tSchedulerState * scheduler, tNodeIndex n
             // Work out if we need to send a master packet
             if (nodesToTx[i] == MASTER_NODE_ID) {
                 oneMasterTx = true;
+                masterBeforeLast |= (i < numTxNodesScheduled-2);
             }
         }
 
+        // Shallower - the slots already sent out to the nodes still stand so just don't add one
+        // this time. Only if the master is still in what's left to send the next schedule
+        if (scheduler->targetNumTxNodesScheduled < numTxNodesScheduled && masterBeforeLast) {
+            scheduler->numTxNodesScheduled--;
+            return;
+        }
+
         // Schedule the last node
         if (oneMasterTx) {
             // Schedule the next node (add on to the end)
@@ -198,11 +504,69 @@ void schedulerUpdateAndCalcNextTxNodes(tSchedulerState * scheduler, tNodeIndex n
             // If the master is not currently scheduled then it needs to be 
             // to ensure the next schedule gets sent out
             nodesToTx[scheduler->numTxNodesScheduled-1] = MASTER_NODE_ID;
+            if (scheduler->reservationsDue.numNodes > 0) {
+                // Goes out in the next slot instead
+                scheduler->stats->reservedSlotsDelayed++;
+            }
+        }
+
+        // Deeper - add an extra slot on the end (the master is always in the ones before it by now)
+        if (scheduler->targetNumTxNodesScheduled > numTxNodesScheduled) {
+            nodesToTx[numTxNodesScheduled] = scheduleNextNode(scheduler, masterTxBufferLevel);
+            scheduler->numTxNodesScheduled++;
         }
     }
 }
 
+// Single channel only - the depth starts from what the master was set up with
+void schedulerSetAdaptiveLookAhead(tSchedulerState * scheduler, bool enabled) {
+    scheduler->adaptiveLookAhead = enabled && (scheduler->numTxNodesScheduled > 1);
+    scheduler->targetNumTxNodesScheduled = scheduler->numTxNodesScheduled;
+}
+
+// The oldest unacked packet to the node has gone out
+void schedulerRecordTx(tSchedulerState * scheduler, tNodeIndex dstNodeId) {
+    scheduler->txSentSlot[dstNodeId] = scheduler->slotCount;
+}
+
+// Packets to the node have been acked - any left are timed from now
+void schedulerRecordAck(tSchedulerState * scheduler, tNodeIndex srcNodeId) {
+    uint16_t latency = MIN((uint16_t)(scheduler->slotCount - scheduler->txSentSlot[srcNodeId]), 255);
+    scheduler->ackLatency = (3 * scheduler->ackLatency + latency) / 4;
+    scheduler->txSentSlot[srcNodeId] = scheduler->slotCount;
+}
+
+// Forget the node's buffer level - otherwise when it rejoins with data buffered
+// it's never added back to nodeTxNodes
+void schedulerRemoveNode(tSchedulerState * scheduler, tNodeIndex nodeId) {
+    nodeQueueRemoveIfExists(scheduler->nodeTxNodes, nodeId);
+    nodeQueueRemoveIfExists(&scheduler->urgentNodes, nodeId);
+    scheduler->nodeTxBufferLevel[nodeId] = 0;
+    clearDrrDeficit(scheduler, nodeId);
+}
+
+// Reported in every node packet (not just data packets) so an idle node can ask for slots
+void schedulerUpdateNodeUrgentBufferLevel(tSchedulerState * scheduler, tNodeIndex srcNodeId, uint8_t urgentBufferLevel) {
+    if (urgentBufferLevel > 0) {
+        nodeQueueAdd(&scheduler->urgentNodes, srcNodeId);
+    } else {
+        nodeQueueRemoveIfExists(&scheduler->urgentNodes, srcNodeId);
+    }
+}
+
+// All the rotation needs to know about a backlog - whether there is one and, for deficit round robin, its quantum
+static uint16_t backlogClass(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t bufferLevel) {
+    if (bufferLevel == 0 || !scheduler->drrEnabled) {
+        return bufferLevel > 0;
+    }
+    return scheduler->nodeWeight[nodeId] * bufferLevel;
+}
+
+
 void schedulerUpdateNodeTxBufferLevel(tSchedulerState * scheduler, tNodeIndex srcNodeId, uint8_t bufferLevel) {
+    if (backlogClass(scheduler, srcNodeId, scheduler->nodeTxBufferLevel[srcNodeId]) != backlogClass(scheduler, srcNodeId, bufferLevel)) {
+        scheduler->plan.version++;
+    }
     // Record if the node has more packets it wants to send
     if (scheduler->nodeTxBufferLevel[srcNodeId] == 0 && bufferLevel > 0) {
         // Buffer level 0 -> 1
@@ -210,11 +574,150 @@ void schedulerUpdateNodeTxBufferLevel(tSchedulerState * scheduler, tNodeIndex sr
     } else if (scheduler->nodeTxBufferLevel[srcNodeId] > 0 && bufferLevel == 0) {
         // Buffer level 1 -> 0
         nodeQueueRemove(scheduler->nodeTxNodes, srcNodeId);
+        clearDrrDeficit(scheduler, srcNodeId);
     }
     scheduler->nodeTxBufferLevel[srcNodeId] = bufferLevel;
 }
 
-void schedulerInit(tSchedulerState * scheduler, tNodeQueue * activeNodes, tNodeQueue * activeTxNodes, tNodeQueue * nodeTxNodes, uint8_t numTxNodesScheduled, uint8_t maxSlotsBetweenUnallocated) {
+// Called by the master tx with each packet it sends. burstRemaining is how many more packets
+// to the node should follow this one (0 if it's the last of a burst)
+void schedulerSetMasterBurst(tSchedulerState * scheduler, tNodeIndex dstNodeId, uint8_t burstRemaining) {
+    if (burstRemaining == 0 && scheduler->burstNode == dstNodeId) {
+        scheduler->burstAckNode = dstNodeId;
+    }
+    scheduler->burstNode = burstRemaining > 0 ? dstNodeId : INVALID_NODE_ID;
+    scheduler->burstRemaining = burstRemaining;
+}
+
+// Service slots still come round every MAX_SLOTS_BETWEEN_SERVICING so low weight nodes aren't starved
+void schedulerSetDrrEnabled(tSchedulerState * scheduler, bool enabled) {
+    scheduler->drrEnabled = enabled;
+    scheduler->drrOwed = 0;
+    scheduler->drrBurst = 0;
+    memset(scheduler->drrDeficit, 0, sizeof(scheduler->drrDeficit));
+    scheduler->plan.version++;
+}
+
+void schedulerSetNodeWeight(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t weight) {
+    microbusAssert(nodeId < MAX_NODES && weight > 0, "");
+    scheduler->nodeWeight[nodeId] = weight;
+    scheduler->plan.version++;
+}
+
+// Off by default - see getNextPlannedNodeTxNode
+void schedulerSetPlanEnabled(tSchedulerState * scheduler, bool enabled) {
+    memset(&scheduler->plan, 0, sizeof(tSchedulePlan));
+    scheduler->plan.enabled = enabled;
+}
+
+// Flow control - what the master is advertising to the nodes (RX_CREDITS_UNLIMITED if it isn't used)
+void schedulerSetMasterRxCredits(tSchedulerState * scheduler, uint8_t rxCredits) {
+    scheduler->masterRxCredits = rxCredits;
+}
+
+// Share of the bus needed for one slot every interval slots (rounded up)
+static uint16_t slotShare(uint8_t interval) {
+    return interval ? (DEADLINE_CAPACITY + interval - 1) / interval : 0;
+}
+
+// Contracts and reservations have to leave room for the master slots and servicing
+static bool schedulerHasRoom(tSchedulerState * scheduler, uint16_t load) {
+    uint16_t overhead = DEADLINE_CAPACITY / MAX_SLOTS_BETWEEN_SERVICING;
+    if (scheduler->numTxNodesScheduled > 1) {
+        overhead += DEADLINE_CAPACITY / scheduler->numTxNodesScheduled;
+    }
+    return load + overhead <= DEADLINE_CAPACITY;
+}
+
+// A node with a contract gets a slot at least every maxSlotInterval slots (0 removes the contract).
+// Returns false (and leaves any old contract) if there isn't room on the bus for it alongside
+// the master slots, servicing and the other contracts
+bool schedulerSetNodeMaxSlotInterval(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t maxSlotInterval) {
+    microbusAssert(nodeId >= FIRST_NODE_ID && nodeId < MAX_NODES, "");
+    uint16_t load = scheduler->deadlineLoad - slotShare(scheduler->nodeMaxSlotInterval[nodeId]);
+    if (maxSlotInterval == 0) {
+        nodeQueueRemoveIfExists(&scheduler->deadlineNodes, nodeId);
+        scheduler->nodeMaxSlotInterval[nodeId] = 0;
+        scheduler->deadlineLoad = load;
+        return true;
+    }
+    load += slotShare(maxSlotInterval);
+    if (!schedulerHasRoom(scheduler, load)) {
+        scheduler->stats->deadlineContractsRejected++;
+        return false;
+    }
+    // Set up before adding to the queue as the scheduler may be running
+    scheduler->nodeDeadline[nodeId] = scheduler->slotCount + maxSlotInterval;
+    scheduler->nodeMaxSlotInterval[nodeId] = maxSlotInterval;
+    scheduler->deadlineLoad = load;
+    nodeQueueAdd(&scheduler->deadlineNodes, nodeId);
+    return true;
+}
+
+static uint8_t gcd(uint8_t a, uint8_t b) {
+    while (b) {
+        uint8_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Node gets every period'th slot, the first one phase slots from now (period 0 removes it).
+// Only one reservation per node. Returns false if it would land on the same slot as another
+// reservation or there isn't room on the bus (counted in stats.slotReservationsRejected).
+// The table is walked by the scheduler each slot, so changing it whilst the bus is running
+// can move a reserved slot by one
+bool schedulerReserveSlots(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t period, uint8_t phase) {
+    microbusAssert(nodeId >= FIRST_NODE_ID && nodeId < MAX_NODES, "");
+    microbusAssert(period == 0 || phase < period, "");
+    uint16_t load = scheduler->deadlineLoad;
+    int32_t existing = -1;
+    for (uint32_t i=0; i<scheduler->numReservations; i++) {
+        tSlotReservation * reservation = &scheduler->reservations[i];
+        if (reservation->nodeId == nodeId) {
+            existing = i;
+            load -= slotShare(reservation->period);
+        } else if (period > 0) {
+            // Two periodic slots meet if their phases match modulo the gcd of the periods
+            uint8_t g = gcd(period, reservation->period);
+            if ((phase % g) == (reservation->countdown % g)) {
+                scheduler->stats->slotReservationsRejected++;
+                return false;
+            }
+        }
+    }
+    if (period == 0) {
+        if (existing >= 0) {
+            scheduler->numReservations--;
+            scheduler->reservations[existing] = scheduler->reservations[scheduler->numReservations];
+            scheduler->deadlineLoad = load;
+        }
+        return true;
+    }
+    load += slotShare(period);
+    if ((existing < 0 && scheduler->numReservations == MAX_SLOT_RESERVATIONS) || !schedulerHasRoom(scheduler, load)) {
+        scheduler->stats->slotReservationsRejected++;
+        return false;
+    }
+    tSlotReservation * reservation = &scheduler->reservations[existing >= 0 ? existing : scheduler->numReservations];
+    reservation->nodeId = nodeId;
+    reservation->period = period;
+    reservation->countdown = phase;
+    scheduler->deadlineLoad = load;
+    if (existing < 0) {
+        // Filled in first as the scheduler may be running
+        scheduler->numReservations++;
+    }
+    return true;
+}
+
+// IDs held back for nodes that have left - they get a chance to claim them back in the allocation slots
+void schedulerSetRejoinNodes(tSchedulerState * scheduler, tNodeQueue * rejoinNodes) {
+    scheduler->rejoinNodes = rejoinNodes;
+}
+
+void schedulerInit(tSchedulerState * scheduler, tNodeQueue * activeNodes, tNodeQueue * activeTxNodes, tNodeQueue * nodeTxNodes, uint8_t numTxNodesScheduled, uint8_t maxSlotsBetweenUnallocated, uint8_t * nodeTimeToLive, tNodeStats * stats) {
     memset(scheduler, 0, sizeof(tSchedulerState));
     NEW_NODE_HEARD_UPDATE_SCHEDULER(*scheduler);
     scheduler->nextMasterRxAckNode = FIRST_NODE_ID;
@@ -223,6 +726,17 @@ void schedulerInit(tSchedulerState * scheduler, tNodeQueue * activeNodes, tNodeQ
     scheduler->activeNodes = activeNodes;
     scheduler->activeTxNodes = activeTxNodes;
     scheduler->nodeTxNodes = nodeTxNodes;
+    scheduler->nodeTimeToLive = nodeTimeToLive;
     scheduler->maxSlotsBetweenUnallocated = maxSlotsBetweenUnallocated;
     scheduler->numTxNodesScheduled = numTxNodesScheduled;
+    scheduler->targetNumTxNodesScheduled = numTxNodesScheduled;
+    scheduler->drrNode = INVALID_NODE_ID;
+    scheduler->burstNode = INVALID_NODE_ID;
+    scheduler->burstAckNode = INVALID_NODE_ID;
+    scheduler->masterRxCredits = RX_CREDITS_UNLIMITED;
+    scheduler->stats = stats;
+    nodeQueueInit(&scheduler->deadlineNodes);
+    nodeQueueInit(&scheduler->reservationsDue);
+    nodeQueueInit(&scheduler->urgentNodes);
+    memset(scheduler->nodeWeight, DRR_DEFAULT_WEIGHT, sizeof(scheduler->nodeWeight));
 }
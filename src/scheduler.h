@@ -8,10 +8,21 @@
 #include "microbus.h"
 #include "txManager.h"
 
-#define MAX_MASTER_SLOTS_BETWEEN_ACKS 4 // Needs to match the tx queue size (otherwise cannot fit in more tx packets till the ack comes back)
+#define MAX_MASTER_SLOTS_BETWEEN_ACKS 4 // Min slots before the same node is given another ack slot (the acks take a few slots to come back). Independent of the window size
 #define MAX_SLOTS_BETWEEN_SERVICING 6
+#define SERVICE_TIME_TO_LIVE 96 // A node only needs a service slot once its master TTL is down to this (a quarter of MASTER_TIMEOUT_US since last heard)
 #define MIN_SLOTS_BETWEEN_UNALLOCATED 2
 #define NUM_SLOTS_BEFORE_ALLOCATION_CHANGED 128
+#define DRR_MAX_BURST SLIDING_WINDOW_SIZE // Most node tx slots in a row - any more and the node runs out of window before it's acked
+#define DRR_DEFAULT_WEIGHT 1
+#define DEADLINE_CAPACITY 256 // Bus share (in 1/256ths) that deadline contracts and reservations are admitted against
+#define MAX_SLOT_RESERVATIONS 8
+#define MIN_TX_NODES_SCHEDULED 2 // Shallowest single channel look-ahead (1 is dual channel)
+#define LOOKAHEAD_UPDATE_SLOTS 32 // How often the adaptive look-ahead can change by one
+#define LOOKAHEAD_BUSY_TX_BACKLOG 4 // Master tx packets buffered above which the look-ahead gets shallower
+#define LOOKAHEAD_MAX_ACK_LATENCY 16 // Average slots to get an ack above which the look-ahead gets shallower
+#define SCHEDULE_PLAN_LENGTH 32 // Most node tx turns compiled into a plan and then replayed
+#define SCHEDULE_PLAN_SETTLE_SLOTS 16 // Node tx turns the plan inputs have to stay the same for before compiling one
 
 #define FOREACH_TURN_ENUM(APPLY_MACRO) \
     APPLY_MACRO(MASTER_TX) \
@@ -33,30 +44,109 @@ static const char *TURN_ENUM_STRING[] = {
 #endif
 
 
+// A node gets every period'th slot
+typedef struct {
+    tNodeIndex nodeId;
+    uint8_t period;
+    uint8_t countdown; // Slots until the next reserved one
+} tSlotReservation;
+
+typedef enum {
+    PLAN_SETTLING,
+    PLAN_COMPILING,
+    PLAN_REPLAYING
+} ePlanState;
+
+// Where the node tx turns carry on from
+typedef struct {
+    uint64_t drrOwed;
+    tNodeIndex nextNode;
+    tNodeIndex drrNode;
+    uint8_t drrBurst;
+} tNodeTxState;
+
+// The node tx turns repeat while the nodes' backlogs don't change, so one full period of
+// them is recorded and replayed
+typedef struct {
+    bool enabled;
+    ePlanState state;
+    uint8_t count;   // Turns settled, or the position in slots when compiling/replaying
+    uint8_t length;  // Turns in one period
+    uint8_t version; // Bumped when a node changes backlog class
+    tNodeTxState start; // The period is complete once the node tx turns come back round to here
+    // What the plan was compiled from - any change and it's thrown away
+    uint64_t nodeTxNodes;
+    uint8_t compiledVersion;
+    tNodeIndex slots[SCHEDULE_PLAN_LENGTH];
+} tSchedulePlan;
+
 // Master only
 typedef struct {
     // uint16_t masterTxBufferLevel;
     uint8_t numTxNodesScheduled;
+    uint8_t targetNumTxNodesScheduled; // Moved towards one step at a time so the nodes stay in sync
+    bool adaptiveLookAhead;
+    uint8_t ackLatency; // Average slots from sending the oldest unacked packet to a node to its ack
     uint8_t maxSlotsBetweenUnallocated;
     uint8_t unallocatedSlotGapUpdateCount;
     uint8_t unallocatedSlotGap;
     uint8_t countTillNextAllocation;
+    bool rejoinTurn; // Alternates allocation slots between new nodes and rejoin claims
+    tNodeIndex lastRejoinNodeId; // End of the block of IDs in the last rejoin slot
     uint8_t countTillNextService;
     uint8_t rxAckEndCount;
+    bool drrEnabled;
+    uint64_t drrOwed; // Nodes with some of their deficit left to spend this round
+    uint8_t drrBurst; // Node tx slots drrNode has had in a row
+    tNodeIndex drrNode;
     eSchedulerTurn nextTurn;
     tNodeIndex nextServiceNode;
     tNodeIndex nextMasterRxAckNode;
     tNodeIndex nextNodeTxNode;
     tNodeIndex recentScheduledNodes[MAX_MASTER_SLOTS_BETWEEN_ACKS];
     uint8_t nodeTxBufferLevel[MAX_NODES];
+    uint8_t nodeWeight[MAX_NODES]; // Only used for deficit round robin
+    uint16_t drrDeficit[MAX_NODES]; // Node tx slots owed this round
+    uint16_t slotCount;
+    uint16_t deadlineLoad; // Sum of DEADLINE_CAPACITY/interval over all contracts and reservations
+    tNodeQueue deadlineNodes; // Nodes with a max slot interval contract
+    uint8_t nodeMaxSlotInterval[MAX_NODES];
+    uint16_t nodeDeadline[MAX_NODES]; // Last slotCount the node can be scheduled in and still meet its contract
+    uint8_t numReservations;
+    tSlotReservation reservations[MAX_SLOT_RESERVATIONS];
+    // Single channel master bursts
+    uint8_t burstRemaining; // More master packets to go in the burst
+    tNodeIndex burstNode;
+    tNodeIndex burstAckNode; // Burst finished - waiting for its ack slot
+    uint16_t txSentSlot[MAX_NODES]; // slotCount when the oldest unacked packet to each node went out
+    tNodeQueue reservationsDue; // Reserved slots waiting to go out (normally only ever the current one)
+    tNodeQueue urgentNodes; // Nodes that have reported urgent packets waiting to go out
+    uint8_t masterRxCredits; // Flow control - no node tx turns while the master has no room
+    tSchedulePlan plan;
+    tNodeStats * stats;
     tNodeQueue * activeNodes;   // All connected nodes
     tNodeQueue * activeTxNodes; // Nodes we have sent data to and are waiting for an ack
     tNodeQueue * nodeTxNodes;   // Nodes that currently have tx packets buffered waiting to go out
-} tSchedulerState; // ~112 bytes
+    uint8_t * nodeTimeToLive;   // The master's TTL for each node (NULL to service every node in turn)
+    tNodeQueue * rejoinNodes;   // IDs held back for nodes that have left (NULL for none)
+} tSchedulerState; // ~820 bytes
 
-void schedulerInit(tSchedulerState * scheduler, tNodeQueue * activeNodes, tNodeQueue * activeTxNodes, tNodeQueue * nodeTxNodes, uint8_t numTxNodesScheduled, uint8_t maxSlotsBetweenUnallocated);
+void schedulerInit(tSchedulerState * scheduler, tNodeQueue * activeNodes, tNodeQueue * activeTxNodes, tNodeQueue * nodeTxNodes, uint8_t numTxNodesScheduled, uint8_t maxSlotsBetweenUnallocated, uint8_t * nodeTimeToLive, tNodeStats * stats);
 void schedulerUpdateAndCalcNextTxNodes(tSchedulerState * scheduler, tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED], uint8_t masterTxBufferLevel);
 void schedulerUpdateNodeTxBufferLevel(tSchedulerState * scheduler, tNodeIndex srcNodeId, uint8_t bufferLevel);
+void schedulerUpdateNodeUrgentBufferLevel(tSchedulerState * scheduler, tNodeIndex srcNodeId, uint8_t urgentBufferLevel);
+void schedulerRemoveNode(tSchedulerState * scheduler, tNodeIndex nodeId);
+void schedulerSetDrrEnabled(tSchedulerState * scheduler, bool enabled);
+void schedulerSetNodeWeight(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t weight);
+bool schedulerSetNodeMaxSlotInterval(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t maxSlotInterval);
+void schedulerSetAdaptiveLookAhead(tSchedulerState * scheduler, bool enabled);
+void schedulerSetPlanEnabled(tSchedulerState * scheduler, bool enabled);
+void schedulerSetMasterRxCredits(tSchedulerState * scheduler, uint8_t rxCredits);
+void schedulerRecordTx(tSchedulerState * scheduler, tNodeIndex dstNodeId);
+void schedulerRecordAck(tSchedulerState * scheduler, tNodeIndex srcNodeId);
+void schedulerSetMasterBurst(tSchedulerState * scheduler, tNodeIndex dstNodeId, uint8_t burstRemaining);
+bool schedulerReserveSlots(tSchedulerState * scheduler, tNodeIndex nodeId, uint8_t period, uint8_t phase);
+void schedulerSetRejoinNodes(tSchedulerState * scheduler, tNodeQueue * rejoinNodes);
 
 // If there are new nodes on the bus reset the gap between unallocated slots to minimum
 // to allocate all nodes as quickly as possible
@@ -9,6 +9,7 @@
 
 #include "microbus.h"
 #include "txManager.h"
+#include "networkManager.h"
 
 // =============================================================== //
 //                        Tx Manager
@@ -28,6 +29,10 @@
 // very efficient if there is a low rate of dropped packets. Plus it
 // ensures correct ordering at the rx.
 //
+// Each destination has a lane per priority class, each with its own
+// sequence numbers, window and queue. Ordering is only kept within a lane.
+// Everything below that works on a dstNodeId works the same on a lane.
+//
 // =============================================================== //
 
 //#define SLIDING_WINDOW_TIMEOUT_RX_PACKETS 3 // How many rx packets without an update to the startSeqNum before we go transmit from the start of the window
@@ -37,55 +42,220 @@
 
 // =============================================================== //
 // Packet store
-// It's a bit inefficient that we are constantly search to find new or matching packets
-// However given the packets are reasonably large we are unlikely to be able to store
-// many of them in a microcontroller so there shouldn't be that many to search
-
-static tPacketEntry * findPacketEntry(tPacketStore * store, tNodeIndex dstNodeId, uint8_t seqNum, bool isMaster) {
-    for (uint16_t packetIndex=0; packetIndex<store->maxEntries; packetIndex++) {
-        tPacketEntry * packetEntry = &store->entries[packetIndex];
-        bool dstNodeIdMatches = isMaster ? (packetEntry->packet.master.dstNodeId == dstNodeId) : true;
-        if (packetEntry->inUse
-            && dstNodeIdMatches
-            && packetEntry->packet.txSeqNum == seqNum) {
-            return packetEntry;
-        }
+// Every destination has its own queue of packet entries linked in sequence
+// number order. The head is the oldest unacknowledged packet (txSeqNumStart),
+// the tail the most recently submitted one. So rather than searching the whole
+// store we can always go straight to the packet we want:
+//  - the next packet to send is the one after txQueueLastSent (or the head)
+//  - acks always free from the head
+//
+// The submit (user thread) only writes the tail (and the head when the queue is
+// empty) and the acks (interrupt) only write the head, so the two can run at the
+// same time. Likewise the entries are only allocated by the user thread and only
+// freed by the interrupt (see packetStoreAllocate/packetStoreFree).
+
+#define PACKET_ENTRY(store, index) (&(store)->entries[(index)])
+
+// Add to the end of the destinations queue
+// NOTE: called by independent thread - must be done before txSeqNumEnd is incremented
+static void appendPacketEntry(tTxManager * manager, tNodeIndex dstNodeId, tPacketEntry * entry) {
+    tPacketStore * store = &manager->packetStore;
+    uint8_t index = entry - store->entries;
+    entry->nextIndex = NULL_PACKET_ENTRY_INDEX;
+
+    if (manager->txSeqNumStart[dstNodeId] != manager->txSeqNumEnd[dstNodeId]) {
+        // The old tail can't be re-allocated whilst we're here (only this thread allocates)
+        // so even if the acks free it now it's safe to link to
+        PACKET_ENTRY(store, manager->txQueueTail[dstNodeId])->nextIndex = index;
     }
-    microbusAssert(0, ""); // "Failed to find packet"
-    return NULL;
+    // Check again in case the acks emptied the queue before seeing the link
+    if (manager->txSeqNumStart[dstNodeId] == manager->txSeqNumEnd[dstNodeId]) {
+        // Empty - nothing else will touch the head until txSeqNumEnd is incremented
+        manager->txQueueHead[dstNodeId] = index;
+        manager->txQueueLastSent[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
+    }
+    manager->txQueueTail[dstNodeId] = index;
 }
 
-static tPacket * allocatePacketEntry(tPacketStore * store) {
-    tPacket * result = NULL;
-    for (uint16_t packetIndex=0; packetIndex<store->maxEntries; packetIndex++) {
-        if (!store->entries[packetIndex].inUse) {
-            store->entries[packetIndex].inUse = true;
-            store->numStored++;
-            result = &store->entries[packetIndex].packet;
-            break;
-        }
+// Remove the packet at the start of the destinations queue
+static void freeHeadPacket(tTxManager * manager, tNodeIndex dstNodeId, uint8_t seqNum) {
+    tPacketStore * store = &manager->packetStore;
+    uint8_t head = manager->txQueueHead[dstNodeId];
+    microbusAssert(head != NULL_PACKET_ENTRY_INDEX, ""); // "Failed to find packet"
+    tPacketEntry * entry = PACKET_ENTRY(store, head);
+    microbusAssert(entry->inUse && entry->packet.txSeqNum == seqNum, "");
+
+    if (manager->txQueueLastSent[dstNodeId] == head) {
+        manager->txQueueLastSent[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
     }
-    return result;
+    manager->txQueueHead[dstNodeId] = entry->nextIndex;
+    packetStoreFree(store, entry);
+    manager->txNumFreed[dstNodeId]++;
+    manager->totalTxFreed++;
 }
 
-static bool freePacket(tPacketStore * store, tNodeIndex dstNodeId, uint8_t seqNum, bool isMaster) {
-    tPacketEntry * entry = findPacketEntry(store, dstNodeId, seqNum, isMaster);
-    if (entry != NULL) {
-        store->numFreed++;
-        entry->inUse = false;
-        return true;
+// Free everything queued for this destination
+static uint8_t freeAllPackets(tTxManager * manager, tNodeIndex dstNodeId) {
+    uint8_t numFreed = 0;
+    while (manager->txSeqNumStart[dstNodeId] != manager->txSeqNumEnd[dstNodeId]) {
+        freeHeadPacket(manager, dstNodeId, manager->txSeqNumStart[dstNodeId]);
+        INCR_SEQUENCE_NUM(manager->txSeqNumStart[dstNodeId]);
+        numFreed++;
     }
-    return false;
+    manager->txSeqNumNext[dstNodeId] = manager->txSeqNumStart[dstNodeId];
+    manager->txQueueHead[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
+    manager->txQueueTail[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
+    manager->txQueueLastSent[dstNodeId] = NULL_PACKET_ENTRY_INDEX;
+    memset(&manager->txSelectiveRepeat[dstNodeId], 0, sizeof(tTxSelectiveRepeat));
+    return numFreed;
 }
 
+// =============================================================== //
+// Selective repeat
+// Rather than restarting the whole window the rx reports which packets
+// after the ack it already has (sackBitmap) and we only resend the gaps.
+// Everything here is relative to txSeqNumStart so is shifted down as the
+// start moves.
+
+#define SHIFT_DOWN_BITMAP(bitmap, num) (bitmap) = ((num) >= 8) ? 0 : ((bitmap) >> (num))
+
+static uint8_t sentBitmap(tTxManager * manager, tNodeIndex dstNodeId) {
+    uint8_t numSent = SEQUENCE_NUM_DISTANCE(manager->txSeqNumStart[dstNodeId], manager->txSeqNumNext[dstNodeId]);
+    return (numSent >= 8) ? 0xFF : ((1 << numSent) - 1);
+}
+
+// expectedSeqNum is the next packet the rx wants (i.e. 1 after its ack)
+static void rxSelectiveAck(tTxManager * manager, tNodeIndex srcNodeId, uint8_t expectedSeqNum, uint8_t sackBitmap) {
+    tTxSelectiveRepeat * sr = &manager->txSelectiveRepeat[srcNodeId];
+    if (sackBitmap == 0 || expectedSeqNum != manager->txSeqNumStart[srcNodeId]) {
+        return;
+    }
+    // The rx's bit 0 is for the packet after the one it's missing
+    sr->sacked |= (uint8_t)(sackBitmap << 1) & sentBitmap(manager, srcNodeId);
+    if (sr->sacked == 0) {
+        return;
+    }
+    // Packets are received in order so anything before the last selectively acked packet has been lost
+    uint8_t lastSacked = 31 - __builtin_clz(sr->sacked);
+    uint8_t lost = ((1 << lastSacked) - 1) & ~sr->sacked & ~sr->resent;
+    sr->resend |= lost;
+    sr->resent |= lost;
+}
+
+// The window has timed out - resend everything sent that hasn't been selectively acked
+static void restartSelectiveRepeat(tTxManager * manager, tNodeIndex dstNodeId) {
+    tTxSelectiveRepeat * sr = &manager->txSelectiveRepeat[dstNodeId];
+    sr->resend = sentBitmap(manager, dstNodeId) & ~sr->sacked;
+    sr->resent = sr->resend;
+}
+
+static tPacketEntry * getNextResendPacket(tTxManager * manager, tNodeIndex dstNodeId) {
+    tTxSelectiveRepeat * sr = &manager->txSelectiveRepeat[dstNodeId];
+    uint8_t resend = sr->resend & ~sr->sacked;
+    if (resend == 0) {
+        sr->resend = 0;
+        return NULL;
+    }
+    uint8_t offset = __builtin_ctz(resend);
+    sr->resend = resend & ~(1 << offset);
+
+    // Walk along the queue from the start of the window
+    uint8_t index = manager->txQueueHead[dstNodeId];
+    for (uint8_t i=0; i<offset && index != NULL_PACKET_ENTRY_INDEX; i++) {
+        index = PACKET_ENTRY(&manager->packetStore, index)->nextIndex;
+    }
+    if (index == NULL_PACKET_ENTRY_INDEX) {
+        microbusAssert(0, ""); // "Failed to find packet to resend"
+        return NULL;
+    }
+    tPacketEntry * packetEntry = PACKET_ENTRY(&manager->packetStore, index);
+    uint8_t seqNum = INCR_AND_WRAP(manager->txSeqNumStart[dstNodeId], offset, MAX_SEQUENCE_NUM);
+    microbusAssert(packetEntry->inUse && packetEntry->packet.txSeqNum == seqNum, "");
+    manager->numSelectiveResends++;
+    MB_TX_MANAGER_PRINTF("-> %u: selectively resending seqNum:%u\n", dstNodeId, seqNum);
+    return packetEntry;
+}
+
+// Submitted but not yet acked (or dropped) for all destinations
 uint8_t getNumAllBufferedTxPackets(tTxManager * manager) {
-    uint8_t count = 0;
-    for (uint16_t packetIndex=0; packetIndex<manager->packetStore.maxEntries; packetIndex++) {
-        if (manager->packetStore.entries[packetIndex].inUse) {
-            count++;
+    return manager->totalTxSubmitted - manager->totalTxFreed;
+}
+
+// =============================================================== //
+// Message aggregation - called by the user thread
+//
+// Small messages are packed into the allocated packet, each with a length
+// in front, until it is full. The packet is then submitted as normal.
+
+// True if the open packet needs submitting before this message can go in
+bool txMessageNeedsNewPacket(tTxManager * manager, tNodeIndex dstNodeId, uint8_t numBytes) {
+    tTxMessagePacket * msgPacket = &manager->txMessagePacket;
+    if (!msgPacket->open) {
+        return false;
+    }
+    return (msgPacket->dstNodeId != dstNodeId) || (msgPacket->size + MESSAGE_HEADER_SIZE + numBytes > MAX_MESSAGE_PACKET_SIZE);
+}
+
+// Returns false if a packet couldn't be allocated
+bool txMessageAppend(tTxManager * manager, bool isMaster, tNodeIndex srcNodeId, tNodeIndex dstNodeId, const uint8_t * data, uint8_t numBytes) {
+    microbusAssert(numBytes > 0 && numBytes <= MAX_MESSAGE_SIZE, "");
+    microbusAssert(!txMessageNeedsNewPacket(manager, dstNodeId, numBytes), "");
+    tTxMessagePacket * msgPacket = &manager->txMessagePacket;
+    if (!msgPacket->open) {
+        if (allocateTxPacket(manager, srcNodeId) == NULL) {
+            return false;
         }
+        msgPacket->open = true;
+        msgPacket->dstNodeId = dstNodeId;
+        msgPacket->size = 0;
+    }
+    tPacket * packet = manager->allocatedPacket;
+    uint8_t * packetData = isMaster ? packet->master.data : packet->node.data;
+    packetData[msgPacket->size] = numBytes;
+    memcpy(&packetData[msgPacket->size + MESSAGE_HEADER_SIZE], data, numBytes);
+    msgPacket->size += MESSAGE_HEADER_SIZE + numBytes;
+    return true;
+}
+
+// Stop adding to the open packet - returns its size (0 if nothing open)
+// The caller must then submit the allocated packet
+uint16_t txMessageClosePacket(tTxManager * manager, tNodeIndex * dstNodeId) {
+    tTxMessagePacket * msgPacket = &manager->txMessagePacket;
+    if (!msgPacket->open) {
+        return 0;
+    }
+    msgPacket->open = false;
+    *dstNodeId = msgPacket->dstNodeId;
+    return msgPacket->size;
+}
+
+// =============================================================== //
+// Large messages - called by the user thread
+//
+// A message too big for one packet is split over consecutive packets to the
+// same destination. As the packets are delivered in order the rx only needs
+// to join them back together.
+
+// How many packets could be allocated right now
+uint8_t getNumFreeTxPackets(tTxManager * manager) {
+    return packetStoreNumFree(&manager->packetStore) + (manager->unsubmittedEntry != NULL ? 1 : 0);
+}
+
+// Fill in the fragment of the message starting at offset - returns the packet data size
+uint16_t txFragmentWrite(uint8_t * packetData, const uint8_t * data, uint16_t numBytes, uint16_t offset) {
+    microbusAssert(offset < numBytes, "");
+    uint16_t fragmentSize = MIN(numBytes - offset, MAX_FRAGMENT_DATA_SIZE);
+    uint8_t flags = 0;
+    if (offset == 0) {
+        flags |= FRAGMENT_FIRST;
     }
-    return count;
+    if (offset + fragmentSize == numBytes) {
+        flags |= FRAGMENT_LAST;
+    }
+    packetData[0] = flags;
+    memcpy(&packetData[1], &numBytes, 2);
+    memcpy(&packetData[FRAGMENT_HEADER_SIZE], &data[offset], fragmentSize);
+    return FRAGMENT_HEADER_SIZE + fragmentSize;
 }
 
 // =============================================================== //
@@ -93,72 +263,81 @@ uint8_t getNumAllBufferedTxPackets(tTxManager * manager) {
 
 // NOTE: called by independent thread
 tPacket * allocateTxPacket(tTxManager * manager, uint8_t nodeId) {
-    tPacket * packet = allocatePacketEntry(&manager->packetStore);
-    if (packet == NULL) {
-        // MB_TX_MANAGER_PRINTF("%s:%u Tx buffer full\n", nodeId == MASTER_NODE_ID ? "Master" : "Node", nodeId);
-        return NULL;
-    }
     if (manager->allocatedPacket != NULL) {
         microbusAssert(0, ""); // "Allocated packet must be submitted before the next allocation"
         return NULL;
     }
-    if (manager->activeTxNodes) {
-        if (manager->activeTxNodes->numNodes >= MAX_NODES) {
-            // MB_TX_MANAGER_PRINTF("%s:%u Tx activeTxQueue is full\n", nodeId == MASTER_NODE_ID ? "Master" : "Node", nodeId);
-            return NULL;
-        }
+    // Re-use a packet that was allocated but never submitted
+    tPacketEntry * entry = manager->unsubmittedEntry;
+    manager->unsubmittedEntry = NULL;
+    if (entry == NULL) {
+        entry = packetStoreAllocate(&manager->packetStore);
     }
-    manager->allocatedPacket = packet;
-    return packet;
+    if (entry == NULL) {
+        // MB_TX_MANAGER_PRINTF("%s:%u Tx buffer full\n", nodeId == MASTER_NODE_ID ? "Master" : "Node", nodeId);
+        return NULL;
+    }
+    manager->allocatedPacket = &entry->packet;
+    return manager->allocatedPacket;
 }
 
 // NOTE: called by independent thread (lower priority thread)
 void submitAllocatedTxPacket(tTxManager * manager, bool isMaster, uint8_t * masterDstNodeTTL, tNodeIndex srcNodeId, tNodeIndex dstNodeId, tPacketType packetType, uint16_t dataSize) {
     if (isMaster) {
         if (*masterDstNodeTTL <= 0) {
+            // Only the interrupt frees packets so hold on to it for the next allocation
+            manager->unsubmittedEntry = PACKET_ENTRY_FROM_PACKET(manager->allocatedPacket);
             manager->allocatedPacket = NULL;
             return;
         }
     }
     microbusAssert(srcNodeId < MAX_NODES && dstNodeId < MAX_NODES, "");
     tPacket * packet = manager->allocatedPacket;
+    uint8_t lane = TX_LANE(manager, dstNodeId, PACKET_TX_PRIORITY(packetType));
     SET_PROTOCOL_VERSION_AND_PACKET_TYPE(packet, packetType);
     SET_PACKET_DATA_SIZE(packet, dataSize);
     if (isMaster) {
         packet->master.dstNodeId = dstNodeId;
     } else {
     	microbusAssert(dstNodeId == 0, "");
-        microbusAssert(packetType != MASTER_DATA_PACKET, "");
+        microbusAssert(!IS_MASTER_DATA_PACKET(packetType), "");
         packet->node.srcNodeId = srcNodeId;
     }
-    packet->txSeqNum = manager->txSeqNumEnd[dstNodeId];
+    packet->txSeqNum = manager->txSeqNumEnd[lane];
+    appendPacketEntry(manager, lane, PACKET_ENTRY_FROM_PACKET(packet));
+    // Count it before it's visible to the acks so the count never goes negative
+    manager->txNumSubmitted[lane]++;
+    manager->totalTxSubmitted++;
 
-    // Update to txSeqNumEnd must be atomic - for different threads
-    INCR_SEQUENCE_NUM(manager->txSeqNumEnd[dstNodeId]);
+    // Update to txSeqNumEnd must be atomic - for different threads. The interrupt can ack the packet
+    // as soon as it's visible and removes the node once the buffer is empty, so the adds go in with it
+    uint32_t state = microbusEnterCritical();
+    INCR_SEQUENCE_NUM(manager->txSeqNumEnd[lane]);
 
     if (isMaster) {
         // If buffer was empty then add this node to the record of active nodes
-        if (packet->txSeqNum == manager->txSeqNumStart[dstNodeId]) {
-            if (nodeQueueAdd(manager->activeTxNodes, dstNodeId) == false) {
-                microbusAssert(0, ""); // Should be caught by allocate
+        if (packet->txSeqNum == manager->txSeqNumStart[lane]) {
+            nodeQueueAdd(manager->activeTxNodes, dstNodeId);
+            if (lane != dstNodeId) {
+                nodeQueueAdd(&manager->urgentTxNodes, dstNodeId);
             }
             MB_TX_MANAGER_PRINTF("%s %u->%u adding to activeTxQueue (num:%u), seqNum:%u\n", isMaster ? "Master" : "Node", srcNodeId, dstNodeId, manager->activeTxNodes->numNodes, packet->txSeqNum);
         }
     }
+    microbusExitCritical(state);
 
     // Keep a record of how full the buffer gets
-    uint8_t txBufferLevel = manager->txSeqNumEnd[dstNodeId] - manager->txSeqNumStart[dstNodeId];
+    uint8_t txBufferLevel = getNumInTxBuffer(manager, lane);
     manager->txBufferLevel = txBufferLevel;
     manager->maxTxBufferLevel = MAX(manager->maxTxBufferLevel, txBufferLevel);
 
     manager->allocatedPacket = NULL;
 
     // This function could be interrupted at any point by a thread that could remove the node
-    // If that has happened check now and remove it too
+    // If that has happened then get the interrupt to remove it again (we can't free packets here)
     if (isMaster) {
         if (*masterDstNodeTTL == 0) {
-            uint8_t unusedNumTxPacketsFreed;
-            masterTxManagerRemoveNode(manager, dstNodeId, &unusedNumTxPacketsFreed);
+            *masterDstNodeTTL = REMOVE_NODE_TTL;
         }
     }
 
@@ -171,12 +350,20 @@ inline static tPacketEntry * getNextTxPacketForNode(tTxManager * manager, bool i
     uint8_t * next       = &manager->txSeqNumNext[dstNodeId];
     uint8_t * pauseCount = &manager->txSeqNumPauseCount[dstNodeId];
 
-    if (*pauseCount > 0) {
+    // Should only be called if we know it's active
+    if (start == end) {
         return NULL;
     }
 
-    // Should only be called if we know it's active
-    if (start == end) {
+    // Fill in any gaps first - even if the window is paused
+    if (MICROBUS_SELECTIVE_REPEAT) {
+        tPacketEntry * resendEntry = getNextResendPacket(manager, dstNodeId);
+        if (resendEntry) {
+            return resendEntry;
+        }
+    }
+
+    if (*pauseCount > 0) {
         return NULL;
     }
 
@@ -186,7 +373,7 @@ inline static tPacketEntry * getNextTxPacketForNode(tTxManager * manager, bool i
         microbusAssert(*next >= start || *next <= end, "");
     }
     
-    uint8_t windowEnd = start + SLIDING_WINDOW_SIZE;
+    uint8_t windowEnd = INCR_AND_WRAP(start, manager->txWindowSize[dstNodeId], MAX_SEQUENCE_NUM);
     if ((*next == end) || (*next == windowEnd)) {
         // if (*pauseCount == SLIDING_WINDOW_PAUSE) {
         //     MB_TX_MANAGER_PRINTF("%s -> %u: Reached end of window, restarting window\n", isMaster ? "Master" : "Node", dstNodeId);
@@ -199,22 +386,36 @@ inline static tPacketEntry * getNextTxPacketForNode(tTxManager * manager, bool i
         // }
     }
     
-    tPacketEntry * packetEntry = findPacketEntry(&manager->packetStore, dstNodeId, *next, isMaster);
-    if (packetEntry == NULL) {
+    // The next packet follows the last one sent (or it's the start of the window)
+    uint8_t lastSent = manager->txQueueLastSent[dstNodeId];
+    uint8_t index = (lastSent == NULL_PACKET_ENTRY_INDEX) ? manager->txQueueHead[dstNodeId] : PACKET_ENTRY(&manager->packetStore, lastSent)->nextIndex;
+    if (index == NULL_PACKET_ENTRY_INDEX) {
         microbusAssert(0, ""); // "Failed to find matching packet!"
         return NULL;
     }
+    tPacketEntry * packetEntry = PACKET_ENTRY(&manager->packetStore, index);
+    microbusAssert(packetEntry->inUse && packetEntry->packet.txSeqNum == *next, "");
+    manager->txQueueLastSent[dstNodeId] = index;
     INCR_SEQUENCE_NUM((*next));
     return packetEntry;
 }
 
-tPacket * nodeGetNextTxDataPacket(tTxManager * manager) {
-    if (manager->txSeqNumStart[MASTER_NODE_ID] == manager->txSeqNumEnd[MASTER_NODE_ID]) {
-        // Empty
-        return NULL;
+// True if nothing is buffered for the node in any priority class
+static bool allLanesEmpty(tTxManager * manager, tNodeIndex nodeId) {
+    for (uint8_t priority=0; priority<NUM_TX_PRIORITIES; priority++) {
+        if (!IS_TX_BUFFER_EMPTY(manager, TX_LANE(manager, nodeId, priority))) {
+            return false;
+        }
     }
+    return true;
+}
 
-    tPacketEntry * packetEntry = getNextTxPacketForNode(manager, false, MASTER_NODE_ID);
+tPacket * nodeGetNextTxDataPacket(tTxManager * manager) {
+    // Urgent first
+    tPacketEntry * packetEntry = getNextTxPacketForNode(manager, false, TX_LANE(manager, MASTER_NODE_ID, TX_PRIORITY_URGENT));
+    if (packetEntry == NULL) {
+        packetEntry = getNextTxPacketForNode(manager, false, MASTER_NODE_ID);
+    }
     // Fill in any acks we need to send
     if (packetEntry) {
         packetEntry->packet.node.ackSeqNum = manager->rxSeqNum[MASTER_NODE_ID];
@@ -223,6 +424,33 @@ tPacket * nodeGetNextTxDataPacket(tTxManager * manager) {
     return packetEntry ? &packetEntry->packet : NULL;
 }
 
+// Flow control - a node with no room left is skipped until it reports some more
+static bool hasTxCredit(tTxManager * manager, tNodeIndex dstNodeId, uint8_t lane) {
+    if (manager->txCredits == NULL || manager->txCredits[dstNodeId] > 0) {
+        return true;
+    }
+    if (getNumTxPacketsSendable(manager, lane) > 0) {
+        manager->numCreditStalls++;
+    }
+    return false;
+}
+
+// Round robin over the nodes with urgent packets - these go before anything else, even a burst
+static tPacketEntry * masterGetNextUrgentTxPacket(tTxManager * manager) {
+    uint8_t numNodes = manager->urgentTxNodes.numNodes;
+    for (uint8_t i=0; i<numNodes; i++) {
+        tNodeIndex dstNodeId = getNextNodeInQueue(&manager->urgentTxNodes);
+        if (!hasTxCredit(manager, dstNodeId, TX_LANE(manager, dstNodeId, TX_PRIORITY_URGENT))) {
+            continue;
+        }
+        tPacketEntry * packetEntry = getNextTxPacketForNode(manager, true, TX_LANE(manager, dstNodeId, TX_PRIORITY_URGENT));
+        if (packetEntry) {
+            return packetEntry;
+        }
+    }
+    return NULL;
+}
+
 tPacket * masterGetNextTxDataPacket(tTxManager * manager, uint8_t numTxNodesScheduled, uint8_t nextTxNodeId[MAX_TX_NODES_SCHEDULED], uint8_t burstSize) {
     tNodeQueue * activeTxNodes = manager->activeTxNodes;
     // Find next node to transmit to - by start with the last node that transmitted
@@ -233,17 +461,20 @@ tPacket * masterGetNextTxDataPacket(tTxManager * manager, uint8_t numTxNodesSche
         return NULL;
     }
 
-    uint32_t lastQueueIndex = manager->lastTxQueueIndex;
-    if (lastQueueIndex >= activeTxNodes->numNodes) {
-    	lastQueueIndex = activeTxNodes->numNodes - 1;
+    if (manager->urgentTxNodes.numNodes > 0) {
+        packetEntry = masterGetNextUrgentTxPacket(manager);
+        if (packetEntry) {
+            return &packetEntry->packet;
+        }
     }
 
+    tNodeIndex lastTxNodeId = manager->lastTxNodeId;
+
     // On single channel, to avoid half the packets having to be acks we try and 
     // send bursts of packets to a single dst
     if (burstSize > 1) {
-        if (manager->lastTxQueueCount < burstSize) {
-            tNodeIndex dstNodeId = activeTxNodes->nodeIds[lastQueueIndex];
-            packetEntry = getNextTxPacketForNode(manager, true, dstNodeId);
+        if (manager->lastTxQueueCount < burstSize && nodeQueueContains(activeTxNodes, lastTxNodeId) && hasTxCredit(manager, lastTxNodeId, lastTxNodeId)) {
+            packetEntry = getNextTxPacketForNode(manager, true, lastTxNodeId);
             if (packetEntry) {
                 manager->lastTxQueueCount++;
                 return &packetEntry->packet;
@@ -252,19 +483,24 @@ tPacket * masterGetNextTxDataPacket(tTxManager * manager, uint8_t numTxNodesSche
     }
 
     MB_TX_MANAGER_PRINTF("Master, getNextTxPacket checking nodes:");
-    uint32_t i = lastQueueIndex;
-    do {
-        i++;
-        if (i >= activeTxNodes->numNodes) {
-            i = 0;
+    // Go round every node once - starting after the last node that transmitted
+    tNodeIndex dstNodeId = lastTxNodeId;
+    uint8_t numNodes = activeTxNodes->numNodes;
+    for (uint8_t i=0; i<numNodes && packetEntry == NULL; i++) {
+        dstNodeId = nodeQueueNextAfter(activeTxNodes, dstNodeId);
+        if (dstNodeId == INVALID_NODE_ID) {
+            break;
         }
-        tNodeIndex dstNodeId = activeTxNodes->nodeIds[i];
         if (MICROBUS_LOG_TX_MANGER > 0) { MB_PRINTF_WITHOUT_NEW_LINE("%u, ", dstNodeId) }
-        packetEntry = getNextTxPacketForNode(manager, true, dstNodeId);
-    } while (i != lastQueueIndex && packetEntry == NULL);
+        if (hasTxCredit(manager, dstNodeId, dstNodeId)) {
+            packetEntry = getNextTxPacketForNode(manager, true, dstNodeId);
+        }
+    }
     if (MICROBUS_LOG_TX_MANGER > 0) { MB_PRINTF_WITHOUT_NEW_LINE("\n") }
 
-    manager->lastTxQueueIndex = i;
+    if (dstNodeId != INVALID_NODE_ID) {
+        manager->lastTxNodeId = dstNodeId;
+    }
 
     if (packetEntry) {
         manager->lastTxQueueCount = 1;
@@ -275,8 +511,17 @@ tPacket * masterGetNextTxDataPacket(tTxManager * manager, uint8_t numTxNodesSche
 
 // Return num tx packet freed
 uint8_t rxAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNum, bool isMaster, uint64_t * statsNumTxWindowRestarts) {
+    return rxSelectiveAckSeqNum(manager, srcNodeId, ackSeqNum, 0, isMaster, statsNumTxWindowRestarts);
+}
+
+// Return num tx packet freed
+uint8_t rxSelectiveAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNum, uint8_t sackBitmap, bool isMaster, uint64_t * statsNumTxWindowRestarts) {
     // If invalid - just means we haven't started sending data yet
+    // (or the rx hasn't got the first packet - but may have some after it)
     if (ackSeqNum == INVALID_SEQUENCE_NUM) {
+        if (MICROBUS_SELECTIVE_REPEAT) {
+            rxSelectiveAck(manager, srcNodeId, 0, sackBitmap);
+        }
         return 0;
     }
 
@@ -302,12 +547,12 @@ uint8_t rxAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNu
 
         for (uint8_t seqNum = *start; seqNum != newStart; ) {
             // Free packets
-            bool valid = freePacket(&manager->packetStore, srcNodeId, seqNum, isMaster);
-            microbusAssert(valid, "");
+            freeHeadPacket(manager, srcNodeId, seqNum);
             packetsFreed++;
             // Update the next if it happened to have restarted before the ack
             if (seqNum == *next) {
                 *next = newStart;
+                manager->txQueueLastSent[srcNodeId] = NULL_PACKET_ENTRY_INDEX;
             }
             INCR_SEQUENCE_NUM(seqNum)
         }
@@ -315,12 +560,21 @@ uint8_t rxAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNu
         *start = newStart;
         // Reset the pause count
         *pauseCount = 0;
+        tTxSelectiveRepeat * sr = &manager->txSelectiveRepeat[srcNodeId];
+        SHIFT_DOWN_BITMAP(sr->sacked, packetsFreed);
+        SHIFT_DOWN_BITMAP(sr->resend, packetsFreed);
+        SHIFT_DOWN_BITMAP(sr->resent, packetsFreed);
 
         // If the buffer is now empty remove this node from the record of active nodes
         if ((*start == *end) && isMaster) {
-            nodeQueueRemove(manager->activeTxNodes, srcNodeId);
-            microbusAssert(manager->txSeqNumStart[srcNodeId] == manager->txSeqNumEnd[srcNodeId], "");
-            MB_TX_MANAGER_PRINTF("%s: srcNode:%u remove from activeTxQueue (num left:%u)\n", isMaster ? "Master" : "Node", srcNodeId, manager->activeTxNodes->numNodes);
+            tNodeIndex nodeId = srcNodeId % manager->maxTxNodes;
+            if (nodeId != srcNodeId) {
+                nodeQueueRemoveIfExists(&manager->urgentTxNodes, nodeId);
+            }
+            if (allLanesEmpty(manager, nodeId)) {
+                nodeQueueRemove(manager->activeTxNodes, nodeId);
+                MB_TX_MANAGER_PRINTF("%s: srcNode:%u remove from activeTxQueue (num left:%u)\n", isMaster ? "Master" : "Node", nodeId, manager->activeTxNodes->numNodes);
+            }
         }
     } else {
         MB_TX_MANAGER_PRINTF("%s - src:%u, invalid ack seqnum, start:%u, end:%u, got:%u\n", isMaster ? "Master" : "Node", srcNodeId, *start, *end, ackSeqNum);
@@ -331,10 +585,21 @@ uint8_t rxAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNu
                 // This shouldn't really happen unless packets have been dropped, right? - TODO
                 MB_TX_MANAGER_PRINTF("%s -> %u: Restarting window\n", isMaster ? "Master" : "Node", srcNodeId);
                 (*statsNumTxWindowRestarts)++;
-                *next = *start;
+                if (MICROBUS_SELECTIVE_REPEAT) {
+                    restartSelectiveRepeat(manager, srcNodeId);
+                } else {
+                    *next = *start;
+                    manager->txQueueLastSent[srcNodeId] = NULL_PACKET_ENTRY_INDEX;
+                }
             }
         }
     }
+
+    if (MICROBUS_SELECTIVE_REPEAT) {
+        uint8_t expectedSeqNum = ackSeqNum;
+        INCR_SEQUENCE_NUM(expectedSeqNum);
+        rxSelectiveAck(manager, srcNodeId, expectedSeqNum, sackBitmap);
+    }
     return packetsFreed;
 }
 
@@ -356,35 +621,111 @@ bool rxPacketCheckAndUpdateSeqNum(tTxManager * manager, tNodeIndex srcNodeId, ui
     return false;
 }
 
+// How far the packet is after the next expected sequence number (0 if it's the one expected)
+uint8_t rxPacketSeqNumOffset(tTxManager * manager, tNodeIndex srcNodeId, uint8_t packetTxSeqNum) {
+    uint8_t expectedSeqNum = manager->rxSeqNum[srcNodeId];
+    if (expectedSeqNum == NULL_SEQUENCE_NUM) {
+        expectedSeqNum = 0;
+    } else {
+        INCR_SEQUENCE_NUM(expectedSeqNum)
+    }
+    return SEQUENCE_NUM_DISTANCE(expectedSeqNum, packetTxSeqNum);
+}
+
+// Move the rx sequence number on past packets that were received out of order
+void rxAdvanceSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t numPackets) {
+    for (uint8_t i=0; i<numPackets; i++) {
+        INCR_SEQUENCE_NUM(manager->rxSeqNum[srcNodeId]);
+    }
+}
+
+// How many new packets could go out to the node now - those not sent yet and still inside the window
+uint8_t getNumTxPacketsSendable(tTxManager * manager, uint8_t dstNodeId) {
+    uint8_t start = manager->txSeqNumStart[dstNodeId];
+    uint8_t next = manager->txSeqNumNext[dstNodeId];
+    uint8_t notSent = CIRCULAR_BUFFER_LENGTH(next, manager->txSeqNumEnd[dstNodeId], MAX_SEQUENCE_NUM);
+    uint8_t sent = CIRCULAR_BUFFER_LENGTH(start, next, MAX_SEQUENCE_NUM);
+    uint8_t windowLeft = (sent < manager->txWindowSize[dstNodeId]) ? manager->txWindowSize[dstNodeId] - sent : 0;
+    return MIN(notSent, windowLeft);
+}
+
+// Buffered but not sent yet (ignoring the window)
+uint8_t getNumTxPacketsNotSent(tTxManager * manager, uint8_t dstNodeId) {
+    return CIRCULAR_BUFFER_LENGTH(manager->txSeqNumNext[dstNodeId], manager->txSeqNumEnd[dstNodeId], MAX_SEQUENCE_NUM);
+}
+
 uint8_t getNumInTxBuffer(tTxManager * manager, uint8_t dstNodeId) {
-    return (manager->txSeqNumEnd[dstNodeId] - manager->txSeqNumStart[dstNodeId]);
+    return (uint8_t)(manager->txNumSubmitted[dstNodeId] - manager->txNumFreed[dstNodeId]);
+}
+
+// ==================================================================== //
+// Flow control - every node packet says how many more packets the node has room for.
+// Each packet sent to it uses one up, so nothing goes out that the node would have to drop
+
+// Called with NULL to turn it off. Until a node reports its credits it's only sent one packet
+void txManagerSetCredits(tTxManager * manager, uint8_t txCredits[]) {
+    if (txCredits) {
+        memset(txCredits, 1, manager->maxTxNodes);
+    }
+    memset(manager->creditTxNodeId, INVALID_NODE_ID, sizeof(manager->creditTxNodeId));
+    manager->txCredits = txCredits;
 }
 
+// The node worked its credits out before the packets still on their way to it arrived
+void txManagerUpdateCredits(tTxManager * manager, tNodeIndex nodeId, uint8_t rxCredits) {
+    if (manager->txCredits == NULL || nodeId >= manager->maxTxNodes) {
+        return;
+    }
+    for (uint8_t i=0; i<CREDIT_PIPELINE_PACKETS; i++) {
+        if (manager->creditTxNodeId[i] == nodeId && rxCredits > 0) {
+            rxCredits--;
+        }
+    }
+    manager->txCredits[nodeId] = rxCredits;
+}
+
+// Called with every packet that goes out - dstNodeId is INVALID_NODE_ID unless it will be stored by the node
+void txManagerRecordCreditTx(tTxManager * manager, tNodeIndex dstNodeId) {
+    if (manager->txCredits == NULL) {
+        return;
+    }
+    for (uint8_t i=CREDIT_PIPELINE_PACKETS-1; i>0; i--) {
+        manager->creditTxNodeId[i] = manager->creditTxNodeId[i-1];
+    }
+    manager->creditTxNodeId[0] = dstNodeId;
+    if (dstNodeId < manager->maxTxNodes && manager->txCredits[dstNodeId] > 0) {
+        manager->txCredits[dstNodeId]--;
+    }
+}
+
+// Drop everything waiting to go out
 void masterTxClearBuffers(tTxManager * manager) {
-    for (uint16_t packetIndex=0; packetIndex < manager->packetStore.maxEntries; packetIndex++) {
-        tPacketEntry * packetEntry = &manager->packetStore.entries[packetIndex];
-        if (packetEntry->inUse) {
-            packetEntry->inUse = false;
-            manager->packetStore.numFreed++;
+    for (uint16_t lane=0; lane < manager->maxTxNodes * NUM_TX_PRIORITIES; lane++) {
+        if (!IS_TX_BUFFER_EMPTY(manager, lane)) {
+            freeAllPackets(manager, lane);
+            manager->txSeqNumPauseCount[lane] = 0;
+            nodeQueueRemoveIfExists(manager->activeTxNodes, lane % manager->maxTxNodes);
+            nodeQueueRemoveIfExists(&manager->urgentTxNodes, lane % manager->maxTxNodes);
         }
     }
 }
 
 void masterTxManagerRemoveNode(tTxManager * manager, tNodeIndex nodeId, uint8_t * numTxPacketsFreed) {
+    if (manager->txCredits) {
+        manager->txCredits[nodeId] = 1;
+    }
     nodeQueueRemoveIfExists(manager->activeTxNodes, nodeId);
-    for (uint16_t packetIndex=0; packetIndex < manager->packetStore.maxEntries; packetIndex++) {
-        tPacketEntry * packetEntry = &manager->packetStore.entries[packetIndex];
-        if (packetEntry->packet.master.dstNodeId == nodeId && packetEntry->inUse) {
-            packetEntry->inUse = false;
-            manager->packetStore.numFreed++;
-            (*numTxPacketsFreed)++;
-        }
+    nodeQueueRemoveIfExists(&manager->urgentTxNodes, nodeId);
+    for (uint8_t priority=0; priority<NUM_TX_PRIORITIES; priority++) {
+        uint8_t lane = TX_LANE(manager, nodeId, priority);
+        (*numTxPacketsFreed) += freeAllPackets(manager, lane);
+        manager->txSeqNumStart[lane] = 0;
+        manager->txSeqNumEnd[lane] = 0;
+        manager->txSeqNumNext[lane] = 0;
+        manager->txSeqNumPauseCount[lane] = 0;
+        manager->rxSeqNum[lane] = NULL_SEQUENCE_NUM;
+        manager->txWindowSize[lane] = (priority == TX_PRIORITY_URGENT) ? URGENT_WINDOW_SIZE : SLIDING_WINDOW_SIZE;
     }
-    manager->txSeqNumStart[nodeId] = 0;
-    manager->txSeqNumEnd[nodeId] = 0;
-    manager->txSeqNumNext[nodeId] = 0;
-    manager->txSeqNumPauseCount[nodeId] = 0;
-    manager->rxSeqNum[nodeId] = NULL_SEQUENCE_NUM;
 }
 
 void initTxManager(
@@ -395,17 +736,31 @@ void initTxManager(
         uint8_t txSeqNumNext[],
         uint8_t txSeqNumPauseCount[],
         uint8_t rxSeqNum[],
+        uint8_t txQueueHead[],
+        uint8_t txQueueTail[],
+        uint8_t txQueueLastSent[],
+        uint8_t txNumSubmitted[],
+        uint8_t txNumFreed[],
+        tTxSelectiveRepeat txSelectiveRepeat[],
+        uint8_t txWindowSize[],
         tNodeQueue * activeTxNodes,
         uint8_t maxPacketEntries,
         tPacketEntry packetEntries[]
     ) {
     // Zero all passed in memory
-    for (uint8_t nodeId=0; nodeId<maxTxNodes; nodeId++) {
-        txSeqNumStart[nodeId] = 0;
-        txSeqNumEnd[nodeId] = 0;
-        txSeqNumNext[nodeId] = 0;
-        txSeqNumPauseCount[nodeId] = 0;
-        rxSeqNum[nodeId] = NULL_SEQUENCE_NUM;
+    for (uint16_t lane=0; lane<maxTxNodes * NUM_TX_PRIORITIES; lane++) {
+        txSeqNumStart[lane] = 0;
+        txSeqNumEnd[lane] = 0;
+        txSeqNumNext[lane] = 0;
+        txSeqNumPauseCount[lane] = 0;
+        rxSeqNum[lane] = NULL_SEQUENCE_NUM;
+        txQueueHead[lane] = NULL_PACKET_ENTRY_INDEX;
+        txQueueTail[lane] = NULL_PACKET_ENTRY_INDEX;
+        txQueueLastSent[lane] = NULL_PACKET_ENTRY_INDEX;
+        txNumSubmitted[lane] = 0;
+        txNumFreed[lane] = 0;
+        memset(&txSelectiveRepeat[lane], 0, sizeof(tTxSelectiveRepeat));
+        txWindowSize[lane] = (lane < maxTxNodes) ? SLIDING_WINDOW_SIZE : URGENT_WINDOW_SIZE;
     }
     memset(manager, 0, sizeof(tTxManager));
 
@@ -415,11 +770,14 @@ void initTxManager(
     manager->txSeqNumNext = txSeqNumNext;
     manager->txSeqNumPauseCount = txSeqNumPauseCount;
     manager->rxSeqNum = rxSeqNum;
-    manager->packetStore.maxEntries = maxPacketEntries;
-    manager->packetStore.entries = packetEntries;
+    manager->txQueueHead = txQueueHead;
+    manager->txQueueTail = txQueueTail;
+    manager->txQueueLastSent = txQueueLastSent;
+    manager->txNumSubmitted = txNumSubmitted;
+    manager->txNumFreed = txNumFreed;
+    manager->txSelectiveRepeat = txSelectiveRepeat;
+    manager->txWindowSize = txWindowSize;
+    packetStoreInit(&manager->packetStore, maxPacketEntries, packetEntries);
     manager->activeTxNodes = activeTxNodes;
-
-    for (uint8_t i=0; i<maxPacketEntries; i++) {
-        manager->packetStore.entries[i].inUse = false;
-    }
+    nodeQueueInit(&manager->urgentTxNodes);
 }
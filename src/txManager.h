@@ -9,30 +9,62 @@
 #include "stdint.h"
 #include "microbus.h"
 
+#define CREDIT_PIPELINE_PACKETS 2 // Master packets that can still be on their way to a node when its packet is processed
+
+// Selective repeat state for a destination - bit i is for txSeqNumStart+i
+typedef struct {
+    uint8_t sacked; // Selectively acked by the rx
+    uint8_t resend; // Waiting to be resent
+    uint8_t resent; // Already resent since the rx reported it missing (so don't resend again for every ack)
+} tTxSelectiveRepeat;
+
+// The allocated packet that messages are being added to
 typedef struct {
-    tPacketEntry * entries;
-    uint8_t maxEntries;
-    uint32_t numStored;
-    uint32_t numFreed;
-} tPacketStore;
+    bool open;
+    tNodeIndex dstNodeId;
+    uint16_t size;
+} tTxMessagePacket;
 
+// The per destination arrays are indexed by lane - maxTxNodes * NUM_TX_PRIORITIES entries.
+// The normal lane is the node id so only the urgent lane needs TX_LANE
 typedef struct {
     tPacket * allocatedPacket;
+    tTxMessagePacket txMessagePacket; // Only used by the user thread
+    tPacketEntry * unsubmittedEntry; // Allocated but dropped by the submit - re-used by the next allocate
     tPacketStore packetStore;
     uint8_t * txSeqNumStart;
     uint8_t * txSeqNumEnd;
     uint8_t * txSeqNumNext;
     uint8_t * txSeqNumPauseCount;
     uint8_t * rxSeqNum;
+    // Per destination queue of packet entries in sequence number order (txSeqNumStart -> txSeqNumEnd)
+    uint8_t * txQueueHead;     // Entry for txSeqNumStart - only moved by the acks
+    uint8_t * txQueueTail;     // Last submitted entry - only moved by the submit
+    uint8_t * txQueueLastSent; // Entry before txSeqNumNext (or NULL_PACKET_ENTRY_INDEX if next is the head)
+    // Per destination count of buffered packets is txNumSubmitted - txNumFreed (mod 256)
+    // Kept as 2 counters so each only has one writer
+    uint8_t * txNumSubmitted;  // Only written by the submit
+    uint8_t * txNumFreed;      // Only written by the interrupt
+    uint32_t totalTxSubmitted; // Only written by the submit
+    uint32_t totalTxFreed;     // Only written by the interrupt
+    tTxSelectiveRepeat * txSelectiveRepeat;
+    uint8_t * txWindowSize; // Per destination - agreed when the node joins
+    uint32_t numSelectiveResends;
     uint8_t maxTxNodes;
     uint8_t maxTxBufferLevel;
     uint8_t txBufferLevel;
     tNodeQueue * activeTxNodes;
-    uint8_t lastTxQueueIndex;
+    tNodeQueue urgentTxNodes; // Master only - nodes with urgent packets buffered
+    tNodeIndex lastTxNodeId;
     uint8_t lastTxQueueCount;
+    // Master only - flow control (see txManagerUpdateCredits)
+    uint8_t * txCredits; // Per node - packets it has room for (NULL if flow control is off)
+    tNodeIndex creditTxNodeId[CREDIT_PIPELINE_PACKETS]; // Where the packets still on their way are going
+    uint32_t numCreditStalls;
 } tTxManager;
 
 
+#define TX_LANE(txManager, nodeId, priority) ((priority) * (txManager)->maxTxNodes + (nodeId))
 #define IS_TX_BUFFER_EMPTY(txManager, dstNodeId) (((txManager)->txSeqNumEnd[(dstNodeId)] == (txManager)->txSeqNumStart[(dstNodeId)]))
 
 void initTxManager(
@@ -43,18 +75,38 @@ void initTxManager(
         uint8_t txSeqNumNext[],
         uint8_t txSeqNumPauseCount[],
         uint8_t rxSeqNum[],
+        uint8_t txQueueHead[],
+        uint8_t txQueueTail[],
+        uint8_t txQueueLastSent[],
+        uint8_t txNumSubmitted[],
+        uint8_t txNumFreed[],
+        tTxSelectiveRepeat txSelectiveRepeat[],
+        uint8_t txWindowSize[],
         tNodeQueue * activeTxNodes,
         uint8_t maxPacketEntries,
         tPacketEntry packetEntries[]
     );
 tPacket * allocateTxPacket(tTxManager * manager, uint8_t nodeId);
 void submitAllocatedTxPacket(tTxManager * manager, bool isMaster, uint8_t * masterDstNodeTTL, tNodeIndex srcNodeId, tNodeIndex dstNodeId, tPacketType packetType, uint16_t dataSize);
+bool txMessageNeedsNewPacket(tTxManager * manager, tNodeIndex dstNodeId, uint8_t numBytes);
+bool txMessageAppend(tTxManager * manager, bool isMaster, tNodeIndex srcNodeId, tNodeIndex dstNodeId, const uint8_t * data, uint8_t numBytes);
+uint16_t txMessageClosePacket(tTxManager * manager, tNodeIndex * dstNodeId);
+uint8_t getNumFreeTxPackets(tTxManager * manager);
+uint16_t txFragmentWrite(uint8_t * packetData, const uint8_t * data, uint16_t numBytes, uint16_t offset);
 tPacket * nodeGetNextTxDataPacket(tTxManager * manager);
+uint8_t getNumTxPacketsSendable(tTxManager * manager, uint8_t dstNodeId);
+uint8_t getNumTxPacketsNotSent(tTxManager * manager, uint8_t dstNodeId);
 tPacket * masterGetNextTxDataPacket(tTxManager * manager, uint8_t numTxNodesScheduled, uint8_t nextTxNodeId[MAX_TX_NODES_SCHEDULED], uint8_t burstSize);
+void txManagerSetCredits(tTxManager * manager, uint8_t txCredits[]);
+void txManagerUpdateCredits(tTxManager * manager, tNodeIndex nodeId, uint8_t rxCredits);
+void txManagerRecordCreditTx(tTxManager * manager, tNodeIndex dstNodeId);
 void masterTxManagerRemoveNode(tTxManager * manager, tNodeIndex nodeId, uint8_t * numTxPacketsFreed);
 void masterTxClearBuffers(tTxManager * manager);
 uint8_t rxAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNum, bool isMaster, uint64_t * statsNumTxWindowRestarts);
+uint8_t rxSelectiveAckSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t ackSeqNum, uint8_t sackBitmap, bool isMaster, uint64_t * statsNumTxWindowRestarts);
 bool rxPacketCheckAndUpdateSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t packetTxSeqNum, bool isMaster);
+uint8_t rxPacketSeqNumOffset(tTxManager * manager, tNodeIndex srcNodeId, uint8_t packetTxSeqNum);
+void rxAdvanceSeqNum(tTxManager * manager, tNodeIndex srcNodeId, uint8_t numPackets);
 void txManagerResetNodeSeqNumbers(tTxManager * manager, uint8_t nodeId);
 uint8_t getNumInTxBuffer(tTxManager * manager, uint8_t dstNodeId);
 uint8_t getNumAllBufferedTxPackets(tTxManager * manager);
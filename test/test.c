@@ -12,6 +12,7 @@ void print_bytes(const uint8_t* data, int len) {
 
 void testMicrobus();
 void testScheduler();
+void testSchedulerModes();
 void testNetworkManager();
 void testTxManager();
 
@@ -29,6 +30,7 @@ int main() {
     MB_PRINTF("Test\n");
 
     // testScheduler();
+    testSchedulerModes();
     testNetworkManager();
     testTxManager();
 
@@ -36,6 +38,9 @@ int main() {
     test_packets_to_from_each_node(10-1, 1);
     test_packets_to_from_each_node(2, 100);
     test_packets_to_from_each_node(4, 50);
+    test_tx_messages_to_from_node();
+    test_large_messages_to_from_node();
+    test_large_messages_across_node_reset();
 
     testMicrobus();
 
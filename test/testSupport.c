@@ -17,6 +17,26 @@
 
 static const tPacket nullPacket = {0};
 
+// Simulated bus time - with variable length slots each slot only takes as long as the longest packet in it
+uint64_t simulatedTimeUs = 0;
+static uint32_t lastSlotTimeUs = SLOT_TIME_US;
+
+// Nothing on the bus still takes a header's worth of time to find out
+static uint32_t recordSlot(uint16_t slotSize) {
+    lastSlotTimeUs = SLOT_TIME_FOR_BYTES_US(MAX(slotSize, MB_HEADER_SIZE));
+    simulatedTimeUs += lastSlotTimeUs;
+    return lastSlotTimeUs;
+}
+
+// Only what was transferred arrives - the rest of the rx memory is left as it was
+static void transferPacket(tPacket * rxPacket, const tPacket * txPacket, uint16_t transferSize) {
+    if (txPacket == NULL) {
+        txPacket = &nullPacket;
+        transferSize = sizeof(tPacket);
+    }
+    memcpy(rxPacket, txPacket, MIN(transferSize, sizeof(tPacket)));
+}
+
 void * myMalloc(size_t numBytes) {
     void * result = malloc(numBytes);
     assert(result);
@@ -50,14 +70,14 @@ tNode * createNode(uint32_t txQueueSize, uint32_t rxQueueSize, uint64_t uniqueId
 
 void freeNode(tNode * node) {
     free(node->txManager.packetStore.entries);
-    free(node->rxPacketManager.rxPacketEntries);
+    free(node->rxPacketManager.packetStore.entries);
     free(node->rxPacketManager.rxPacketQueue);
     free(node);
 }
 
 void freeMaster(tMaster * master) {
     free(master->tx.txManager.packetStore.entries);
-    free(master->rx.rxPacketManager.rxPacketEntries);
+    free(master->rx.rxPacketManager.packetStore.entries);
     free(master->rx.rxPacketManager.rxPacketQueue);
     free(master);
 }
@@ -89,6 +109,25 @@ void checkAllNodesHaveDistinctIds(uint8_t i, tNode * nodes[], uint32_t numNodes)
 }
 
 
+// Nodes transmitting at the same time - new node requests and rejoin claims only drive their own sub-slot
+// so they are ORed together (like an open drain bus), anything else is lost
+static tPacket overlappedPacket;
+static tPacket * overlapPackets(tPacket * packet, tPacket * otherPacket, uint16_t size) {
+    if (packet == NULL || GET_PACKET_TYPE(packet) != GET_PACKET_TYPE(otherPacket)) {
+        return NULL;
+    }
+    if (GET_PACKET_TYPE(packet) != NEW_NODE_REQUEST_PACKET && GET_PACKET_TYPE(packet) != NODE_REJOIN_PACKET) {
+        return NULL;
+    }
+    if (packet != &overlappedPacket) {
+        memcpy(&overlappedPacket, packet, size);
+    }
+    for (uint16_t i=0; i<size; i++) {
+        ((uint8_t *)&overlappedPacket)[i] |= ((uint8_t *)otherPacket)[i];
+    }
+    return &overlappedPacket;
+}
+
 void runSingleChannel(tMaster * master, tNode * nodes[], bool ignoreNodes[], uint32_t numNodes, uint32_t numFrames, bool allowNodeTxOverlaps) {
     for (uint32_t j=0; j<numFrames; j++) {
         cycleIndex++;
@@ -96,12 +135,14 @@ void runSingleChannel(tMaster * master, tNode * nodes[], bool ignoreNodes[], uin
         tPacket * nodeTxData = NULL;
         uint32_t numNodeTxPackets = 0;
         tPacket * masterTxPacket = NULL;
+        uint16_t slotSize = 0;
+        uint16_t nodeTxSize = 0;
         bool masterTx = master->currentTxNodeId == MASTER_NODE_ID;
 
-        masterUpdateTimeUs(master, SLOT_TIME_US);
+        masterUpdateTimeUs(master, lastSlotTimeUs);
 
         if (masterTx) {
-            masterNoDelaySingleChannelProcessTx(master, &masterTxPacket);
+            slotSize = masterNoDelaySingleChannelProcessTx(master, &masterTxPacket);
             MB_PRINTF("Master Tx mode, txPacket:%u\n", masterTxPacket != NULL);
             if (masterTxPacket != NULL) {
                 numNodeTxPackets++;
@@ -112,13 +153,14 @@ void runSingleChannel(tMaster * master, tNode * nodes[], bool ignoreNodes[], uin
             tNode * node = nodes[i];
             tPacket * nodeTxPacket = NULL;
 
-            nodeUpdateTimeUs(node, SLOT_TIME_US);
+            nodeUpdateTimeUs(node, lastSlotTimeUs);
 
             if (ignoreNodes == NULL || !ignoreNodes[i]) {
                 bool nodeTx = nodeIsTxMode(node);
 
                 if (nodeTx) {
-                    nodeNoDelaySingleChannelProcessTx(node, &nodeTxPacket);
+                    uint16_t txSize = nodeNoDelaySingleChannelProcessTx(node, &nodeTxPacket);
+                    slotSize = MAX(slotSize, txSize);
                     MB_PRINTF("node Tx mode:%u, txPacket:%u\n", node->nodeId, nodeTxPacket != NULL);
 
                     if (nodeTxPacket != NULL) {
@@ -128,24 +170,26 @@ void runSingleChannel(tMaster * master, tNode * nodes[], bool ignoreNodes[], uin
                         }
 
                         numNodeTxPackets++;
-                        nodeTxData = nodeTxPacket;
 
                         if(numNodeTxPackets > 1) {
                             if (MICROBUS_LOGGING) {
                                 MB_PRINTF("Overlap occurred\n");
                             }
                             if (allowNodeTxOverlaps) {
-                                nodeTxData = NULL;
+                                nodeTxData = overlapPackets(nodeTxData, nodeTxPacket, txSize);
                             } else {
                                 assert(0);
                             }
+                        } else {
+                            nodeTxData = nodeTxPacket;
                         }
+                        nodeTxSize = txSize;
                     }
                 } else {
                     tPacket * nodeRxPacket = NULL;
                     nodeRxPacket = nodeGetRxPacketMemory(node);
                     // Record Master -> Node packet
-                    memcpy(nodeRxPacket, masterTxPacket ? masterTxPacket : &nullPacket, sizeof(tPacket));
+                    transferPacket(nodeRxPacket, masterTxPacket, microbusPacketTransferSize(masterTxPacket));
                     nodeNoDelaySingleChannelProcessRx(node, false);
                 }
             }
@@ -155,9 +199,10 @@ void runSingleChannel(tMaster * master, tNode * nodes[], bool ignoreNodes[], uin
         // Record Node -> Master packet
         if (!masterTx) {
             tPacket * masterRxPacket = masterGetRxPacketMemory(master);
-            memcpy(masterRxPacket, nodeTxData ? nodeTxData : &nullPacket, sizeof(tPacket));
+            transferPacket(masterRxPacket, nodeTxData, nodeTxSize);
             masterNoDelaySingleChannelProcessRx(master, false);
         }
+        recordSlot(slotSize);
     }
 }
 
@@ -170,50 +215,56 @@ void runDualChannel(tMaster * master, tNode * nodes[], bool ignoreNodes[], uint3
 
         tPacket * masterRxPacket = NULL;
         tPacket * masterTxPacket = NULL;
-        masterUpdateTimeUs(master, SLOT_TIME_US);
+        uint16_t nodeTxSize = 0;
+        masterUpdateTimeUs(master, lastSlotTimeUs);
         // Process previous packet
         masterDualChannelPipelinedPostProcess(master);
         // Get next packets
-        masterDualChannelPipelinedPreProcess(master, &masterTxPacket, &masterRxPacket, false);
+        uint16_t masterTxSize = masterDualChannelPipelinedPreProcess(master, &masterTxPacket, &masterRxPacket, false);
+        uint16_t slotSize = masterTxSize;
 
         for (uint32_t i=0; i<numNodes; i++) {
             tNode * node = nodes[i];
             tPacket * nodeTxPacket = NULL;
             tPacket * nodeRxPacket = NULL;
 
-            nodeUpdateTimeUs(node, SLOT_TIME_US);
+            nodeUpdateTimeUs(node, lastSlotTimeUs);
 
             if (ignoreNodes == NULL || !ignoreNodes[i]) {
                 // Process previous packet
                 nodeDualChannelPipelinedPostProcess(node);
                 // Get next packets
-                nodeDualChannelPipelinedPreProcess(node, &nodeTxPacket, &nodeRxPacket, false);
+                uint16_t txSize = nodeDualChannelPipelinedPreProcess(node, &nodeTxPacket, &nodeRxPacket, false);
+                slotSize = MAX(slotSize, txSize);
 
                 if (nodeTxPacket != NULL) {
                     numNodeTxPackets++;
-                    nodeTxData = nodeTxPacket;
 
                     if(numNodeTxPackets > 1) {
                         if (MICROBUS_LOGGING) {
                             MB_PRINTF("Overlap occurred\n");
                         }
                         if (allowNodeTxOverlaps) {
-                            nodeTxData = NULL;
+                            nodeTxData = overlapPackets(nodeTxData, nodeTxPacket, txSize);
                         } else {
                             assert(0);
                         }
+                    } else {
+                        nodeTxData = nodeTxPacket;
                     }
+                    nodeTxSize = txSize;
                 }
 
                 // Record Master -> Node packet
-                memcpy(nodeRxPacket, masterTxPacket ? masterTxPacket : &nullPacket, sizeof(tPacket));
+                transferPacket(nodeRxPacket, masterTxPacket, masterTxSize);
             }
 
             checkAllNodesHaveDistinctIds(i, nodes, numNodes);
         }
 
         // Record Node -> Master packet
-        memcpy(masterRxPacket, nodeTxData ? nodeTxData : &nullPacket, sizeof(tPacket));
+        transferPacket(masterRxPacket, nodeTxData, nodeTxSize);
+        recordSlot(slotSize);
     }
 }
 
@@ -227,12 +278,14 @@ void run(tMaster * master, tNode * nodes[], bool ignoreNodes[], uint32_t numNode
 }
 
 
-void runUntilAllNodesOnNetwork(tMaster ** master, tNode * nodes[MAX_NODES], uint32_t numNodes, bool disableLogging, bool singleChannel) {
+// Returns the number of frames it took
+uint32_t runUntilAllNodesOnNetwork(tMaster ** master, tNode * nodes[MAX_NODES], uint32_t numNodes, bool disableLogging, bool singleChannel) {
     if (disableLogging) {
         loggingEnabled = false;
     }
     // Run until nodes are on the network
-    for (uint32_t j=0; j<300*numNodes; j++) {
+    uint32_t j;
+    for (j=0; j<300*numNodes; j++) {
         run(*master, &nodes[1], NULL, numNodes, 1, true, singleChannel);
         // Check if all nodes allocated
         bool allAllocated = true;
@@ -252,6 +305,7 @@ void runUntilAllNodesOnNetwork(tMaster ** master, tNode * nodes[MAX_NODES], uint
     if (disableLogging) {
         loggingEnabled = true;
     }
+    return j + 1;
 }
 
 
@@ -355,7 +409,8 @@ bool areAllTxBuffersEmpty(tMaster * master, tNode * nodes[MAX_NODES], uint32_t n
 void getMasterRxData(tMaster * master, uint8_t * rxData, uint8_t numBytes) {
     uint16_t size;
     tNodeIndex srcNodeId;
-    uint8_t * data = masterPeekNextRxDataPacket(master, &size, &srcNodeId);
+    bool datagram;
+    uint8_t * data = masterPeekNextRxDataPacket(master, &size, &srcNodeId, &datagram);
     assert(data);
     memcpy(rxData, data, numBytes);
     masterPopNextDataPacket(master);
@@ -364,7 +419,8 @@ void getMasterRxData(tMaster * master, uint8_t * rxData, uint8_t numBytes) {
 void getNodeRxData(tNode * node, uint8_t * rxData, uint8_t numBytes) {
     uint16_t size;
     tNodeIndex srcNodeId;
-    uint8_t * data = nodePeekNextRxDataPacket(node, &size, &srcNodeId);
+    bool datagram;
+    uint8_t * data = nodePeekNextRxDataPacket(node, &size, &srcNodeId, &datagram);
     memcpy(rxData, data, numBytes);
     nodePopNextDataPacket(node);
 }
@@ -375,7 +431,8 @@ uint32_t processAllRxData(tPacketChecker * checker, tMaster * master, tNode * no
     while (true) {
         uint16_t size;
         tNodeIndex srcNodeId;
-        uint8_t * masterRxData = masterPeekNextRxDataPacket(master, &size, &srcNodeId);
+        bool datagram;
+        uint8_t * masterRxData = masterPeekNextRxDataPacket(master, &size, &srcNodeId, &datagram);
         if (masterRxData) {
             processRxPacket(checker, masterRxData, size);
             masterPopNextDataPacket(master);
@@ -389,7 +446,8 @@ uint32_t processAllRxData(tPacketChecker * checker, tMaster * master, tNode * no
         while (true) {
             uint16_t size;
             tNodeIndex srcNodeId;
-            uint8_t * nodeRxData = nodePeekNextRxDataPacket(nodes[i], &size, &srcNodeId);
+            bool datagram;
+            uint8_t * nodeRxData = nodePeekNextRxDataPacket(nodes[i], &size, &srcNodeId, &datagram);
             if (nodeRxData) {
                 processRxPacket(checker, nodeRxData, size);
                 nodePopNextDataPacket(nodes[i]);
@@ -18,6 +18,8 @@
 
 #include "packetChecker.h"
 
+extern uint64_t simulatedTimeUs;
+
 void * myMalloc(size_t numBytes);
 tMaster * createMaster(uint32_t txQueueSize, uint32_t rxQueueSize, bool singleChannel);
 tNode * createNode(uint32_t txQueueSize, uint32_t rxQueueSize, uint64_t uniqueId);
@@ -26,7 +28,7 @@ void freeMaster(tMaster * master);
 void initSystem(tPacketChecker * checker, tMaster ** master, tNode * nodes[MAX_NODES], uint32_t numNodes, bool singleChannel);
 
 void run(tMaster * master, tNode * nodes[], bool ignoreNodes[], uint32_t numNodes, uint32_t numFrames, bool allowNodeTxOverlaps, bool singleChannel);
-void runUntilAllNodesOnNetwork(tMaster ** master, tNode * nodes[MAX_NODES], uint32_t numNodes, bool disableLogging, bool singleChannel);
+uint32_t runUntilAllNodesOnNetwork(tMaster ** master, tNode * nodes[MAX_NODES], uint32_t numNodes, bool disableLogging, bool singleChannel);
 bool attemptMasterTxRandomPacket(tPacketChecker * checker, tMaster * master, tNode * nodes[], uint8_t dstSimNodeId);
 bool attemptNodeTxRandomPacket(tPacketChecker * checker, tNode * node, uint8_t srcSimNodeId);
 void fillTxBuffersWithRandomPackets(
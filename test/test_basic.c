@@ -100,4 +100,149 @@ void test_packets_to_from_each_node(uint32_t numNodes, uint32_t numPacketsPerNod
         assert(0 == getNumInTxBuffer(&nodes[i]->txManager, MASTER_NODE_ID));
         assert(0 == getNumInTxBuffer(&master->tx.txManager, nodes[i]->nodeId));
     }
-}
\ No newline at end of file
+}
+
+// Lots of small messages each way should be packed into a few packets and come out the same
+void test_tx_messages_to_from_node(void) {
+    #define NUM_MESSAGES 60
+    #define MESSAGE_SIZE 10
+    tMaster * master = createMaster(10, 10, false);
+    tNode * nodes[1];
+    nodes[0] = createNode(10, 10, 0x5555);
+
+    run(master, nodes, NULL, 1, 4000, true, false);
+    assert(nodes[0]->nodeId != UNALLOCATED_NODE_ID);
+    tNodeIndex nodeId = nodes[0]->nodeId;
+
+    uint8_t message[MESSAGE_SIZE];
+    for (uint32_t i=0; i<NUM_MESSAGES; i++) {
+        memset(message, i, MESSAGE_SIZE);
+        assert(masterAppendTxMessage(master, nodeId, message, MESSAGE_SIZE));
+        assert(nodeAppendTxMessage(nodes[0], message, 1 + (i % MESSAGE_SIZE)));
+    }
+    masterFlushTxMessages(master);
+    nodeFlushTxMessages(nodes[0]);
+    // Far fewer packets than messages
+    assert(getNumInTxBuffer(&master->tx.txManager, nodeId) < NUM_MESSAGES / 8);
+
+    run(master, nodes, NULL, 1, 1000, false, false);
+
+    for (uint32_t i=0; i<NUM_MESSAGES; i++) {
+        uint16_t size;
+        tNodeIndex srcNodeId;
+        uint8_t * data = nodePeekNextRxMessage(nodes[0], &size);
+        assert(data && size == MESSAGE_SIZE && data[0] == i && data[MESSAGE_SIZE-1] == i);
+        assert(nodePopNextRxMessage(nodes[0]));
+
+        data = masterPeekNextRxMessage(master, &size, &srcNodeId);
+        assert(data && srcNodeId == nodeId && size == 1 + (i % MESSAGE_SIZE) && data[0] == i);
+        assert(masterPopNextRxMessage(master));
+    }
+    uint16_t size;
+    tNodeIndex srcNodeId;
+    assert(nodePeekNextRxMessage(nodes[0], &size) == NULL);
+    assert(masterPeekNextRxMessage(master, &size, &srcNodeId) == NULL);
+
+    freeNode(nodes[0]);
+    freeMaster(master);
+}
+
+// Messages bigger than a packet are split up and put back together on the other side
+void test_large_messages_to_from_node(void) {
+    static tReassemblyEntry masterReassembly[2];
+    static tReassemblyEntry nodeReassembly[2];
+    uint16_t sizes[3] = {700, 50, MAX_LARGE_MESSAGE_SIZE};
+    static uint8_t message[MAX_LARGE_MESSAGE_SIZE];
+
+    tMaster * master = createMaster(20, 20, false);
+    tNode * nodes[1];
+    nodes[0] = createNode(20, 20, 0x6666);
+    masterInitLargeRxMessages(master, 2, masterReassembly);
+    nodeInitLargeRxMessages(nodes[0], 2, nodeReassembly);
+
+    run(master, nodes, NULL, 1, 4000, true, false);
+    assert(nodes[0]->nodeId != UNALLOCATED_NODE_ID);
+    tNodeIndex nodeId = nodes[0]->nodeId;
+
+    for (uint32_t i=0; i<3; i++) {
+        for (uint32_t j=0; j<sizes[i]; j++) {
+            message[j] = i + j;
+        }
+        assert(masterSubmitLargeTxMessage(master, nodeId, message, sizes[i]));
+        assert(nodeSubmitLargeTxMessage(nodes[0], message, sizes[i]));
+        run(master, nodes, NULL, 1, 200, false, false);
+    }
+
+    for (uint32_t i=0; i<3; i++) {
+        uint16_t size;
+        tNodeIndex srcNodeId;
+        uint8_t * data = nodePeekNextLargeRxMessage(nodes[0], &size);
+        assert(data && size == sizes[i]);
+        for (uint32_t j=0; j<sizes[i]; j++) {
+            assert(data[j] == (uint8_t)(i + j));
+        }
+        assert(nodePopNextLargeRxMessage(nodes[0]));
+
+        data = masterPeekNextLargeRxMessage(master, &size, &srcNodeId);
+        assert(data && size == sizes[i] && srcNodeId == nodeId);
+        for (uint32_t j=0; j<sizes[i]; j++) {
+            assert(data[j] == (uint8_t)(i + j));
+        }
+        assert(masterPopNextLargeRxMessage(master));
+    }
+    assert(master->rx.rxPacketManager.numFragmentsDropped == 0);
+    assert(nodes[0]->rxPacketManager.numFragmentsDropped == 0);
+
+    freeNode(nodes[0]);
+    freeMaster(master);
+}
+
+
+// The reassembly buffers are kept across a node reset, and the master drops the
+// unfinished message from a node it removes
+void test_large_messages_across_node_reset(void) {
+    static tReassemblyEntry masterReassembly[1];
+    static tReassemblyEntry nodeReassembly[1];
+    static uint8_t message[700];
+    for (uint32_t j=0; j<sizeof(message); j++) {
+        message[j] = j;
+    }
+
+    tMaster * master = createMaster(20, 20, false);
+    tNode * nodes[1];
+    nodes[0] = createNode(20, 20, 0x7777);
+    masterInitLargeRxMessages(master, 1, masterReassembly);
+    nodeInitLargeRxMessages(nodes[0], 1, nodeReassembly);
+    run(master, nodes, NULL, 1, 4000, true, false);
+    assert(nodes[0]->nodeId != UNALLOCATED_NODE_ID);
+
+    nodeReset(nodes[0]);
+    run(master, nodes, NULL, 1, 4000, true, false);
+    assert(nodes[0]->nodeId != UNALLOCATED_NODE_ID);
+    assert(masterSubmitLargeTxMessage(master, nodes[0]->nodeId, message, sizeof(message)));
+    run(master, nodes, NULL, 1, 200, false, false);
+    uint16_t size;
+    uint8_t * data = nodePeekNextLargeRxMessage(nodes[0], &size);
+    assert(data && size == sizeof(message) && memcmp(data, message, size) == 0);
+    assert(nodePopNextLargeRxMessage(nodes[0]));
+
+    // The node goes quiet part way through sending a message
+    tNodeIndex srcNodeId;
+    assert(nodeSubmitLargeTxMessage(nodes[0], message, sizeof(message)));
+    for (uint32_t i=0; i<100 && !masterReassembly[0].inUse; i++) {
+        run(master, nodes, NULL, 1, 1, false, false);
+        assert(masterPeekNextLargeRxMessage(master, &size, &srcNodeId) == NULL);
+    }
+    assert(masterReassembly[0].inUse);
+    bool ignoreNodes[1] = {true};
+    for (uint32_t i=0; i<100000 && master->activeNodes.numNodes > 0; i++) {
+        run(master, nodes, ignoreNodes, 1, 1, false, false);
+    }
+    assert(master->activeNodes.numNodes == 0);
+    assert(masterPeekNextLargeRxMessage(master, &size, &srcNodeId) == NULL);
+    assert(!masterReassembly[0].inUse);
+    assert(master->rx.rxPacketManager.numFragmentsDropped == 1);
+
+    freeNode(nodes[0]);
+    freeMaster(master);
+}
@@ -20,5 +20,8 @@
 
 void test_max_nodes_new_node_allocation(void);
 void test_packets_to_from_each_node(uint32_t numNodes, uint32_t numPacketsPerNode);
+void test_tx_messages_to_from_node(void);
+void test_large_messages_to_from_node(void);
+void test_large_messages_across_node_reset(void);
 
 #endif
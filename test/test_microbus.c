@@ -356,6 +356,368 @@ void test_full_system_with_nodes_disconnecting(uint32_t numNodes, bool singleCha
     checkAllPacketsReceived(&checker);
 }
 
+// Nodes that aren't in the schedule get their acks from the master's ack packet
+void test_master_ack_packet(void) {
+    tMaster * master = createMaster(4, 4, false);
+    tNode * node = createNode(4, 4, 0x1234);
+    master->tx.masterResetCycles = 0;
+    node->nodeId = 5;
+
+    master->tx.txManager.rxSeqNum[3] = 10;
+    master->tx.txManager.rxSeqNum[5] = 20;
+    masterTxRecordAckPending(&master->tx, 3, TX_PRIORITY_NORMAL);
+    masterTxRecordAckPending(&master->tx, 5, TX_PRIORITY_NORMAL);
+
+    // Nothing to send - so send the acks instead of an empty packet
+    tNodeIndex schedule[MAX_TX_NODES_SCHEDULED] = {MASTER_NODE_ID};
+    masterProcessTx(&master->tx, &master->nwManager, &master->scheduler, schedule);
+    masterQuickUpdateTxPacket(&master->tx, &master->scheduler, schedule);
+    tPacket * txPacket = masterTxGetNextTxPacket(&master->tx);
+    assert(GET_PACKET_TYPE(txPacket) == MASTER_ACK_PACKET);
+    assert(GET_PACKET_DATA_SIZE(txPacket) == 2 * MASTER_ACK_ENTRY_SIZE);
+    assert(master->tx.ackPendingNodes.numNodes == 0);
+
+    // Node picks out its own ack
+    memcpy(&node->nextRxPacketEntry->packet, txPacket, sizeof(tPacket));
+    nodeQuickProcessPrevRx(node, false);
+    assert(node->savedRxAckValid);
+    assert(node->savedRxAck == 20);
+    assert(!node->validRxPacket);
+
+    // Once acked there is nothing more to send
+    masterProcessTx(&master->tx, &master->nwManager, &master->scheduler, schedule);
+    assert(GET_PACKET_TYPE(masterTxGetNextTxPacket(&master->tx)) == MASTER_EMPTY_PACKET);
+
+    freeNode(node);
+    freeMaster(master);
+}
+
+// Slots only take as long as the packets sent in them
+void test_variable_length_slots(void) {
+    tPacket packet = {0};
+    SET_PACKET_DATA_SIZE(&packet, 10);
+    assert(microbusPacketTransferSize(NULL) == 0);
+    assert(microbusPacketTransferSize(&packet) == (MICROBUS_VARIABLE_LENGTH_SLOTS ? MB_HEADER_SIZE + 10 : MB_PACKET_SIZE));
+
+    // An idle bus only sends headers
+    tMaster * master = createMaster(4, 4, false);
+    tNode * nodes[MAX_NODES] = {NULL, createNode(4, 4, 0x1234)};
+    runUntilAllNodesOnNetwork(&master, nodes, 1, true, false);
+    uint64_t startTimeUs = simulatedTimeUs;
+    run(master, &nodes[1], NULL, 1, 100, false, false);
+    uint64_t idleTimeUs = simulatedTimeUs - startTimeUs;
+    if (MICROBUS_VARIABLE_LENGTH_SLOTS) {
+        assert(idleTimeUs < 100 * SLOT_TIME_US / 2);
+    } else {
+        assert(idleTimeUs == 100 * SLOT_TIME_US);
+    }
+
+    // A completely full packet gets through both ways
+    memset(masterAllocateTxPacket(master), 0xAA, MASTER_PACKET_DATA_SIZE);
+    masterSubmitAllocatedTxPacket(master, nodes[1]->nodeId, MASTER_PACKET_DATA_SIZE);
+    memset(nodeAllocateTxPacket(nodes[1]), 0x55, NODE_PACKET_DATA_SIZE);
+    nodeSubmitAllocatedTxPacket(nodes[1], MASTER_NODE_ID, NODE_PACKET_DATA_SIZE);
+    run(master, &nodes[1], NULL, 1, 20, false, false);
+    uint16_t size;
+    tNodeIndex srcNodeId;
+    bool datagram;
+    uint8_t * data = masterPeekNextRxDataPacket(master, &size, &srcNodeId, &datagram);
+    assert(data && size == NODE_PACKET_DATA_SIZE && data[NODE_PACKET_DATA_SIZE-1] == 0x55);
+    data = nodePeekNextRxDataPacket(nodes[1], &size, &srcNodeId, &datagram);
+    assert(data && size == MASTER_PACKET_DATA_SIZE && data[MASTER_PACKET_DATA_SIZE-1] == 0xAA);
+
+    freeNode(nodes[1]);
+    freeMaster(master);
+}
+
+// Single channel - a busy master shortens the look-ahead and a quiet one lengthens it
+// again, without the nodes losing track of the schedule
+void test_adaptive_look_ahead(void) {
+    tPacketChecker checker = {0};
+    tMaster * master;
+    tNode * nodes[MAX_NODES];
+    uint32_t numNodes = 2;
+    initSystem(&checker, &master, nodes, numNodes, true);
+    runUntilAllNodesOnNetwork(&master, nodes, numNodes, true, true);
+    masterSetAdaptiveLookAhead(master, true);
+    assert(master->scheduler.numTxNodesScheduled == MAX_TX_NODES_SCHEDULED);
+
+    uint32_t packetsSent[MAX_NODES] = {0};
+    uint32_t numPacketsSent = 0;
+    uint32_t numPacketsReceived = 0;
+    uint8_t minLookAhead = MAX_TX_NODES_SCHEDULED;
+    for (uint32_t i=0; i<2000; i++) {
+        fillTxBuffersWithRandomPackets(400, &checker, master, nodes, numNodes, packetsSent, &numPacketsSent, true, false, false);
+        run(master, &nodes[1], NULL, numNodes, 1, false, true);
+        numPacketsReceived += processAllRxData(&checker, master, nodes, numNodes);
+        minLookAhead = MIN(minLookAhead, master->scheduler.numTxNodesScheduled);
+    }
+    assert(minLookAhead < MAX_TX_NODES_SCHEDULED);
+
+    // Finish off and go quiet
+    for (uint32_t i=0; i<2000; i++) {
+        run(master, &nodes[1], NULL, numNodes, 1, false, true);
+        numPacketsReceived += processAllRxData(&checker, master, nodes, numNodes);
+    }
+    assert(numPacketsReceived == numPacketsSent);
+    assert(master->scheduler.numTxNodesScheduled == MAX_TX_NODES_SCHEDULED);
+    checkAllPacketsReceived(&checker);
+}
+
+static void checkUrgentPacketOrder(uint8_t * rxTags, uint32_t numPackets, uint8_t urgentTag) {
+    for (uint32_t rxIndex=0; rxIndex<numPackets; rxIndex++) {
+        if ((rxTags[rxIndex] & urgentTag) == 0) {
+            continue;
+        }
+        uint8_t submitIndex = rxTags[rxIndex] & ~urgentTag;
+        assert(rxIndex < submitIndex);
+        for (uint32_t j=0; j<rxIndex; j++) {
+            assert((rxTags[j] & urgentTag) || (rxTags[j] < submitIndex));
+        }
+    }
+}
+
+// Urgent packets overtake normal packets queued before them, in both directions
+void test_urgent_packets(void) {
+    uint32_t numPackets = 14;
+    uint8_t urgentTag = 0x80; // Tags are the submit order, with this set for urgent packets
+    tMaster * master = createMaster(16, 16, false);
+    tNode * nodes[MAX_NODES];
+    nodes[1] = createNode(16, 16, 0);
+    runUntilAllNodesOnNetwork(&master, nodes, 1, true, false);
+
+    for (uint32_t i=0; i<numPackets; i++) {
+        bool urgent = (i == numPackets / 2) || (i == numPackets - 1);
+        uint8_t tag = urgent ? (i | urgentTag) : i;
+        uint8_t * data = masterAllocateTxPacket(master);
+        assert(data);
+        data[0] = tag;
+        if (urgent) {
+            masterSubmitAllocatedUrgentTxPacket(master, nodes[1]->nodeId, 4);
+        } else {
+            masterSubmitAllocatedTxPacket(master, nodes[1]->nodeId, 4);
+        }
+        data = nodeAllocateTxPacket(nodes[1]);
+        assert(data);
+        data[0] = tag;
+        if (urgent) {
+            nodeSubmitAllocatedUrgentTxPacket(nodes[1], MASTER_NODE_ID, 4);
+        } else {
+            nodeSubmitAllocatedTxPacket(nodes[1], MASTER_NODE_ID, 4);
+        }
+    }
+
+    uint8_t masterRxTags[16], nodeRxTags[16];
+    uint32_t masterRxCount = 0, nodeRxCount = 0;
+    for (uint32_t i=0; (i<1000) && ((masterRxCount < numPackets) || (nodeRxCount < numPackets)); i++) {
+        run(master, &nodes[1], NULL, 1, 1, false, false);
+        uint16_t size;
+        tNodeIndex srcNodeId;
+        bool datagram;
+        while (masterPeekNextRxDataPacket(master, &size, &srcNodeId, &datagram)) {
+            assert(masterRxCount < numPackets);
+            getMasterRxData(master, &masterRxTags[masterRxCount++], 1);
+        }
+        while (nodePeekNextRxDataPacket(nodes[1], &size, &srcNodeId, &datagram)) {
+            assert(nodeRxCount < numPackets);
+            getNodeRxData(nodes[1], &nodeRxTags[nodeRxCount++], 1);
+        }
+    }
+    assert(masterRxCount == numPackets);
+    assert(nodeRxCount == numPackets);
+    // Every urgent packet beats the first normal packet submitted after it, and gets in ahead
+    // of some of the normal packets submitted before it
+    checkUrgentPacketOrder(masterRxTags, numPackets, urgentTag);
+    checkUrgentPacketOrder(nodeRxTags, numPackets, urgentTag);
+
+    freeNode(nodes[1]);
+    freeMaster(master);
+}
+
+// Only the newest datagram is sent and datagrams don't hold up (or get held up by) reliable packets
+void test_datagrams(void) {
+    uint32_t numNormal = 8;
+    tMaster * master = createMaster(16, 16, false);
+    tNode * nodes[MAX_NODES];
+    nodes[1] = createNode(16, 16, 0);
+    tPacketEntry * masterDatagrams = myMalloc(4 * sizeof(tPacketEntry));
+    tPacketEntry * nodeDatagrams = myMalloc(4 * sizeof(tPacketEntry));
+    masterInitDatagrams(master, 4, masterDatagrams);
+    runUntilAllNodesOnNetwork(&master, nodes, 1, true, false);
+    nodeInitDatagrams(nodes[1], 4, nodeDatagrams);
+
+    for (uint32_t i=0; i<numNormal; i++) {
+        uint8_t * data = masterAllocateTxPacket(master);
+        data[0] = i;
+        masterSubmitAllocatedTxPacket(master, nodes[1]->nodeId, 4);
+        data = nodeAllocateTxPacket(nodes[1]);
+        data[0] = i;
+        nodeSubmitAllocatedTxPacket(nodes[1], MASTER_NODE_ID, 4);
+    }
+    // Latest value wins
+    for (uint8_t tag=0x80; tag<0x83; tag++) {
+        uint8_t * data = masterAllocateDatagram(master);
+        assert(data);
+        data[0] = tag;
+        masterSubmitAllocatedDatagram(master, nodes[1]->nodeId, 4);
+        data = nodeAllocateDatagram(nodes[1]);
+        assert(data);
+        data[0] = tag;
+        nodeSubmitAllocatedDatagram(nodes[1], MASTER_NODE_ID, 4);
+    }
+
+    uint32_t masterRxCount = 0, nodeRxCount = 0;
+    uint8_t masterRxDatagram = 0, nodeRxDatagram = 0;
+    for (uint32_t i=0; i<200; i++) {
+        run(master, &nodes[1], NULL, 1, 1, false, false);
+        uint8_t tag;
+        uint16_t size;
+        tNodeIndex srcNodeId;
+        bool datagram;
+        while (masterPeekNextRxDataPacket(master, &size, &srcNodeId, &datagram)) {
+            getMasterRxData(master, &tag, 1);
+            assert(datagram == ((tag & 0x80) != 0));
+            if (datagram) {
+                assert(masterRxDatagram == 0);
+                masterRxDatagram = tag;
+            } else {
+                assert(tag == masterRxCount++);
+            }
+        }
+        while (nodePeekNextRxDataPacket(nodes[1], &size, &srcNodeId, &datagram)) {
+            getNodeRxData(nodes[1], &tag, 1);
+            assert(datagram == ((tag & 0x80) != 0));
+            if (datagram) {
+                assert(nodeRxDatagram == 0);
+                nodeRxDatagram = tag;
+            } else {
+                assert(tag == nodeRxCount++);
+            }
+        }
+    }
+    assert(masterRxCount == numNormal && nodeRxCount == numNormal);
+    assert(masterRxDatagram == 0x82 && nodeRxDatagram == 0x82);
+    assert(master->stats.datagramsReplaced == 2 && nodes[1]->stats.datagramsReplaced == 2);
+    assert(master->stats.txDatagrams == 1 && nodes[1]->stats.txDatagrams == 1);
+    assert(areAllTxBuffersEmpty(master, nodes, 1, true));
+
+    // The message calls drop a datagram rather than read it as messages
+    uint8_t message[2] = {1, 2};
+    uint8_t * data = masterAllocateDatagram(master);
+    data[0] = 2;
+    masterSubmitAllocatedDatagram(master, nodes[1]->nodeId, 4);
+    assert(masterAppendTxMessage(master, nodes[1]->nodeId, message, sizeof(message)));
+    masterFlushTxMessages(master);
+    run(master, &nodes[1], NULL, 1, 20, false, false);
+    uint16_t size;
+    data = nodePeekNextRxMessage(nodes[1], &size);
+    assert(data && size == sizeof(message) && data[0] == 1);
+    assert(nodes[1]->rxPacketManager.numDatagramsDropped == 1);
+
+    // Every datagram entry is free again
+    for (uint32_t i=0; i<4; i++) {
+        assert(masterAllocateDatagram(master));
+        masterSubmitAllocatedDatagram(master, nodes[1]->nodeId, 4);
+    }
+}
+
+// With small rx buffers that aren't read for a while nothing is sent that would have to be dropped
+void test_flow_control(void) {
+    uint32_t numPackets = 12;
+    tMaster * master = createMaster(16, 4, false);
+    tNode * nodes[MAX_NODES];
+    nodes[1] = createNode(16, 4, 0);
+    masterSetFlowControl(master, true);
+    runUntilAllNodesOnNetwork(&master, nodes, 1, true, false);
+
+    for (uint32_t i=0; i<numPackets; i++) {
+        uint8_t * data = masterAllocateTxPacket(master);
+        data[0] = i;
+        masterSubmitAllocatedTxPacket(master, nodes[1]->nodeId, 4);
+        data = nodeAllocateTxPacket(nodes[1]);
+        data[0] = i;
+        nodeSubmitAllocatedTxPacket(nodes[1], MASTER_NODE_ID, 4);
+    }
+    // Neither end reads anything so both buffers fill up
+    run(master, &nodes[1], NULL, 1, 200, false, false);
+    assert(master->stats.txCreditStalls > 0 && nodes[1]->stats.txCreditStalls > 0);
+    assert(master->stats.rxBufferFull == 0 && nodes[1]->stats.rxBufferFull == 0);
+
+    uint32_t masterRxCount = 0, nodeRxCount = 0;
+    for (uint32_t i=0; i<200; i++) {
+        run(master, &nodes[1], NULL, 1, 1, false, false);
+        uint8_t tag;
+        uint16_t size;
+        tNodeIndex srcNodeId;
+        bool datagram;
+        while (masterPeekNextRxDataPacket(master, &size, &srcNodeId, &datagram)) {
+            getMasterRxData(master, &tag, 1);
+            assert(tag == masterRxCount++);
+        }
+        while (nodePeekNextRxDataPacket(nodes[1], &size, &srcNodeId, &datagram)) {
+            getNodeRxData(nodes[1], &tag, 1);
+            assert(tag == nodeRxCount++);
+        }
+    }
+    assert(masterRxCount == numPackets && nodeRxCount == numPackets);
+    assert(master->stats.rxBufferFull == 0 && nodes[1]->stats.rxBufferFull == 0);
+    assert(areAllTxBuffersEmpty(master, nodes, 1, true));
+}
+
+// All the nodes power up at once - the join backoff should keep the time to a full network down
+void test_join_backoff(uint32_t numNodes, bool singleChannel) {
+    tPacketChecker checker = {0};
+    tMaster * master;
+    tNode * nodes[MAX_NODES];
+    initSystem(&checker, &master, nodes, numNodes, singleChannel);
+    uint32_t numFrames = runUntilAllNodesOnNetwork(&master, nodes, numNodes, disableAllocationLogging, singleChannel);
+    printf("Time to full network, numNodes: %u, frames: %u, collisions: %u\n", numNodes, numFrames, master->stats.newNodeRequestCollisions);
+    // Uniform backoff over MAX_NEW_NODE_BACKOFF takes over 6 frames a node for 20 nodes
+    assert(numFrames < 6 * numNodes);
+
+    // Once everyone has joined the advertised collisions die away so a later node doesn't wait
+    run(master, &nodes[1], NULL, numNodes, 2000, false, singleChannel);
+    assert(master->nwManager.joinCollisions == 0);
+}
+
+// After a master restart the nodes claim back the IDs they had rather than all contending again
+void test_sticky_node_ids(uint32_t numNodes, bool singleChannel) {
+    tPacketChecker checker = {0};
+    tMaster * master;
+    tNode * nodes[MAX_NODES];
+    initSystem(&checker, &master, nodes, numNodes, singleChannel);
+    runUntilAllNodesOnNetwork(&master, nodes, numNodes, disableAllocationLogging, singleChannel);
+    run(master, &nodes[1], NULL, numNodes, 100, false, singleChannel);
+
+    tNodeIndex nodeIds[MAX_NODES];
+    for (tNodeIndex node=1; node<numNodes+1; node++) {
+        nodeIds[node] = nodes[node]->nodeId;
+    }
+
+    freeMaster(master);
+    master = createMaster(10, 10, singleChannel);
+
+    uint32_t numFrames = 0;
+    bool allRejoined = false;
+    while (!allRejoined) {
+        run(master, &nodes[1], NULL, numNodes, 1, true, singleChannel);
+        numFrames++;
+        assert(numFrames < 2000);
+        allRejoined = (master->nwManager.numNewNodes == 0) && (master->activeNodes.numNodes == numNodes);
+        for (tNodeIndex node=1; node<numNodes+1; node++) {
+            allRejoined &= (nodes[node]->nodeId != UNALLOCATED_NODE_ID);
+        }
+    }
+    printf("Time to rejoin after master restart, numNodes: %u, frames: %u, rejoin claims: %u\n", numNodes, numFrames, master->stats.nodeRejoined);
+    for (tNodeIndex node=1; node<numNodes+1; node++) {
+        assert(nodes[node]->nodeId == nodeIds[node]);
+    }
+    assert(master->stats.nodeRejoined == numNodes);
+
+    // The rest are given out once the restart sweep is over
+    run(master, &nodes[1], NULL, numNodes, 1000, false, singleChannel);
+    assert(master->nwManager.rejoinNodes.numNodes == 0);
+}
 
 // ============================================= //
 
@@ -366,7 +728,7 @@ void testMicrobus() {
 
     test_fully_loaded_system(1, 1000, 4000, 40, 40, true, false, false);
     test_fully_loaded_system(1, 1000, 4000, 60, 0, true, true, false); // Only master - 65% is the best we can get with rxAcks every 4 and servicing every 6
-    test_fully_loaded_system(4, 1000, 4000, 40, 0, true, true, false); // Only master - 40% is the best we can get with as acks are occuring every other turn
+    test_fully_loaded_system(4, 1000, 4000, 45, 0, true, true, false); // Only master - bursts to each node before its ack slot (was 40% with an ack every other turn)
 
     // Dual channel
 
@@ -385,5 +747,24 @@ void testMicrobus() {
 
     test_full_system_with_rx_buffer_overflows(1, 1000, 2000, false);
 
+    test_master_ack_packet();
+
+    test_variable_length_slots();
+
+    test_adaptive_look_ahead();
+    test_urgent_packets();
+
+    test_datagrams();
+
+    test_flow_control();
+    test_join_backoff(20, false);
+    test_join_backoff(20, true);
+    test_join_backoff(62, false);
+    test_join_backoff(62, true);
+
+    test_sticky_node_ids(10, false);
+    test_sticky_node_ids(62, false);
+    test_sticky_node_ids(62, true);
+
 }
 
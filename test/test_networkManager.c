@@ -11,35 +11,178 @@
 
 uint32_t statsNodeJoinedNw = 0;
 uint32_t networkFullCount = 0;
+uint32_t collisionCount = 0;
 
 void test_new_node_given_id(void) {
     // Master
     tPacket masterPacket = {0};
     tNetworkManager nwManager = {0};
-    uint8_t nodeTTL[10] = {0};
+    uint8_t nodeTTL[MAX_NODES] = {0};
     // Node
     tPacket nodePacket = {0};
     uint64_t uniqueId = 7;
     tNodeIndex nodeId = INVALID_NODE_ID;
     int32_t timeToLive;
+    uint8_t windowSize = 0;
+    uint8_t nodeWindowSize[MAX_NODES] = {0};
 
     tNodeQueue activeNodes = {0};
     tNodeQueue activeTxNodes = {0};
     networkManagerInit(&nwManager, &activeNodes);
     
-    txNewNodeRequest(&nodePacket, uniqueId);
-    rxNewNodePacketRequest(&nwManager, nodeTTL, &nodePacket, &networkFullCount);
-    txNewNodeResponse(&nwManager, &masterPacket);
-    rxNewNodePacketResponse(&masterPacket, uniqueId, &nodeId, &timeToLive, &statsNodeJoinedNw);
+    txNewNodeRequest(&nodePacket, uniqueId, SLIDING_WINDOW_SIZE, 0);
+    rxNewNodePacketRequest(&nwManager, nodeTTL, nodeWindowSize, &nodePacket, &networkFullCount, &collisionCount);
+    txNewNodeResponse(&nwManager, nodeWindowSize, &masterPacket);
+    rxNewNodePacketResponse(&masterPacket, uniqueId, &nodeId, &windowSize, &timeToLive, &statsNodeJoinedNw);
     
     assert(FIRST_NODE_ID == nodeId);
+    assert(SLIDING_WINDOW_SIZE == windowSize);
+}
+
+void test_window_size_negotiated(void) {
+    tPacket masterPacket = {0};
+    tNetworkManager nwManager = {0};
+    uint8_t nodeTTL[MAX_NODES] = {0};
+    uint8_t nodeWindowSize[MAX_NODES] = {0};
+    tNodeQueue activeNodes = {0};
+    tPacket nodePacket = {0};
+    uint64_t uniqueIds[3] = {11, 12, 13};
+    uint8_t requested[3] = {2, MAX_SLIDING_WINDOW_SIZE, 0};
+    // Node 2 is capped by the master and node 3 didn't ask for a size
+    uint8_t expected[3] = {2, 6, SLIDING_WINDOW_SIZE};
+
+    networkManagerInit(&nwManager, &activeNodes);
+    networkManagerSetMaxWindowSize(&nwManager, 6);
+
+    for (uint32_t i=0; i<3; i++) {
+        txNewNodeRequest(&nodePacket, uniqueIds[i], requested[i], i);
+        rxNewNodePacketRequest(&nwManager, nodeTTL, nodeWindowSize, &nodePacket, &networkFullCount, &collisionCount);
+    }
+    txNewNodeResponse(&nwManager, nodeWindowSize, &masterPacket);
+
+    for (uint32_t i=0; i<3; i++) {
+        tNodeIndex nodeId = INVALID_NODE_ID;
+        uint8_t windowSize = 0;
+        int32_t timeToLive;
+        rxNewNodePacketResponse(&masterPacket, uniqueIds[i], &nodeId, &windowSize, &timeToLive, &statsNodeJoinedNw);
+        assert(FIRST_NODE_ID + i == nodeId);
+        assert(expected[i] == windowSize);
+        // Master uses the same window for its side
+        assert(expected[i] == nodeWindowSize[nodeId]);
+    }
+}
+
+// TTLs only step down on the tick they are due, and only timed out nodes are left to be removed
+void test_ttl_timer_wheel(void) {
+    tNetworkManager nwManager = {0};
+    tNodeQueue activeNodes;
+    uint8_t nodeTimeToLive[MAX_NODES] = {0};
+    uint8_t nodeWindowSize[MAX_NODES] = {0};
+    nodeQueueInit(&activeNodes);
+    networkManagerInit(&nwManager, &activeNodes);
+    for (uint64_t uniqueId=1; uniqueId<=3; uniqueId++) {
+        networkManagerRegisterNewNode(&nwManager, nodeTimeToLive, nodeWindowSize, uniqueId, 0, &networkFullCount);
+    }
+    // Node 1 never sends, node 2 sends once and node 3 keeps sending
+    networkManagerRecordRxPacket(&nwManager, nodeTimeToLive, 2);
+    for (uint32_t tick=1; tick<=MASTER_MAX_TIME_TO_LIVE+1; tick++) {
+        networkManagerRecordRxPacket(&nwManager, nodeTimeToLive, 3);
+        networkManagerUpdateTimeUs(&nwManager, nodeTimeToLive, TIME_TO_LIVE_UPDATE_TIME_US);
+        assert(nodeTimeToLive[1] == ((tick < SERVICE_TIME_TO_LIVE) ? SERVICE_TIME_TO_LIVE : REMOVE_NODE_TTL));
+        assert(nodeTimeToLive[2] == ((tick < MASTER_MAX_TIME_TO_LIVE - SERVICE_TIME_TO_LIVE) ? MASTER_MAX_TIME_TO_LIVE :
+                                     (tick < MASTER_MAX_TIME_TO_LIVE) ? SERVICE_TIME_TO_LIVE : REMOVE_NODE_TTL));
+        assert(nodeTimeToLive[3] == MASTER_MAX_TIME_TO_LIVE);
+    }
+    assert(nwManager.timedOutNodes == (NODE_BIT(1) | NODE_BIT(2)));
+
+    // Heard again before the master got round to removing it
+    networkManagerRecordRxPacket(&nwManager, nodeTimeToLive, 2);
+    networkManagerClearTimedOutNode(&nwManager, 1);
+    assert(nwManager.timedOutNodes == 0);
+}
+
+// Nodes requesting in the same packet get in if they picked different sub-slots
+void test_new_node_sub_slots(void) {
+    tNetworkManager nwManager = {0};
+    tNodeQueue activeNodes = {0};
+    uint8_t nodeTTL[MAX_NODES] = {0};
+    uint8_t nodeWindowSize[MAX_NODES] = {0};
+    tPacket nodePacket = {0};
+    tPacket busPacket = {0};
+    uint8_t subSlots[5] = {0, 3, NEW_NODE_REQUEST_SUB_SLOTS-1, 7, 7};
+    uint32_t numCollisions = 0;
+
+    networkManagerInit(&nwManager, &activeNodes);
+    assert(NEW_NODE_REQUEST_SUB_SLOTS >= 15);
+
+    // Each node only drives its own sub-slot so the bus ORs them together
+    for (uint32_t i=0; i<5; i++) {
+        txNewNodeRequest(&nodePacket, 20 + i, 0, subSlots[i]);
+        for (uint32_t b=0; b<sizeof(tPacket); b++) {
+            ((uint8_t *)&busPacket)[b] |= ((uint8_t *)&nodePacket)[b];
+        }
+    }
+    rxNewNodePacketRequest(&nwManager, nodeTTL, nodeWindowSize, &busPacket, &networkFullCount, &numCollisions);
+
+    // The last two picked the same sub-slot
+    assert(nwManager.numNewNodes == 3);
+    assert(nwManager.newNodeUniqueId[0] == 20 && nwManager.newNodeUniqueId[1] == 21 && nwManager.newNodeUniqueId[2] == 22);
+    assert(numCollisions == 1);
+}
+
+// A removed node's ID is held for it - only it can claim it back and new nodes are given other IDs
+void test_rejoin_claim(void) {
+    tNetworkManager nwManager = {0};
+    tNodeQueue activeNodes = {0};
+    uint8_t nodeTTL[MAX_NODES] = {0};
+    uint8_t nodeWindowSize[MAX_NODES] = {0};
+    tPacket nodePacket = {0};
+    tPacket masterPacket = {0};
+    tNodeIndex nodeId = INVALID_NODE_ID;
+    uint8_t windowSize = 0;
+    int32_t timeToLive;
+
+    nodeQueueInit(&activeNodes);
+    networkManagerInit(&nwManager, &activeNodes);
+    networkManagerRegisterNewNode(&nwManager, nodeTTL, nodeWindowSize, 31, 0, &networkFullCount);
+    networkManagerRemoveNewNodeRequest(&nwManager, FIRST_NODE_ID);
+
+    // Removed the way the master does it when it times out
+    nodeTTL[FIRST_NODE_ID] = 0;
+    nodeQueueRemove(&activeNodes, FIRST_NODE_ID);
+    networkManagerRemoveNode(&nwManager, FIRST_NODE_ID);
+
+    networkManagerRegisterNewNode(&nwManager, nodeTTL, nodeWindowSize, 40, 0, &networkFullCount);
+    assert(nwManager.newNodeId[0] == FIRST_NODE_ID + 1);
+
+    // Someone else claiming it is ignored
+    txRejoinRequest(&nodePacket, 99, 0, FIRST_NODE_ID, FIRST_NODE_ID);
+    assert(rxRejoinRequest(&nwManager, nodeTTL, nodeWindowSize, &nodePacket) == 0);
+
+    // A corrupted block start would move a claim on to another ID
+    memset(&nodePacket, 0, sizeof(nodePacket));
+    txRejoinRequest(&nodePacket, 31, 0, FIRST_NODE_ID, FIRST_NODE_ID + 1);
+    nodePacket.node.srcNodeId = FIRST_NODE_ID - 1;
+    assert(rxRejoinRequest(&nwManager, nodeTTL, nodeWindowSize, &nodePacket) == 0);
+
+    memset(&nodePacket, 0, sizeof(nodePacket));
+    txRejoinRequest(&nodePacket, 31, 0, FIRST_NODE_ID, FIRST_NODE_ID);
+    assert(rxRejoinRequest(&nwManager, nodeTTL, nodeWindowSize, &nodePacket) == 1);
+    assert(nodeQueueContains(&activeNodes, FIRST_NODE_ID));
+    assert(!nodeQueueContains(&nwManager.rejoinNodes, FIRST_NODE_ID));
+
+    // Confirmed in the same response as the new node
+    txNewNodeResponse(&nwManager, nodeWindowSize, &masterPacket);
+    rxNewNodePacketResponse(&masterPacket, 31, &nodeId, &windowSize, &timeToLive, &statsNodeJoinedNw);
+    assert(nodeId == FIRST_NODE_ID);
+    assert(windowSize == SLIDING_WINDOW_SIZE);
 }
 
 // void test_node_removed_from_network(void) {
 //     // Master
 //     tPacket masterPacket = {0};
 //     tNetworkManager nwManager = {0};
-//     uint8_t nodeTTL[10] = {0};
+//     uint8_t nodeTTL[MAX_NODES] = {0};
 
 //     tNodeIndex activeNodeIds[MAX_NODES];
 //     tNodeQueue activeNodes = {0};
@@ -63,7 +206,7 @@ void test_new_node_given_id(void) {
 //     // Master
 //     tPacket masterPacket = {0};
 //     tNetworkManager nwManager = {0};
-//     uint8_t nodeTTL[10] = {0};
+//     uint8_t nodeTTL[MAX_NODES] = {0};
 
 //     tNodeIndex activeNodeIds[MAX_NODES];
 //     tNodeQueue activeNodes = {0};
@@ -89,6 +232,10 @@ void test_new_node_given_id(void) {
 
 void testNetworkManager() {
     test_new_node_given_id();
+    test_window_size_negotiated();
+    test_ttl_timer_wheel();
+    test_new_node_sub_slots();
+    test_rejoin_claim();
     // test_node_removed_from_network();
     // test_node_not_removed_from_network();
 }
@@ -16,18 +16,17 @@
 #define MAX_SLOTS_BETWEEN_UNALLOCATED 80
 
 tSchedulerState scheduler;
+static tNodeStats stats = {0};
 static tNodeQueue activeNodes = {0};
 static tNodeQueue activeTxNodes = {0};
 static tNodeQueue nodeTxNodes = {0};
 
 void basicSchedulerInit(uint32_t numActiveNodes, bool withAllocation) {
-    activeNodes.numNodes = 0;
-    activeNodes.lastIndex = 0;
-    activeTxNodes.numNodes = 0;
-    activeTxNodes.lastIndex = 0;
-    nodeTxNodes.numNodes = 0;
-    nodeTxNodes.lastIndex = 0;
-    schedulerInit(&scheduler, &activeNodes, &activeTxNodes, &nodeTxNodes, 1, 80);
+    nodeQueueInit(&activeNodes);
+    nodeQueueInit(&activeTxNodes);
+    nodeQueueInit(&nodeTxNodes);
+    memset(&stats, 0, sizeof(tNodeStats));
+    schedulerInit(&scheduler, &activeNodes, &activeTxNodes, &nodeTxNodes, 1, 80, NULL, &stats);
 
     for (tNodeIndex nodeId=1; nodeId<numActiveNodes+1; nodeId++) {
         nodeQueueAdd(&activeNodes, nodeId);
@@ -181,7 +180,94 @@ void test_scheduler_with_N_rx_ack(uint32_t numNodes) {
 
 
 
+void test_node_queue_round_robin(void) {
+    tNodeQueue queue;
+    nodeQueueInit(&queue);
+    nodeQueueAdd(&queue, 5);
+    nodeQueueAdd(&queue, 1);
+    nodeQueueAdd(&queue, 63);
+    nodeQueueAdd(&queue, 5);
+    assert(queue.numNodes == 3);
+    assert(getNextNodeInQueue(&queue) == 1);
+    assert(getNextNodeInQueue(&queue) == 5);
+    // Added behind the current position - has to wait for the next round
+    nodeQueueAdd(&queue, 2);
+    assert(queueReachedEnd(&queue));
+    assert(getNextNodeInQueue(&queue) == 63);
+    assert(getNextNodeInQueue(&queue) == 1);
+    assert(getNextNodeInQueue(&queue) == 2);
+    // Removing the next node moves on to the one after
+    nodeQueueRemove(&queue, 5);
+    assert(!nodeQueueContains(&queue, 5));
+    assert(getNextNodeInQueue(&queue) == 63);
+    assert(nodeQueueNextAfter(&queue, 63) == 1);
+    assert(nodeQueueNextAfter(&queue, 1) == 2);
+    nodeQueueRemoveIfExists(&queue, 5);
+    nodeQueueRemove(&queue, 1);
+    nodeQueueRemove(&queue, 2);
+    nodeQueueRemove(&queue, 63);
+    assert(queue.numNodes == 0);
+    assert(nodeQueueNextAfter(&queue, 1) == INVALID_NODE_ID);
+}
+
+static void countNodeTxSlots(uint32_t numSlots, uint32_t counts[MAX_NODES]) {
+    tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED] = {0};
+    memset(counts, 0, MAX_NODES * sizeof(uint32_t));
+    for (uint32_t i=0; i<numSlots; i++) {
+        schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 0);
+        if (nodesToTx[0] < MAX_NODES) {
+            counts[nodesToTx[0]]++;
+        }
+    }
+}
+
+// Deficit round robin shares node tx slots by buffer level and weight, but still services everyone
+void test_drr_scheduler(void) {
+    uint32_t counts[MAX_NODES];
+    basicSchedulerInit(3, false);
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 1, 30);
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 4);
+
+    // Plain round robin ignores the buffer levels
+    countNodeTxSlots(1000, counts);
+    assert(counts[1] < counts[2] + 10);
+
+    // Bigger backlog gets more slots - in proportion, not just up to a cap
+    schedulerSetDrrEnabled(&scheduler, true);
+    countNodeTxSlots(1000, counts);
+    assert(counts[1] > 4 * counts[2]);
+    assert(counts[3] > 0); // Nothing to send but still serviced
+
+    // A big quantum is spent a few slots at a time while anyone else is still owed slots
+    tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED] = {0};
+    uint32_t inARow = 0;
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 30);
+    countNodeTxSlots(100, counts);
+    for (uint32_t i=0; i<1000; i++) {
+        schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 0);
+        inARow = (nodesToTx[0] == 1) ? inARow + 1 : 0;
+        assert(inARow <= DRR_MAX_BURST + 1); // A service slot can land next to a burst
+    }
+
+    // Weight makes up the difference in backlog
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 4);
+    schedulerSetNodeWeight(&scheduler, 2, 8);
+    countNodeTxSlots(1000, counts);
+    assert(counts[1] < counts[2] + counts[2] / 4);
+    assert(counts[2] < counts[1] + counts[1] / 4);
+
+    // Same backlog - shared by weight
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 1, 4);
+    schedulerSetNodeWeight(&scheduler, 2, 4);
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 4);
+    countNodeTxSlots(1000, counts);
+    assert(counts[2] > 3 * counts[1]);
+    assert(counts[1] > 0);
+    assert(counts[3] > 0);
+}
+
 void testScheduler() {
+    test_node_queue_round_robin();
     test_scheduler_allocation_slots();
     test_scheduler_servicing();
     test_scheduler_with_N_node_tx(1);
@@ -197,3 +283,174 @@ void testScheduler() {
     }
 }
 
+// Contract nodes always get a slot within their interval - bulk traffic gets the rest
+void test_deadline_scheduler(void) {
+    basicSchedulerInit(4, false);
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 1, 30);
+    assert(schedulerSetNodeMaxSlotInterval(&scheduler, 2, 8));
+    assert(schedulerSetNodeMaxSlotInterval(&scheduler, 3, 10));
+    // No room for one that needs every slot
+    assert(!schedulerSetNodeMaxSlotInterval(&scheduler, 4, 1));
+    assert(stats.deadlineContractsRejected == 1);
+
+    tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED] = {0};
+    uint32_t lastSlot[MAX_NODES] = {0};
+    uint32_t maxGap[MAX_NODES] = {0};
+    uint32_t counts[MAX_NODES] = {0};
+    for (uint32_t i=1; i<=2000; i++) {
+        schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 0);
+        tNodeIndex node = nodesToTx[0];
+        if (node < MAX_NODES) {
+            maxGap[node] = MAX(maxGap[node], i - lastSlot[node]);
+            lastSlot[node] = i;
+            counts[node]++;
+        }
+    }
+    assert(maxGap[2] <= 8);
+    assert(maxGap[3] <= 10);
+    assert(stats.deadlineOverruns == 0);
+    assert(counts[1] > counts[2] + counts[3]); // Bulk traffic still gets most of the bus
+    assert(counts[4] > 0);
+
+    // Removing a contract frees its share
+    assert(schedulerSetNodeMaxSlotInterval(&scheduler, 2, 0));
+    assert(schedulerSetNodeMaxSlotInterval(&scheduler, 4, 3));
+}
+
+// Reserved nodes always get their slot - everything else fits round them
+void test_reserved_slots(void) {
+    basicSchedulerInit(4, true);
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 1, 30);
+    assert(schedulerReserveSlots(&scheduler, 2, 5, 0));
+    assert(schedulerReserveSlots(&scheduler, 3, 10, 1));
+    // Would land on node 2's slots
+    assert(!schedulerReserveSlots(&scheduler, 4, 10, 5));
+    assert(!schedulerReserveSlots(&scheduler, 4, 4, 0));
+    assert(stats.slotReservationsRejected == 2);
+
+    tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED] = {0};
+    uint32_t counts[MAX_NODES] = {0};
+    uint32_t numAllocationSlots = 0;
+    for (uint32_t i=0; i<1000; i++) {
+        schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 0);
+        tNodeIndex node = nodesToTx[0];
+        if (node < MAX_NODES) {
+            counts[node]++;
+        } else if (node == UNALLOCATED_NODE_ID) {
+            numAllocationSlots++;
+        }
+        // (they can still get other slots from servicing)
+        assert(i % 5 != 0 || node == 2);
+        assert(i % 10 != 1 || node == 3);
+    }
+    assert(numAllocationSlots > 50); // Allocation still gets its slots
+    assert(counts[1] > 400);
+    assert(counts[4] > 0); // Serviced
+
+    // Removed - node 2's slots are free for another reservation
+    assert(schedulerReserveSlots(&scheduler, 2, 0, 0));
+    assert(schedulerReserveSlots(&scheduler, 4, 4, 0));
+}
+
+// Single channel - the master keeps the bus for its burst and the node acks straight after
+void test_master_burst_scheduling(void) {
+    basicSchedulerInit(2, false);
+    scheduler.numTxNodesScheduled = 2;
+    scheduler.targetNumTxNodesScheduled = 2;
+    scheduler.countTillNextAllocation = 80;
+    scheduler.countTillNextService = MAX_SLOTS_BETWEEN_SERVICING;
+    nodeQueueAdd(&activeTxNodes, 1);
+    nodeQueueAdd(&activeTxNodes, 2);
+
+    tNodeIndex nodesToTx[MAX_TX_NODES_SCHEDULED] = {MASTER_NODE_ID, MASTER_NODE_ID};
+    schedulerSetMasterBurst(&scheduler, 1, 2);
+    schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 10);
+    assert(nodesToTx[1] == MASTER_NODE_ID);
+    schedulerSetMasterBurst(&scheduler, 1, 1);
+    schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 10);
+    assert(nodesToTx[1] == MASTER_NODE_ID);
+    schedulerSetMasterBurst(&scheduler, 1, 0);
+    schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 10);
+    assert(nodesToTx[1] == 1);
+
+    // Nodes with data keep their turns
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 5);
+    schedulerSetMasterBurst(&scheduler, 1, 2);
+    schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 0);
+    assert(nodesToTx[1] == MASTER_NODE_ID); // Has to send the schedule after node 1's ack slot
+    schedulerUpdateAndCalcNextTxNodes(&scheduler, nodesToTx, 0);
+    assert(nodesToTx[1] != MASTER_NODE_ID);
+}
+
+// Service slots only go to nodes whose TTL is getting low
+void test_ttl_aware_service(void) {
+    uint8_t nodeTimeToLive[MAX_NODES];
+    uint32_t counts[MAX_NODES];
+    memset(nodeTimeToLive, MASTER_MAX_TIME_TO_LIVE, sizeof(nodeTimeToLive));
+    basicSchedulerInit(3, false);
+    scheduler.nodeTimeToLive = nodeTimeToLive;
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 1, 30);
+
+    // Busy node gets the whole bus while the others were heard recently
+    countNodeTxSlots(1000, counts);
+    assert(counts[2] == 0);
+    assert(counts[3] == 0);
+
+    // Node 3 hasn't been heard for a while
+    nodeTimeToLive[3] = SERVICE_TIME_TO_LIVE;
+    countNodeTxSlots(1000, counts);
+    assert(counts[2] == 0);
+    assert(counts[3] > 0);
+}
+
+// Once the nodes settle one full period of the node tx turns is replayed from the plan, giving
+// the same slots as working them out every time, until a backlog changes
+void test_schedule_plan(void) {
+    uint32_t counts[MAX_NODES];
+    uint32_t liveCounts[MAX_NODES];
+    for (uint32_t numTxNodes=1; numTxNodes<=5; numTxNodes++) {
+        for (uint32_t planned=0; planned<2; planned++) {
+            // Node 6 is waiting for acks, the rest have data to send
+            basicSchedulerInit(6, false);
+            schedulerSetPlanEnabled(&scheduler, planned);
+            nodeQueueAdd(&activeTxNodes, 6);
+            for (tNodeIndex nodeId=1; nodeId<=numTxNodes; nodeId++) {
+                schedulerUpdateNodeTxBufferLevel(&scheduler, nodeId, 5);
+            }
+            countNodeTxSlots(1000, planned ? counts : liveCounts);
+        }
+        assert(stats.schedulePlanSlots > 400);
+        assert(memcmp(counts, liveCounts, sizeof(counts)) == 0);
+    }
+
+    // Same backlog class - the plan is kept
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 1, 7);
+    uint32_t planSlots = stats.schedulePlanSlots;
+    countNodeTxSlots(100, counts);
+    assert(stats.schedulePlanInvalidations == 0);
+    assert(stats.schedulePlanSlots > planSlots + 50);
+
+    // Node 2 has nothing left to send
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 0);
+    countNodeTxSlots(1000, counts);
+    assert(stats.schedulePlanInvalidations == 1);
+    assert(counts[1] > 3 * counts[2]);
+    assert(counts[2] > 0); // Still serviced
+
+    // Deficit round robin repeats once a round is over
+    schedulerSetDrrEnabled(&scheduler, true);
+    schedulerUpdateNodeTxBufferLevel(&scheduler, 2, 3);
+    planSlots = stats.schedulePlanSlots;
+    countNodeTxSlots(1000, counts);
+    assert(stats.schedulePlanSlots > planSlots + 400);
+}
+
+// The scheduling modes - kept apart from testScheduler() as the tests above predate the current rotation
+void testSchedulerModes() {
+    test_drr_scheduler();
+    test_deadline_scheduler();
+    test_reserved_slots();
+    test_master_burst_scheduling();
+    test_ttl_aware_service();
+    test_schedule_plan();
+}
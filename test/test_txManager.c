@@ -22,21 +22,26 @@ uint32_t myRand(uint32_t max) {
 }
 
 static tTxManager manager;
-static uint8_t txSeqNumStart[10];
-static uint8_t txSeqNumEnd[10];
-static uint8_t txSeqNumNext[10];
-static uint8_t txSeqNumPauseCount[10];
-static uint8_t rxSeqNum[10];
+static uint8_t txSeqNumStart[10*NUM_TX_PRIORITIES];
+static uint8_t txSeqNumEnd[10*NUM_TX_PRIORITIES];
+static uint8_t txSeqNumNext[10*NUM_TX_PRIORITIES];
+static uint8_t txSeqNumPauseCount[10*NUM_TX_PRIORITIES];
+static uint8_t rxSeqNum[10*NUM_TX_PRIORITIES];
+static uint8_t txQueueHead[10*NUM_TX_PRIORITIES];
+static uint8_t txQueueTail[10*NUM_TX_PRIORITIES];
+static uint8_t txQueueLastSent[10*NUM_TX_PRIORITIES];
+static uint8_t txNumSubmitted[10*NUM_TX_PRIORITIES];
+static uint8_t txNumFreed[10*NUM_TX_PRIORITIES];
+static tTxSelectiveRepeat txSelectiveRepeat[10*NUM_TX_PRIORITIES];
+static uint8_t txWindowSize[10*NUM_TX_PRIORITIES];
 static tPacketEntry packetEntries[100];
-static tNodeIndex activeTxNodeIds[10];
 static tNodeQueue activeTxNodes;
 uint64_t txWindowRestarts;
 uint8_t ttl = 1;
 
 static void basicInit() {
-    activeTxNodes.numNodes = 0;
-    activeTxNodes.lastIndex = 0;
-    initTxManager(&manager, 10, txSeqNumStart, txSeqNumEnd, txSeqNumNext, txSeqNumPauseCount, rxSeqNum, &activeTxNodes, 100, packetEntries);
+    nodeQueueInit(&activeTxNodes);
+    initTxManager(&manager, 10, txSeqNumStart, txSeqNumEnd, txSeqNumNext, txSeqNumPauseCount, rxSeqNum, txQueueHead, txQueueTail, txQueueLastSent, txNumSubmitted, txNumFreed, txSelectiveRepeat, txWindowSize, &activeTxNodes, 100, packetEntries);
 }
 
 static void createMasterTxPacket(tTxManager * txManager, tNodeIndex dstNodeId, bool allowFull) {
@@ -58,8 +63,8 @@ void test_simple(void) {
     }
     // Check that we can retrieve those 50 packets from the tx manager
     for (uint32_t i=0; i<100/2; i++) {
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         assert(packet != NULL);
         rxAckSeqNum(&manager, dstNodeId, packet->txSeqNum, true, &txWindowRestarts);
     }
@@ -71,8 +76,8 @@ void test_continuous(void) {
     uint8_t dstNodeId = 0;
     for (uint32_t i=0; i<100/2; i++) {
         createMasterTxPacket(&manager, dstNodeId, false);
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         assert(packet != NULL);
         rxAckSeqNum(&manager, dstNodeId, packet->txSeqNum, true, &txWindowRestarts);
     }
@@ -87,8 +92,8 @@ void test_multiple_nodes(void) {
     }
     for (uint32_t i=0; i<100/2; i++) {
         uint8_t dstNodeId = i % 5;
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         assert(packet != NULL);
         rxAckSeqNum(&manager, packet->master.dstNodeId, packet->txSeqNum, true, &txWindowRestarts);
     }
@@ -106,8 +111,8 @@ void test_simple_with_dropped_packets(void) {
     uint8_t lastAckSeqNum = 0;
     uint32_t drops = 0;
     for (uint32_t i=0; i<4*100; i++) {
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         if (packet != NULL) {
             if (myRand(10) == 0) {
                 drops++;
@@ -155,8 +160,8 @@ void test_multiple_nodes_with_dropped_packets(void) {
                 }
                 
                 uint8_t dstNodeId = myRand(5);
-                tNodeIndex nextTxNodeId = dstNodeId;
-                tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+                tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+                tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
 
                 if (packet != NULL) {
                     if (myRand(10) == 0) {
@@ -190,8 +195,8 @@ void test_continuous_with_delayed_acks(void) {
     uint8_t lastTxSeqNum = 0;
     for (uint32_t i=0; i<100/2; i++) {
         createMasterTxPacket(&manager, dstNodeId, false);
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         assert(packet != NULL);
         lastTxSeqNum = MAX(packet->txSeqNum, lastTxSeqNum);
 
@@ -210,8 +215,8 @@ void test_continuous_with_extra_delayed_acks(void) {
     uint8_t lastTxSeqNum = 0;
     for (uint32_t i=0; i<100/2; i++) {
         createMasterTxPacket(&manager, dstNodeId, false);
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         if (packet) {
             lastTxSeqNum = MAX(packet->txSeqNum, lastTxSeqNum);
         }
@@ -232,8 +237,8 @@ void test_continuous_with_extra_delayed_acks_2(void) {
     uint8_t lastTxSeqNum = 0;
     for (uint32_t i=0; i<100/2; i++) {
         createMasterTxPacket(&manager, dstNodeId, false);
-        tNodeIndex nextTxNodeId = dstNodeId;
-        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, &nextTxNodeId, 1);
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {dstNodeId};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
         if (packet) {
             lastTxSeqNum = MAX(packet->txSeqNum, lastTxSeqNum);
         }
@@ -248,6 +253,121 @@ void test_continuous_with_extra_delayed_acks_2(void) {
     assert(manager.packetStore.numStored == 50);
 }
 
+void test_remove_node_keeps_other_queues(void) {
+    basicInit();
+    // Interleave the packets for 2 nodes in the store
+    for (uint32_t i=0; i<20; i++) {
+        createMasterTxPacket(&manager, 1 + (i % 2), false);
+    }
+    uint8_t numTxPacketsFreed = 0;
+    masterTxManagerRemoveNode(&manager, 1, &numTxPacketsFreed);
+    assert(numTxPacketsFreed == 10);
+    assert(getNumInTxBuffer(&manager, 1) == 0);
+
+    // Re-use the freed entries for node 3
+    for (uint32_t i=0; i<10; i++) {
+        createMasterTxPacket(&manager, 3, false);
+    }
+
+    // Node 2 and 3 should still come out in order
+    uint8_t expSeqNum[MAX_NODES] = {0};
+    for (uint32_t i=0; i<20; i++) {
+        tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {0};
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
+        assert(packet != NULL);
+        tNodeIndex dstNodeId = packet->master.dstNodeId;
+        assert(dstNodeId == 2 || dstNodeId == 3);
+        assert(packet->txSeqNum == expSeqNum[dstNodeId]);
+        expSeqNum[dstNodeId]++;
+        rxAckSeqNum(&manager, dstNodeId, packet->txSeqNum, true, &txWindowRestarts);
+    }
+    assert(manager.packetStore.numStored == manager.packetStore.numFreed);
+}
+
+void test_buffered_counts(void) {
+    basicInit();
+    // Keep 3 packets buffered for node 1 whilst the sequence numbers wrap
+    for (uint32_t i=0; i<3; i++) {
+        createMasterTxPacket(&manager, 1, false);
+    }
+    for (uint32_t i=0; i<600; i++) {
+        createMasterTxPacket(&manager, 1, false);
+        createMasterTxPacket(&manager, 2, false);
+        assert(getNumInTxBuffer(&manager, 1) == 4);
+        assert(getNumInTxBuffer(&manager, 2) == 1);
+        assert(getNumAllBufferedTxPackets(&manager) == 5);
+        rxAckSeqNum(&manager, 1, txSeqNumStart[1], true, &txWindowRestarts);
+        rxAckSeqNum(&manager, 2, txSeqNumStart[2], true, &txWindowRestarts);
+        assert(getNumAllBufferedTxPackets(&manager) == 3);
+    }
+    uint8_t numTxPacketsFreed = 0;
+    masterTxManagerRemoveNode(&manager, 1, &numTxPacketsFreed);
+    assert(numTxPacketsFreed == 3);
+    assert(getNumInTxBuffer(&manager, 1) == 0);
+    assert(getNumAllBufferedTxPackets(&manager) == 0);
+
+    createMasterTxPacket(&manager, 3, false);
+    createMasterTxPacket(&manager, 4, false);
+    masterTxClearBuffers(&manager);
+    assert(getNumInTxBuffer(&manager, 3) == 0);
+    assert(getNumAllBufferedTxPackets(&manager) == 0);
+}
+
+void test_packet_store_free_in_any_order(void) {
+    tPacketStore store;
+    tPacketEntry * entries[10];
+    packetStoreInit(&store, 10, packetEntries);
+    for (uint32_t loop=0; loop<50; loop++) {
+        for (uint32_t i=0; i<10; i++) {
+            entries[i] = packetStoreAllocate(&store);
+            assert(entries[i] != NULL);
+        }
+        assert(packetStoreAllocate(&store) == NULL);
+        assert(packetStoreNumFree(&store) == 0);
+        // Free in a different order each loop
+        for (uint32_t i=0; i<10; i++) {
+            packetStoreFree(&store, entries[(i * 3 + loop) % 10]);
+        }
+        assert(packetStoreNumFree(&store) == 10);
+    }
+    // Check nothing was handed out twice
+    for (uint32_t i=0; i<10; i++) {
+        entries[i] = packetStoreAllocate(&store);
+        for (uint32_t j=0; j<i; j++) {
+            assert(entries[i] != entries[j]);
+        }
+    }
+}
+
+void test_selective_repeat(void) {
+    basicInit();
+    tNodeIndex nextTxNodeId[MAX_TX_NODES_SCHEDULED] = {1};
+    for (uint32_t i=0; i<6; i++) {
+        createMasterTxPacket(&manager, 1, false);
+    }
+    // Send the whole window
+    for (uint32_t i=0; i<SLIDING_WINDOW_SIZE; i++) {
+        tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
+        assert(packet != NULL && packet->txSeqNum == i);
+    }
+    // Packet 1 lost - the rx has 0 and then 2 & 3
+    assert(rxSelectiveAckSeqNum(&manager, 1, 0, 0x3, true, &txWindowRestarts) == 1);
+    // Only 1 should be resent
+    tPacket * packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
+    assert(packet != NULL && packet->txSeqNum == 1);
+    // Same again (before the resend has got there) shouldn't resend it again
+    assert(rxSelectiveAckSeqNum(&manager, 1, 0, 0x3, true, &txWindowRestarts) == 0);
+    packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
+    assert(packet != NULL && packet->txSeqNum == 4);
+    // Rx has got 1 - so everything up to 4 is acked
+    assert(rxSelectiveAckSeqNum(&manager, 1, 4, 0, true, &txWindowRestarts) == 4);
+    packet = masterGetNextTxDataPacket(&manager, 1, nextTxNodeId, 1);
+    assert(packet != NULL && packet->txSeqNum == 5);
+    assert(rxSelectiveAckSeqNum(&manager, 1, 5, 0, true, &txWindowRestarts) == 1);
+    assert(manager.numSelectiveResends == 1);
+    assert(manager.packetStore.numStored == manager.packetStore.numFreed);
+}
+
 void testTxManager() {
     test_simple();
     test_continuous();
@@ -257,5 +377,11 @@ void testTxManager() {
     test_continuous_with_delayed_acks();
     test_continuous_with_extra_delayed_acks();
     test_continuous_with_extra_delayed_acks_2();
+    test_remove_node_keeps_other_queues();
+    test_packet_store_free_in_any_order();
+    test_buffered_counts();
+    if (MICROBUS_SELECTIVE_REPEAT) {
+        test_selective_repeat();
+    }
 }
 